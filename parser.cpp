@@ -8,330 +8,2362 @@
 #include <regex>
 #include <algorithm>
 #include <cctype>
+#include <string_view>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <iterator>
+#include <filesystem>
+#include <glob.h>
+#include <cstdint>
+#include <climits>
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <deque>
+#include <map>
+#include <chrono>
+#include <csignal>
 
-// Token types
-enum TokenType {
-    KEYWORD,
-    IDENTIFIER,
-    LITERAL,
-    OPERATOR,
-    SYMBOL,
-    COMMENT,
-    STRING_LITERAL,
-    END_OF_FILE
+#include "plpgsql_internal.h"
+
+using namespace plpgsql;
+
+// Catalog snapshots: the merged symbols of a run in a flat binary file that is mapped
+// and read in place. After the header come the sections below, in this order, followed
+// by the string pool; all records are fixed-size and in host byte order.
+const char snapshotMagic[8] = {'P', 'L', 'P', 'G', 'S', 'N', 'A', 'P'};
+const uint32_t snapshotFormatVersion = 1;
+const uint32_t snapshotFile = UINT32_MAX; // FunctionSignature::file of snapshot symbols
+
+struct SnapshotString {
+    uint32_t offset; // Into the string pool
+    uint32_t length;
 };
 
-// Token structure
-struct Token {
-    TokenType type;
-    std::string value;
-    int line;
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t formatVersion;
+    uint32_t catalogVersion; // PG_CATALOG_VERSION the snapshot was written with
+    uint64_t sourceHash;     // Combined content hash of all source files
+    uint32_t sourceCount;
+    uint32_t typeCount;
+    uint32_t functionCount;
+    uint32_t argumentCount;
+    uint32_t tableCount;
+    uint32_t columnCount;
+    uint32_t stringBytes;
+    uint32_t reserved;
 };
 
-// Function signature structure
-struct FunctionSignature {
-    std::string name;
-    std::vector<std::string> argumentTypes;
-    int line; // Line where the function is defined or first called
+struct SnapshotSource {
+    uint64_t size;
+    int64_t modified;
+    uint64_t contentHash;
+    SnapshotString path;
 };
 
-// Set of keywords
-const std::set<std::string> keywords = {
-    "select", "insert", "update", "delete", "create", "table", "begin", "end", "declare", "do", "values"
+struct SnapshotType {
+    SnapshotString name;
+    uint32_t userDefined; // Defined by CREATE TYPE/DOMAIN rather than only referenced
+    int32_t line;
+    uint32_t file;
 };
 
-// Preprocessor map to store substitutions
-std::unordered_map<std::string, std::string> preprocessorMap;
+struct SnapshotFunction {
+    SnapshotString name;
+    int32_t line;
+    uint32_t file;
+    uint32_t firstArgument; // Into the argument section, which holds type indices
+    uint32_t argumentCount;
+    uint32_t requiredArguments;
+    uint32_t variadic;
+};
 
-// Lexer class
-class Lexer {
-private:
-    std::string input;
-    size_t position = 0;
-    int line = 1;
+struct SnapshotTable {
+    SnapshotString name;
+    int32_t line;
+    uint32_t file;
+    uint32_t firstColumn;
+    uint32_t columnCount;
+};
+
+struct SnapshotColumn {
+    SnapshotString name;
+    uint32_t type; // Index into the type section
+};
+
+int64_t modificationTime(const std::string &path) {
+    std::error_code error;
+    auto time = std::filesystem::last_write_time(path, error);
+    return error ? 0 : static_cast<int64_t>(time.time_since_epoch().count());
+}
+
+std::string canonicalPath(const std::string &path) {
+    std::error_code error;
+    auto absolute = std::filesystem::absolute(path, error);
+    return error ? path : absolute.lexically_normal().string();
+}
+
+Status writeSnapshot(const std::string &filename, SymbolTable &symbols, const std::vector<ParsedFile> &files) {
+    std::string strings;
+    auto addString = [&](const std::string &value) {
+        SnapshotString reference{static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(value.size())};
+        strings += value;
+        return reference;
+    };
 
-    char peek() {
-        return position < input.length() ? input[position] : '\0';
+    std::vector<SnapshotSource> sources;
+    uint64_t sourceHash = hashBytes("");
+    for (const auto &file : files) {
+        sources.push_back({file.size, file.modified, file.contentHash, addString(canonicalPath(file.path))});
+        sourceHash = hashValue(file.contentHash, sourceHash);
     }
 
-    char advance() {
-        char current = peek();
-        position++;
-        if (current == '\n') line++;
-        return current;
+    std::vector<SnapshotType> types;
+    std::unordered_map<TypeId, uint32_t> typeIndex;
+    auto addType = [&](TypeId id) {
+        auto entry = typeIndex.emplace(id, static_cast<uint32_t>(types.size()));
+        if (entry.second) types.push_back({addString(typeTable().name(id)), 0, 0, 0});
+        return entry.first->second;
+    };
+    for (const auto &type : symbols.types) {
+        SnapshotType &record = types[addType(typeTable().intern(lowercase(type.name)))];
+        record = {record.name, 1, type.line, type.file};
+    }
+
+    std::vector<SnapshotFunction> functions;
+    std::vector<uint32_t> arguments;
+    for (const auto &signature : symbols.functions.signatures()) {
+        if (signature.file == snapshotFile) continue;
+        functions.push_back({addString(signature.name), signature.line, signature.file,
+                             static_cast<uint32_t>(arguments.size()),
+                             static_cast<uint32_t>(signature.argumentTypes.size()),
+                             static_cast<uint32_t>(signature.requiredArguments), signature.variadic});
+        for (TypeId type : signature.argumentTypes) arguments.push_back(addType(type));
+    }
+
+    std::vector<SnapshotTable> tables;
+    std::vector<SnapshotColumn> columns;
+    for (const auto &table : symbols.tables) {
+        if (table.file == snapshotFile) continue;
+        tables.push_back({addString(table.name), table.line, table.file, static_cast<uint32_t>(columns.size()),
+                          static_cast<uint32_t>(table.columns.size())});
+        for (const auto &column : table.columns) columns.push_back({addString(column.name), addType(column.type)});
+    }
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+    header.formatVersion = snapshotFormatVersion;
+    header.catalogVersion = builtinCatalogVersion;
+    header.sourceHash = sourceHash;
+    header.sourceCount = static_cast<uint32_t>(sources.size());
+    header.typeCount = static_cast<uint32_t>(types.size());
+    header.functionCount = static_cast<uint32_t>(functions.size());
+    header.argumentCount = static_cast<uint32_t>(arguments.size());
+    header.tableCount = static_cast<uint32_t>(tables.size());
+    header.columnCount = static_cast<uint32_t>(columns.size());
+    header.stringBytes = static_cast<uint32_t>(strings.size());
+
+    OutputBuffer content;
+    auto writeSection = [&](const auto &records) {
+        content.append(std::string_view(reinterpret_cast<const char *>(records.data()),
+                                        records.size() * sizeof(records[0])));
+    };
+    content.append(std::string_view(reinterpret_cast<const char *>(&header), sizeof(header)));
+    writeSection(sources);
+    writeSection(types);
+    writeSection(functions);
+    writeSection(arguments);
+    writeSection(tables);
+    writeSection(columns);
+    content.append(strings);
+    // A reader never sees a snapshot half written, and a failed write keeps the old one
+    return replaceFile(filename, content);
+}
+
+// Adds the symbols of a snapshot to symbols, after the symbols parsed in this run so local
+// definitions win. Symbols from files that are part of this run are skipped, and source
+// files changed since the snapshot was written are reported as stale. Every record is
+// checked before any is used, so a corrupt snapshot adds nothing.
+Status loadSnapshot(const std::string &filename, SymbolTable &symbols, const std::vector<ParsedFile> &files) {
+    auto failure = [&](const std::string &reason) {
+        return Status::failure("Cannot load snapshot " + filename + ": " + reason);
+    };
+    int descriptor = open(filename.c_str(), O_RDONLY);
+    if (descriptor < 0) return failure("cannot open file");
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || static_cast<size_t>(status.st_size) < sizeof(SnapshotHeader)) {
+        close(descriptor);
+        return failure("file is truncated");
+    }
+    size_t mappedSize = static_cast<size_t>(status.st_size);
+    void *mapping = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (mapping == MAP_FAILED) return failure("cannot map file");
+    std::unique_ptr<void, std::function<void(void *)>> unmap(mapping, [&](void *data) { munmap(data, mappedSize); });
+    const char *data = static_cast<const char *>(mapping);
+
+    const auto *header = reinterpret_cast<const SnapshotHeader *>(data);
+    if (std::memcmp(header->magic, snapshotMagic, sizeof(snapshotMagic)) != 0) return failure("not a snapshot file");
+    if (header->formatVersion != snapshotFormatVersion) return failure("unsupported snapshot format version");
+    if (header->catalogVersion != builtinCatalogVersion) return failure("written for another PostgreSQL version");
+
+    uint64_t offset = sizeof(SnapshotHeader);
+    auto section = [&](auto *&records, uint32_t count) {
+        // Past the end of the file the records are never read, since the size check fails
+        const char *at = data + std::min<uint64_t>(offset, mappedSize);
+        records = reinterpret_cast<std::remove_reference_t<decltype(records)>>(at);
+        offset += static_cast<uint64_t>(count) * sizeof(*records);
+    };
+    const SnapshotSource *sources;
+    const SnapshotType *types;
+    const SnapshotFunction *functions;
+    const uint32_t *arguments;
+    const SnapshotTable *tables;
+    const SnapshotColumn *columns;
+    section(sources, header->sourceCount);
+    section(types, header->typeCount);
+    section(functions, header->functionCount);
+    section(arguments, header->argumentCount);
+    section(tables, header->tableCount);
+    section(columns, header->columnCount);
+    if (offset + header->stringBytes != mappedSize) return failure("file size does not match its header");
+    const char *strings = data + offset;
+
+    auto validString = [&](SnapshotString reference) {
+        return static_cast<uint64_t>(reference.offset) + reference.length <= header->stringBytes;
+    };
+    for (uint32_t i = 0; i < header->sourceCount; ++i) {
+        if (!validString(sources[i].path)) return failure("corrupt string");
     }
+    for (uint32_t i = 0; i < header->typeCount; ++i) {
+        if (!validString(types[i].name)) return failure("corrupt string");
+    }
+    for (uint32_t i = 0; i < header->argumentCount; ++i) {
+        if (arguments[i] >= header->typeCount) return failure("corrupt type reference");
+    }
+    for (uint32_t i = 0; i < header->functionCount; ++i) {
+        const SnapshotFunction &function = functions[i];
+        if (!validString(function.name)) return failure("corrupt string");
+        if (static_cast<uint64_t>(function.firstArgument) + function.argumentCount > header->argumentCount) {
+            return failure("corrupt argument list");
+        }
+        // A variadic function takes its last parameter any number of times, so it has one
+        if (function.requiredArguments > function.argumentCount ||
+            (function.variadic != 0 && function.argumentCount == 0)) {
+            return failure("corrupt function signature");
+        }
+    }
+    for (uint32_t i = 0; i < header->columnCount; ++i) {
+        if (!validString(columns[i].name)) return failure("corrupt string");
+        if (columns[i].type >= header->typeCount) return failure("corrupt type reference");
+    }
+    for (uint32_t i = 0; i < header->tableCount; ++i) {
+        if (!validString(tables[i].name)) return failure("corrupt string");
+        if (static_cast<uint64_t>(tables[i].firstColumn) + tables[i].columnCount > header->columnCount) {
+            return failure("corrupt column list");
+        }
+    }
+    auto text = [&](SnapshotString reference) { return std::string(strings + reference.offset, reference.length); };
 
-    void skipWhitespace() {
-        while (isspace(peek())) advance();
+    std::set<std::string> localPaths;
+    for (const auto &file : files) localPaths.insert(canonicalPath(file.path));
+    std::vector<bool> skipSource(header->sourceCount);
+    size_t staleCount = 0;
+    for (uint32_t i = 0; i < header->sourceCount; ++i) {
+        std::string path = text(sources[i].path);
+        skipSource[i] = localPaths.count(path) > 0;
+        if (skipSource[i]) continue;
+        std::error_code error;
+        uint64_t size = std::filesystem::file_size(path, error);
+        if (!error && size == sources[i].size && modificationTime(path) == sources[i].modified) continue;
+        std::ifstream source(path, std::ios::binary);
+        std::ostringstream content;
+        content << source.rdbuf();
+        if (error || !source.is_open() || hashBytes(content.str()) != sources[i].contentHash) staleCount++;
+    }
+    if (staleCount > 0) {
+        std::cerr << "Warning: Snapshot " << filename << " is stale: " << staleCount << " of "
+                  << header->sourceCount << " source files changed since it was written\n";
     }
+    auto skipped = [&](uint32_t file) { return file < header->sourceCount && skipSource[file]; };
 
-    Token handleIdentifierOrKeyword() {
-        std::string value;
-        while (isalnum(peek()) || peek() == '_') {
-            value += advance();
+    std::vector<TypeId> typeIds;
+    for (uint32_t i = 0; i < header->typeCount; ++i) {
+        typeIds.push_back(typeTable().intern(text(types[i].name)));
+        if (types[i].userDefined && !skipped(types[i].file)) {
+            symbols.types.push_back({text(types[i].name), types[i].line, snapshotFile});
+        }
+    }
+    for (uint32_t i = 0; i < header->functionCount; ++i) {
+        const SnapshotFunction &function = functions[i];
+        if (skipped(function.file)) continue;
+        FunctionSignature signature{text(function.name), {}, function.line, function.requiredArguments,
+                                    function.variadic != 0, snapshotFile};
+        for (uint32_t a = 0; a < function.argumentCount; ++a) {
+            signature.argumentTypes.push_back(typeIds[arguments[function.firstArgument + a]]);
         }
-        std::string lowercaseValue = value;
-        std::transform(lowercaseValue.begin(), lowercaseValue.end(), lowercaseValue.begin(), ::tolower);
-        if (keywords.count(lowercaseValue)) {
-            return {KEYWORD, value, line};
+        symbols.functions.add(std::move(signature));
+    }
+    for (uint32_t i = 0; i < header->tableCount; ++i) {
+        const SnapshotTable &table = tables[i];
+        if (skipped(table.file)) continue;
+        TableDefinition definition{text(table.name), {}, table.line, snapshotFile};
+        for (uint32_t c = 0; c < table.columnCount; ++c) {
+            const SnapshotColumn &column = columns[table.firstColumn + c];
+            definition.columns.push_back({text(column.name), typeIds[column.type]});
         }
-        return {IDENTIFIER, value, line};
+        symbols.tables.push_back(std::move(definition));
     }
+    return {};
+}
 
-    Token handleLiteral() {
-        std::string value;
-        while (isdigit(peek())) {
-            value += advance();
+// Expands command line arguments into the sorted list of files to process: directories
+// are searched recursively for *.sql files, arguments with wildcards go through glob(3).
+// Paths leading to the same file through symbolic links are kept once, so no file is
+// processed, or rewritten in place, twice.
+std::vector<std::string> collectInputFiles(const std::vector<std::string> &arguments) {
+    std::vector<std::string> files;
+    for (const auto &argument : arguments) {
+        if (argument.find_first_of("*?[") != std::string::npos) {
+            glob_t matches;
+            if (glob(argument.c_str(), 0, nullptr, &matches) == 0) {
+                for (size_t i = 0; i < matches.gl_pathc; ++i) files.push_back(matches.gl_pathv[i]);
+            }
+            globfree(&matches);
+        } else if (std::filesystem::is_directory(argument)) {
+            for (const auto &entry : std::filesystem::recursive_directory_iterator(argument)) {
+                if (entry.is_regular_file() && entry.path().extension() == ".sql") {
+                    files.push_back(entry.path().string());
+                }
+            }
+        } else {
+            files.push_back(argument);
         }
-        return {LITERAL, value, line};
     }
+    std::sort(files.begin(), files.end());
+    std::set<std::string> targets;
+    std::vector<std::string> unique;
+    for (auto &path : files) {
+        std::error_code error;
+        std::filesystem::path target = std::filesystem::canonical(path, error);
+        if (targets.insert(error ? path : target.string()).second) unique.push_back(std::move(path));
+    }
+    return unique;
+}
+
+// Git-aware incremental mode
 
-    Token handleSymbol() {
-        return {SYMBOL, std::string(1, advance()), line};
+// Runs a shell command and captures its standard output; false when it fails
+bool runCommand(const std::string &command, std::string &output) {
+    FILE *pipe = popen(command.c_str(), "r");
+    if (!pipe) return false;
+    char buffer[65536];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), pipe)) > 0) output.append(buffer, count);
+    return pclose(pipe) == 0;
+}
+
+std::string shellQuote(const std::string &value) {
+    std::string quoted = "'";
+    for (char c : value) {
+        if (c == '\'') quoted += "'\\''";
+        else quoted += c;
     }
+    return quoted + "'";
+}
 
-    Token handleStringLiteral() {
-        std::string value;
-        advance(); // Skip the opening quote
-        while (peek() != '"' && peek() != '\0') {
-            value += advance();
+// Lines one file lost and gained between two revisions, as inclusive line ranges
+struct FileDiff {
+    std::string oldPath; // Relative to the repository root, empty for added files
+    std::string newPath; // Empty for deleted files
+    std::vector<std::pair<int, int>> oldRanges;
+    std::vector<std::pair<int, int>> newRanges;
+
+    static bool touches(const std::vector<std::pair<int, int>> &ranges, int first, int last) {
+        for (const auto &range : ranges) {
+            if (range.first <= last && first <= range.second) return true;
         }
-        if (peek() == '"') advance(); // Skip the closing quote
-        return {STRING_LITERAL, value, line};
+        return false;
     }
+};
 
-public:
-    Lexer(const std::string &input) : input(input) {}
+// Changes between BASE and HEAD, or between BASE and the working tree, in the repository
+// containing the current directory. BASE...HEAD diffs against their merge base.
+class GitDiff {
+private:
+    std::filesystem::path root;
+    std::vector<FileDiff> changes;
+    std::unordered_map<std::string, size_t> byPath; // Absolute path at HEAD to changes index
 
-    std::vector<Token> tokenize() {
-        std::vector<Token> tokens;
-        while (position < input.length()) {
-            skipWhitespace();
-            char current = peek();
-            if (isalpha(current) || current == '_') {
-                tokens.push_back(handleIdentifierOrKeyword());
-            } else if (isdigit(current)) {
-                tokens.push_back(handleLiteral());
-            } else if (current == '"') {
-                tokens.push_back(handleStringLiteral());
-            } else if (ispunct(current)) {
-                tokens.push_back(handleSymbol());
-            } else {
-                advance();
+    Status git(const std::string &arguments, std::string &output) const {
+        if (!runCommand("git -C " + shellQuote(root.string()) + " " + arguments + " 2>/dev/null", output)) {
+            return Status::failure("git " + arguments + " failed");
+        }
+        return {};
+    }
+
+    static std::string trimmed(std::string value) {
+        while (!value.empty() && isspace(static_cast<unsigned char>(value.back()))) value.pop_back();
+        return value;
+    }
+
+    void parse(const std::string &output) {
+        static const std::regex hunk(R"(^@@ -(\d+)(?:,(\d+))? \+(\d+)(?:,(\d+))? @@)");
+        std::istringstream stream(output);
+        std::string line;
+        while (std::getline(stream, line)) {
+            std::smatch match;
+            if (line.compare(0, 11, "diff --git ") == 0) {
+                changes.emplace_back();
+            } else if (changes.empty()) {
+                continue;
+            } else if (line.compare(0, 4, "--- ") == 0) {
+                changes.back().oldPath = line.compare(4, 2, "a/") == 0 ? line.substr(6) : "";
+            } else if (line.compare(0, 4, "+++ ") == 0) {
+                changes.back().newPath = line.compare(4, 2, "b/") == 0 ? line.substr(6) : "";
+            } else if (std::regex_search(line, match, hunk)) {
+                int oldStart = std::stoi(match[1]);
+                int oldCount = match[2].matched ? std::stoi(match[2]) : 1;
+                int newStart = std::stoi(match[3]);
+                int newCount = match[4].matched ? std::stoi(match[4]) : 1;
+                if (oldCount > 0) changes.back().oldRanges.push_back({oldStart, oldStart + oldCount - 1});
+                // A pure deletion touches the lines on both sides of the gap it leaves
+                changes.back().newRanges.push_back({newStart, newStart + std::max(newCount, 2) - 1});
             }
         }
-        tokens.push_back({END_OF_FILE, "", line});
-        return tokens;
+        for (size_t i = 0; i < changes.size(); ++i) {
+            if (!changes[i].newPath.empty()) byPath[canonicalPath((root / changes[i].newPath).string())] = i;
+        }
     }
-};
 
-// Preprocessor class
-class Preprocessor {
 public:
-    static std::string process(const std::string &input) {
-        std::istringstream stream(input);
-        std::ostringstream processedCode;
-        std::string line;
+    std::string base;
+    std::string head; // Empty for the working tree
 
-        while (std::getline(stream, line)) {
-            // Check for #define directive
-            if (line.find("#define") == 0) {
-                std::istringstream defineStream(line);
-                std::string directive, key, value;
-                defineStream >> directive >> key;
-                std::getline(defineStream, value);
-                value = std::regex_replace(value, std::regex("^\\s+|\\s+$"), ""); // Trim whitespace
-                preprocessorMap[key] = value;
-            } else {
-                // Replace macros in the line
-                for (const auto &entry : preprocessorMap) {
-                    size_t pos = 0;
-                    while ((pos = line.find(entry.first, pos)) != std::string::npos) {
-                        line.replace(pos, entry.first.length(), entry.second);
-                        pos += entry.second.length();
-                    }
-                }
-                processedCode << line << "\n";
+    // Finds the repository and reads the changes in range, BASE[..HEAD] or BASE...HEAD
+    Status load(const std::string &range) {
+        std::string output;
+        if (!runCommand("git rev-parse --show-toplevel 2>/dev/null", output)) {
+            return Status::failure("--diff needs to run inside a git repository");
+        }
+        root = trimmed(output);
+        size_t dots = range.find("..");
+        base = range.substr(0, dots);
+        if (dots != std::string::npos) {
+            bool mergeBase = range.compare(dots, 3, "...") == 0;
+            head = range.substr(dots + (mergeBase ? 3 : 2));
+            if (head.empty()) head = "HEAD";
+            if (mergeBase) {
+                output.clear();
+                Status status = git("merge-base " + shellQuote(base) + " " + shellQuote(head), output);
+                if (!status) return status;
+                base = trimmed(output);
             }
         }
+        output.clear();
+        Status status = git("-c core.quotePath=false diff --no-color --no-ext-diff --no-renames -U0 " +
+                                shellQuote(base) + (head.empty() ? "" : " " + shellQuote(head)) + " --",
+                            output);
+        if (status) parse(output);
+        return status;
+    }
+
+    std::string relativePath(const std::string &path) const {
+        return std::filesystem::path(canonicalPath(path)).lexically_relative(root).string();
+    }
+
+    const FileDiff *find(const std::string &path) const {
+        auto it = byPath.find(canonicalPath(path));
+        return it == byPath.end() ? nullptr : &changes[it->second];
+    }
+
+    // Contents of paths at revision through one `git cat-file --batch`; found tells which
+    // paths exist there
+    Status readRevision(const std::string &revision, const std::vector<std::string> &paths,
+                        std::vector<std::string> &contents, std::vector<bool> &found) const {
+        std::string requestPath = (std::filesystem::temp_directory_path() / "parser-git-XXXXXX").string();
+        int descriptor = mkstemp(requestPath.data());
+        if (descriptor < 0) return Status::failure("Cannot create a temporary file");
+        std::string requests;
+        for (const auto &path : paths) requests += revision + ":" + path + "\n";
+        bool written = write(descriptor, requests.data(), requests.size()) == static_cast<ssize_t>(requests.size());
+        close(descriptor);
+        std::string output;
+        bool ran = written && runCommand("git -C " + shellQuote(root.string()) + " cat-file --batch < " +
+                                             shellQuote(requestPath),
+                                         output);
+        std::filesystem::remove(requestPath);
+        if (!ran) return Status::failure("Cannot read files at revision " + revision);
+
+        // Each answer is "<object> blob <size>\n<content>\n" or "<name> missing\n"
+        contents.assign(paths.size(), {});
+        found.assign(paths.size(), false);
+        size_t offset = 0;
+        for (size_t i = 0; i < paths.size() && offset < output.size(); ++i) {
+            size_t lineEnd = output.find('\n', offset);
+            if (lineEnd == std::string::npos) break;
+            std::istringstream header(output.substr(offset, lineEnd - offset));
+            offset = lineEnd + 1;
+            std::string object, type;
+            size_t size = 0;
+            header >> object >> type >> size;
+            if (type != "blob") continue;
+            contents[i] = output.substr(offset, size);
+            found[i] = true;
+            offset += size + 1;
+        }
+        return {};
+    }
 
-        return processedCode.str();
+    // Adds to result the lowercase names of the functions BASE defined in the units the diff
+    // changed, so callers of removed or re-declared functions are checked again
+    Status removedFunctions(ThreadPool &pool, std::set<std::string> &result) const {
+        std::vector<const FileDiff *> touched;
+        std::vector<std::string> paths;
+        for (const auto &change : changes) {
+            if (change.oldPath.empty() || change.oldRanges.empty()) continue;
+            touched.push_back(&change);
+            paths.push_back(change.oldPath);
+        }
+        std::vector<std::string> contents;
+        std::vector<bool> found;
+        if (Status status = readRevision(base, paths, contents, found); !status) return status;
+        std::vector<std::vector<std::string>> names(touched.size());
+        pool.parallelFor(touched.size(), [&](size_t i) {
+            if (!found[i]) return;
+            std::vector<Token> tokens = Lexer(Preprocessor().process(contents[i])).tokenize();
+            for (const auto &unit : splitUnits(tokens)) {
+                if (!FileDiff::touches(touched[i]->oldRanges, tokens[unit.begin].line, tokens[unit.end - 1].line)) {
+                    continue;
+                }
+                Parser parser(tokens, unit.begin, unit.end);
+                parser.firstPass();
+                for (const auto &signature : parser.getFunctionTable().signatures()) {
+                    names[i].push_back(lowercase(signature.name));
+                }
+            }
+        });
+        for (const auto &list : names) result.insert(list.begin(), list.end());
+        return {};
     }
 };
 
-// Parser with two-pass analysis
-class Parser {
-private:
-    std::vector<Token> tokens;
-    size_t position = 0;
-    int indentLevel = 0; // Tracks indentation level
-    std::ostringstream formattedCode;
-    std::unordered_map<std::string, FunctionSignature> functionTable; // Stores function definitions and calls
+// Command line options
+struct Options {
+    std::vector<std::string> inputs;
+    unsigned threads = std::thread::hardware_concurrency();
+    std::string snapshotPath;      // Symbols of files outside this run
+    std::string writeSnapshotPath; // Where to save the symbols of this run
+    std::string cachePath;         // Directory of the per-unit analysis cache
+    uintmax_t cacheSize = 512;     // Cache size limit in MiB
+    uintmax_t streamThreshold = 256; // Size in MiB from which a file is formatted as a stream
+    FormatOptions format;
+    std::string diffRange;         // BASE[..HEAD] to check incrementally
+    bool check = false;            // Report files that are not formatted instead of formatting them
+    bool inPlace = false;          // Replace files with their formatted code instead of writing .formatted
+    bool patch = false;            // Print a unified diff to the formatted code instead of writing it
+    std::string lineRange;         // FIRST:LAST lines of the one input to format, as an edit
+    std::string byteRange;         // OFFSET:LENGTH bytes of the one input to format, as an edit
+    bool watch = false;            // Stay resident and check files as they are saved
+    bool languageServer = false;   // Serve the language server protocol on stdio
+    DiagnosticWriter::Format diagnostics = DiagnosticWriter::TEXT;
+    std::string diagnosticsPath;   // Where diagnostics go instead of stdout
+};
+
+// Stream diagnostics are written to: diagnosticsPath, opened into file, or stdout
+std::ostream &diagnosticStream(const Options &options, std::ofstream &file) {
+    if (options.diagnosticsPath.empty()) return std::cout;
+    file.open(options.diagnosticsPath, std::ios::binary | std::ios::trunc);
+    return file;
+}
 
-    Token peek() {
-        return position < tokens.size() ? tokens[position] : Token{END_OF_FILE, "", -1};
+// Stream of the summary for people, kept off stdout when stdout carries JSON Lines or SARIF
+std::ostream &summaryStream(const Options &options) {
+    return options.diagnostics != DiagnosticWriter::TEXT && options.diagnosticsPath.empty() ? std::cerr : std::cout;
+}
+
+// Loads every file, largest first, from disk or from contents when given, and sets order
+// to the file indices in that order. Files of streamThreshold bytes or more are only
+// marked as streamed. Fails when a file cannot be read.
+Status loadFiles(std::vector<ParsedFile> &files, std::vector<size_t> &order, const std::vector<std::string> &filenames,
+                 ThreadPool &pool, const std::vector<std::string> *contents = nullptr,
+                 uintmax_t streamThreshold = UINTMAX_MAX) {
+    files = std::vector<ParsedFile>(filenames.size());
+    std::vector<Status> statuses(files.size());
+    std::vector<std::pair<uintmax_t, size_t>> bySize; // Lexing cost is proportional to file size
+    for (size_t i = 0; i < files.size(); ++i) {
+        std::error_code error;
+        uintmax_t size = contents ? (*contents)[i].size() : std::filesystem::file_size(filenames[i], error);
+        bySize.push_back({error ? 0 : size, i});
+    }
+    std::stable_sort(bySize.begin(), bySize.end(),
+                     [](const auto &a, const auto &b) { return a.first > b.first; });
+    pool.parallelFor(files.size(), [&](size_t n) {
+        size_t index = bySize[n].second;
+        ParsedFile &file = files[index];
+        file.path = filenames[index];
+        if (contents) {
+            loadSource(file, (*contents)[index], pool, files.size() == 1);
+        } else if (bySize[n].first >= streamThreshold) {
+            file.streamed = true;
+            file.modified = modificationTime(file.path);
+        } else {
+            std::string source;
+            statuses[index] = readFile(file.path, source);
+            loadSource(file, source, pool, files.size() == 1);
+            file.modified = modificationTime(file.path);
+        }
+    });
+    order.clear();
+    for (const auto &entry : bySize) order.push_back(entry.second);
+    for (auto &status : statuses) {
+        if (!status) return status;
     }
+    return {};
+}
 
-    Token advance() {
-        return position < tokens.size() ? tokens[position++] : Token{END_OF_FILE, "", -1};
+// Runs the first pass over every unit and merges the results into symbols; streamed files
+// are read again here
+Status collectSymbols(std::vector<ParsedFile> &files, const std::vector<WorkItem> &items, AnalysisCache *cache,
+                      ThreadPool &pool, SymbolTable &symbols) {
+    pool.parallelFor(items.size(), [&](size_t n) {
+        for (size_t u = items[n].firstUnit; u < items[n].endUnit; ++u) firstPassUnit(files[items[n].file], u, cache);
+    });
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!files[i].streamed) {
+            mergeSymbols(files[i], static_cast<uint32_t>(i), symbols);
+        } else if (Status status = collectStreamed(files[i], static_cast<uint32_t>(i), symbols, pool); !status) {
+            return status;
+        }
     }
+    return {};
+}
+
+void reportCache(AnalysisCache *cache, std::ostream &out) {
+    if (!cache) return;
+    cache->evict();
+    out << "Cache: " << cache->hits << " hits, " << cache->revalidated << " revalidated, " << cache->misses
+        << " misses\n";
+}
 
-    void writeIndentedLine(const std::string &line) {
-        for (int i = 0; i < indentLevel; ++i) {
-            formattedCode << "    "; // 4 spaces for each indentation level
+// Whether the unit of tokens calls one of the lowercase names; a token scan, without parsing
+bool callsAny(const std::vector<Token> &tokens, const TokenRange &unit, const std::set<std::string> &names) {
+    if (names.empty()) return false;
+    for (size_t t = unit.begin; t + 1 < unit.end; ++t) {
+        if (tokens[t].type == IDENTIFIER && tokens[t + 1].value == "(" && names.count(lowercase(tokens[t].value))) {
+            return true;
         }
-        formattedCode << line << "\n";
     }
+    return false;
+}
 
-    // First pass: Detect functions
-    void detectFunctionCall() {
-        Token functionName = advance();
-        if (peek().value == "(") {
-            advance(); // Skip '('
-            std::vector<std::string> arguments;
+// Map every file to its symbols in parallel, reduce them into one global table, then
+// validate and format every file in parallel against that read-only table. Each stage
+// dispatches its largest work first.
+int runProject(const std::vector<std::string> &filenames, const Options &options, ThreadPool &pool) {
+    std::vector<ParsedFile> files;
+    std::vector<size_t> bySize;
+    if (Status status = loadFiles(files, bySize, filenames, pool, nullptr, options.streamThreshold << 20); !status) {
+        std::cerr << "Error: " << status.message << "\n";
+        return EXIT_FAILURE;
+    }
+    for (auto &file : files) file.format = options.format;
 
-            while (peek().value != ")" && peek().type != END_OF_FILE) {
-                if (peek().type == LITERAL || peek().type == IDENTIFIER || peek().type == STRING_LITERAL) {
-                    arguments.push_back(peek().value);
-                }
-                advance();
-                if (peek().value == ",") advance(); // Skip commas
+    std::unique_ptr<AnalysisCache> cache;
+    if (!options.cachePath.empty()) {
+        cache = std::make_unique<AnalysisCache>(options.cachePath, options.cacheSize << 20);
+    }
+    std::vector<WorkItem> items = scheduleWork(files, pool.size());
+    SymbolTable symbols;
+    if (Status status = collectSymbols(files, items, cache.get(), pool, symbols); !status) {
+        std::cerr << "Error: " << status.message << "\n";
+        return EXIT_FAILURE;
+    }
+    Status snapshotStatus;
+    if (!options.writeSnapshotPath.empty()) snapshotStatus = writeSnapshot(options.writeSnapshotPath, symbols, files);
+    if (snapshotStatus && !options.snapshotPath.empty()) {
+        snapshotStatus = loadSnapshot(options.snapshotPath, symbols, files);
+    }
+    if (!snapshotStatus) {
+        std::cerr << "Error: " << snapshotStatus.message << "\n";
+        return EXIT_FAILURE;
+    }
+    indexSymbols(symbols);
+
+    pool.parallelFor(items.size(), [&](size_t n) {
+        for (size_t u = items[n].firstUnit; u < items[n].endUnit; ++u) {
+            secondPassUnit(files[items[n].file], u, symbols, cache.get());
+        }
+    });
+    std::ofstream diagnosticsFile;
+    DiagnosticWriter writer(diagnosticStream(options, diagnosticsFile), options.diagnostics);
+    for (const auto &file : files) writer.addFile(file.path, file.directives);
+    std::vector<Status> writeStatuses(files.size());
+    // In place, a file with #define directives still gets a .formatted file, since its
+    // output has the directives applied and writing it back would lose them
+    auto inPlace = [&](const ParsedFile &file) { return options.inPlace && !file.directives; };
+    std::vector<char> rewritten(files.size(), 0);
+    pool.parallelFor(files.size(), [&](size_t n) {
+        size_t i = bySize[n];
+        ParsedFile &file = files[i];
+        if (file.streamed) return;
+        assembleOutput(file);
+        if (!inPlace(file)) {
+            writeStatuses[i] = writeFile(file.path + ".formatted", file.formattedCode);
+        } else if (file.formattedCode.size() != file.size || hashOutput(file.formattedCode) != file.contentHash) {
+            writeStatuses[i] = replaceFile(file.path, file.formattedCode);
+            rewritten[i] = 1;
+        }
+    });
+    // Diagnostics are reported in file order; those of a streamed file batch by batch
+    size_t errorCount = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        ParsedFile &file = files[i];
+        auto report = [&](const std::vector<Diagnostic> &diagnostics) {
+            writer.write(i, diagnostics);
+            errorCount += diagnostics.size();
+        };
+        if (!file.streamed) {
+            report(file.diagnostics);
+            continue;
+        }
+        if (!inPlace(file)) {
+            writeStatuses[i] = formatStreamed(file, file.path + ".formatted", symbols, pool, report);
+        } else {
+            // The output is too large to hold, so it goes to the temporary file right away,
+            // which is dropped when it turns out to match the file
+            std::string temporary;
+            uint64_t hash = 0;
+            struct stat written;
+            Status status = createTemporary(file.path, temporary);
+            if (status) status = formatStreamed(file, temporary, symbols, pool, report, &hash);
+            if (status && stat(temporary.c_str(), &written) == 0 && static_cast<uint64_t>(written.st_size) == file.size &&
+                hash == file.contentHash) {
+                unlink(temporary.c_str());
+            } else if (status) {
+                status = commitTemporary(temporary, file.path);
+                rewritten[i] = 1;
+            } else if (!temporary.empty()) {
+                unlink(temporary.c_str());
             }
+            writeStatuses[i] = status;
+        }
+    }
+    writeStatuses.push_back(writer.finish());
+    std::ostream &summary = summaryStream(options);
+    reportCache(cache.get(), summary);
+    for (const auto &status : writeStatuses) {
+        if (!status) {
+            std::cerr << "Error: " << status.message << "\n";
+            return EXIT_FAILURE;
+        }
+    }
 
-            if (peek().value == ")") {
-                advance(); // Skip ')'
+    if (options.inPlace) {
+        for (const auto &file : files) {
+            if (file.directives) {
+                summary << file.path << ": has #define directives, output written to " << file.path
+                        << ".formatted instead\n";
             }
+        }
+        summary << "Formatted and validated " << files.size() << " files (" << errorCount << " errors), "
+                << std::count(rewritten.begin(), rewritten.end(), 1) << " rewritten in place\n";
+        return EXIT_SUCCESS;
+    }
+    if (files.size() == 1) {
+        summary << "Formatted and validated code written to " << files[0].path << ".formatted\n";
+        return EXIT_SUCCESS;
+    }
+    summary << "Formatted and validated " << files.size() << " files (" << errorCount
+            << " errors), output written next to each file as .formatted\n";
+    return EXIT_SUCCESS;
+}
+
+// Calls fn(i) for every loaded, not streamed, file. Files larger than a fair share of the
+// work go one at a time, each with all threads; the others go in parallel, each on one
+// thread.
+void forEachLoaded(const std::vector<ParsedFile> &files, const std::vector<size_t> &bySize, ThreadPool &pool,
+                   const std::function<void(size_t)> &fn) {
+    uint64_t totalSize = 0;
+    for (const auto &file : files) totalSize += file.size;
+    std::vector<size_t> small;
+    for (size_t i : bySize) {
+        if (files[i].streamed) continue;
+        if (files[i].size > totalSize / pool.size()) fn(i);
+        else small.push_back(i);
+    }
+    pool.parallelFor(small.size(), [&](size_t n) { fn(small[n]); });
+}
+
+// Check mode: every file is formatted, without being validated, and compared with its
+// text as it is formatted, up to the first difference. Nothing is written.
+int runCheck(const std::vector<std::string> &filenames, const Options &options, ThreadPool &pool) {
+    std::vector<ParsedFile> files;
+    std::vector<size_t> bySize;
+    if (Status status = loadFiles(files, bySize, filenames, pool, nullptr, options.streamThreshold << 20); !status) {
+        std::cerr << "Error: " << status.message << "\n";
+        return EXIT_FAILURE;
+    }
+    for (auto &file : files) file.format = options.format;
+    std::vector<FormatDifference> differences(files.size());
+    std::vector<Status> statuses(files.size());
+    for (size_t i : bySize) {
+        if (files[i].streamed) statuses[i] = checkStreamed(files[i], pool, differences[i]);
+    }
+    forEachLoaded(files, bySize, pool, [&](size_t i) { differences[i] = checkFormatted(files[i], pool); });
+
+    size_t unformatted = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!statuses[i]) {
+            std::cerr << "Error: " << statuses[i].message << "\n";
+            return EXIT_FAILURE;
+        }
+        if (!differences[i].found) continue;
+        std::cout << files[i].path << ":" << differences[i].line << ":" << differences[i].column
+                  << ": error: not formatted\n";
+        unformatted++;
+    }
+    std::cout << unformatted << " of " << files.size() << " files not formatted\n";
+    return unformatted == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Patch mode: every file is formatted, without being validated, and a unified diff from
+// the file to its formatted code is printed, for patch -p0. Nothing is written. The exit
+// status is non-zero when any file would change.
+int runPatch(const std::vector<std::string> &filenames, const Options &options, ThreadPool &pool) {
+    std::vector<ParsedFile> files;
+    std::vector<size_t> bySize;
+    if (Status status = loadFiles(files, bySize, filenames, pool, nullptr, options.streamThreshold << 20); !status) {
+        std::cerr << "Error: " << status.message << "\n";
+        return EXIT_FAILURE;
+    }
+    for (auto &file : files) file.format = options.format;
+    std::vector<OutputBuffer> patches(files.size());
+    forEachLoaded(files, bySize, pool, [&](size_t i) {
+        const ParsedFile &file = files[i];
+        if (file.directives) return;
+        std::string formatted = formatUnvalidated(file, pool).str();
+        // The preprocessor only adds a missing final newline to a file without directives
+        std::string_view original = std::string_view(file.preprocessedCode).substr(0, file.size);
+        std::vector<std::string_view> before = splitLines(original);
+        std::vector<std::string_view> after = splitLines(formatted);
+        writeUnifiedDiff(patches[i], file.path, before, after, diffLines(before, after));
+    });
+
+    bool changed = false;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (files[i].streamed || files[i].directives) {
+            std::cerr << files[i].path << ": not diffed, "
+                      << (files[i].streamed ? "too large to hold in memory" : "has #define directives") << "\n";
+            continue;
+        }
+        if (patches[i].empty()) continue;
+        changed = true;
+        if (!writeAll(STDOUT_FILENO, patches[i])) {
+            std::cerr << "Error: Cannot write to standard output\n";
+            return EXIT_FAILURE;
+        }
+    }
+    return changed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Diff mode: the first pass still covers every file, since calls anywhere may resolve to
+// any function, but the second pass only runs over the units a diff touched and over the
+// units calling functions those units define or used to define. Diagnostics are printed
+// instead of writing formatted files.
+int runDiff(const std::vector<std::string> &filenames, const Options &options, ThreadPool &pool) {
+    GitDiff diff;
+    if (Status status = diff.load(options.diffRange); !status) {
+        std::cerr << "Error: " << status.message << "\n";
+        return EXIT_FAILURE;
+    }
+    std::vector<std::string> contents;
+    std::vector<std::string> analyzed;
+    if (diff.head.empty()) {
+        analyzed = filenames;
+    } else {
+        // Files come from the HEAD revision; inputs missing there are skipped
+        std::vector<std::string> paths;
+        for (const auto &filename : filenames) paths.push_back(diff.relativePath(filename));
+        std::vector<std::string> blobs;
+        std::vector<bool> found;
+        if (Status status = diff.readRevision(diff.head, paths, blobs, found); !status) {
+            std::cerr << "Error: " << status.message << "\n";
+            return EXIT_FAILURE;
+        }
+        for (size_t i = 0; i < filenames.size(); ++i) {
+            if (!found[i]) continue;
+            analyzed.push_back(filenames[i]);
+            contents.push_back(std::move(blobs[i]));
+        }
+    }
+    std::vector<ParsedFile> files;
+    std::vector<size_t> order;
+    if (Status status = loadFiles(files, order, analyzed, pool, diff.head.empty() ? nullptr : &contents); !status) {
+        std::cerr << "Error: " << status.message << "\n";
+        return EXIT_FAILURE;
+    }
+    for (auto &file : files) file.format = options.format; // Part of the cache keys
 
-            // Record the function in the function table
-            if (functionTable.find(functionName.value) == functionTable.end()) {
-                functionTable[functionName.value] = {functionName.value, arguments, functionName.line};
+    std::unique_ptr<AnalysisCache> cache;
+    if (!options.cachePath.empty()) {
+        cache = std::make_unique<AnalysisCache>(options.cachePath, options.cacheSize << 20);
+    }
+    std::vector<WorkItem> items = scheduleWork(files, pool.size());
+    SymbolTable symbols;
+    if (Status status = collectSymbols(files, items, cache.get(), pool, symbols); !status) {
+        std::cerr << "Error: " << status.message << "\n";
+        return EXIT_FAILURE;
+    }
+    if (!options.snapshotPath.empty()) {
+        if (Status status = loadSnapshot(options.snapshotPath, symbols, files); !status) {
+            std::cerr << "Error: " << status.message << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+    indexSymbols(symbols);
+
+    // Units overlapping changed lines, and the functions defined in them on either side
+    std::set<std::pair<size_t, size_t>> affected;
+    std::set<std::string> changedFunctions;
+    for (size_t i = 0; i < files.size(); ++i) {
+        const FileDiff *changes = diff.find(files[i].path);
+        if (!changes) continue;
+        for (size_t u = 0; u < files[i].units.size(); ++u) {
+            int first = unitLine(files[i], u);
+            int last = files[i].tokens[files[i].units[u].end - 1].line;
+            if (changes->touches(changes->newRanges, first, last)) affected.insert({i, u});
+        }
+    }
+    for (auto &signature : symbols.functions.signatures()) {
+        if (signature.file >= files.size()) continue;
+        const ParsedFile &file = files[signature.file];
+        for (size_t u = 0; u < file.units.size(); ++u) {
+            if (affected.count({signature.file, u}) && unitLine(file, u) <= signature.line &&
+                signature.line <= file.tokens[file.units[u].end - 1].line) {
+                changedFunctions.insert(lowercase(signature.name));
             }
         }
     }
+    if (Status status = diff.removedFunctions(pool, changedFunctions); !status) {
+        std::cerr << "Error: " << status.message << "\n";
+        return EXIT_FAILURE;
+    }
 
-    // Second pass: Validate functions
-    void validateFunctionCall() {
-        Token functionName = advance();
-        writeIndentedLine(functionName.value + " (");
+    // Callers of changed functions
+    for (size_t i = 0; i < files.size(); ++i) {
+        for (size_t u = 0; u < files[i].units.size(); ++u) {
+            if (callsAny(files[i].tokens, files[i].units[u], changedFunctions)) affected.insert({i, u});
+        }
+    }
 
-        if (peek().value == "(") {
-            advance(); // Skip '('
-            std::vector<std::string> arguments;
+    std::vector<std::pair<size_t, size_t>> work(affected.begin(), affected.end());
+    pool.parallelFor(work.size(), [&](size_t n) {
+        ParsedFile &file = files[work[n].first];
+        size_t unit = work[n].second;
+        secondPassUnit(file, unit, symbols, cache.get());
+    });
+    std::ofstream diagnosticsFile;
+    DiagnosticWriter writer(diagnosticStream(options, diagnosticsFile), options.diagnostics);
+    for (const auto &file : files) writer.addFile(file.path, file.directives);
+    size_t errorCount = 0;
+    for (const auto &[fileIndex, unit] : work) {
+        ParsedFile &file = files[fileIndex];
+        auto &diagnostics = file.parsers[unit] ? file.parsers[unit]->getDiagnostics()
+                                               : file.cacheEntries[unit]->diagnostics;
+        writer.write(fileIndex, diagnostics);
+        errorCount += diagnostics.size();
+    }
+    if (Status status = writer.finish(); !status) {
+        std::cerr << "Error: " << status.message << "\n";
+        return EXIT_FAILURE;
+    }
+    std::ostream &summary = summaryStream(options);
+    reportCache(cache.get(), summary);
 
-            while (peek().value != ")" && peek().type != END_OF_FILE) {
-                if (peek().type == LITERAL || peek().type == IDENTIFIER || peek().type == STRING_LITERAL) {
-                    arguments.push_back(peek().value);
-                }
-                advance();
-                if (peek().value == ",") advance(); // Skip commas
+    size_t unitCount = 0;
+    for (const auto &file : files) unitCount += file.units.size();
+    summary << "Validated " << work.size() << " of " << unitCount << " units affected by " << options.diffRange
+            << " (" << errorCount << " errors)\n";
+    return errorCount == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// State of one file in watch mode
+struct WatchedFile {
+    ParsedFile parsed;
+    SymbolTable symbols; // Symbols the file defines, kept to rebuild the global table
+};
+
+// Overloads of every function in table, keyed by lowercase name, in a form that compares
+// equal exactly when validation against them gives the same results
+std::map<std::string, std::vector<std::string>> describeFunctions(FunctionTable &table) {
+    std::map<std::string, std::vector<std::string>> result;
+    for (const auto &signature : table.signatures()) {
+        std::string description = std::to_string(signature.line) + ":" +
+                                  std::to_string(signature.requiredArguments) + ":" +
+                                  std::to_string(signature.variadic);
+        for (TypeId type : signature.argumentTypes) description += ":" + typeTable().name(type);
+        result[lowercase(signature.name)].push_back(description);
+    }
+    return result;
+}
+
+// Write end of the pipe that stops watch mode; set while it runs
+volatile std::sig_atomic_t watchStopPipe = -1;
+
+void stopWatching(int) {
+    if (watchStopPipe < 0) return;
+    ssize_t written = write(watchStopPipe, "", 1); // A full pipe already stops the loop
+    (void)written;
+}
+
+// Watch mode: after the initial analysis, inotify reports saved files; each one is
+// preprocessed, lexed and parsed again on its own, the global table is rebuilt from the
+// per-file symbols, and the units of other files calling a function whose signature
+// changed are validated again. Diagnostics of every file checked again are printed.
+// SIGINT or SIGTERM ends it with success; failing to read events ends it with an error.
+int runWatch(const std::vector<std::string> &filenames, const Options &options, ThreadPool &pool) {
+    std::deque<WatchedFile> files; // Parsers refer to the tokens, so files never move
+    std::unordered_map<std::string, size_t> byPath;
+    SymbolTable symbols;
+    SymbolTable snapshot;
+    if (!options.snapshotPath.empty()) {
+        if (Status status = loadSnapshot(options.snapshotPath, snapshot, {}); !status) {
+            std::cerr << "Error: " << status.message << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto rebuildSymbols = [&] {
+        symbols = SymbolTable();
+        auto append = [&](SymbolTable &source) {
+            for (const auto &signature : source.functions.signatures()) symbols.functions.add(signature);
+            symbols.tables.insert(symbols.tables.end(), source.tables.begin(), source.tables.end());
+            symbols.types.insert(symbols.types.end(), source.types.begin(), source.types.end());
+        };
+        for (auto &file : files) append(file.symbols);
+        append(snapshot);
+        indexSymbols(symbols);
+    };
+    // Reads and first-passes file index; a file that vanished is left without units
+    auto parseFile = [&](size_t index) {
+        WatchedFile &file = files[index];
+        std::string path = file.parsed.path;
+        file.parsed = ParsedFile();
+        file.parsed.path = path;
+        file.symbols = SymbolTable();
+        std::ifstream stream(path, std::ios::binary);
+        if (!stream.is_open()) return;
+        std::ostringstream content;
+        content << stream.rdbuf();
+        loadSource(file.parsed, content.str(), pool, false);
+        for (size_t u = 0; u < file.parsed.units.size(); ++u) firstPassUnit(file.parsed, u, nullptr);
+        mergeSymbols(file.parsed, static_cast<uint32_t>(index), file.symbols);
+    };
+    // Only diagnostics are reported, so units are validated without being formatted
+    auto validateUnit = [&](size_t index, size_t unit) {
+        ParsedFile &file = files[index].parsed;
+        file.parsers[unit] = std::make_unique<Parser>(file.tokens, file.units[unit].begin, file.units[unit].end);
+        file.parsers[unit]->setSymbols(symbols);
+        file.parsers[unit]->secondPass();
+    };
+    // Each round is reported as one batch; in JSON Lines it numbers its own files
+    std::ofstream diagnosticsFile;
+    std::ostream &diagnosticsOut = diagnosticStream(options, diagnosticsFile);
+    std::ostream &summary = summaryStream(options);
+    auto report = [&](const std::set<size_t> &indices, size_t &errorCount) {
+        DiagnosticWriter writer(diagnosticsOut, options.diagnostics);
+        errorCount = 0;
+        for (size_t index : indices) {
+            const ParsedFile &file = files[index].parsed;
+            size_t number = writer.addFile(file.path, file.directives);
+            for (const auto &parser : file.parsers) {
+                writer.write(number, parser->getDiagnostics());
+                errorCount += parser->getDiagnostics().size();
             }
+        }
+        return writer.finish();
+    };
+    auto addFile = [&](const std::string &path) {
+        std::string key = canonicalPath(path);
+        auto entry = byPath.emplace(key, files.size());
+        if (entry.second) {
+            files.emplace_back();
+            files.back().parsed.path = path;
+        }
+        return entry.first->second;
+    };
 
-            if (peek().value == ")") {
-                advance(); // Skip ')'
-            } else {
-                writeIndentedLine("-- Error: Missing closing parenthesis for function call.");
+    for (const auto &filename : filenames) addFile(filename);
+    pool.parallelFor(files.size(), [&](size_t i) { parseFile(i); });
+    rebuildSymbols();
+    std::set<size_t> all;
+    for (size_t i = 0; i < files.size(); ++i) {
+        pool.parallelFor(files[i].parsed.units.size(), [&](size_t u) { validateUnit(i, u); });
+        all.insert(i);
+    }
+    size_t errorCount;
+    if (Status status = report(all, errorCount); !status) {
+        std::cerr << "Error: " << status.message << "\n";
+        return EXIT_FAILURE;
+    }
+
+    int inotify = inotify_init1(IN_CLOEXEC);
+    if (inotify < 0) {
+        std::cerr << "Error: Cannot initialize inotify\n";
+        return EXIT_FAILURE;
+    }
+    const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE;
+    std::unordered_map<int, std::filesystem::path> directories;
+    std::vector<std::filesystem::path> roots; // Directory inputs, where new *.sql files count
+    auto watchDirectory = [&](const std::filesystem::path &directory) {
+        int watch = inotify_add_watch(inotify, directory.c_str(), mask);
+        if (watch >= 0) directories[watch] = directory;
+    };
+    for (const auto &input : options.inputs) {
+        std::error_code error;
+        if (std::filesystem::is_directory(input, error)) {
+            roots.push_back(canonicalPath(input));
+            watchDirectory(roots.back());
+            for (const auto &entry : std::filesystem::recursive_directory_iterator(input, error)) {
+                if (entry.is_directory()) watchDirectory(canonicalPath(entry.path().string()));
             }
+        }
+    }
+    for (const auto &file : files) {
+        watchDirectory(std::filesystem::path(canonicalPath(file.parsed.path)).parent_path());
+    }
+    auto tracked = [&](const std::filesystem::path &path) {
+        if (byPath.count(path.string())) return true;
+        if (path.extension() != ".sql") return false;
+        for (const auto &root : roots) {
+            if (path.string().compare(0, root.string().size(), root.string()) == 0) return true;
+        }
+        return false;
+    };
+    summary << "Watching " << files.size() << " files for changes\n" << std::flush;
+
+    // SIGINT and SIGTERM end the loop through a pipe polled with the inotify descriptor, so
+    // a signal handled on any thread wakes it
+    int stopPipe[2];
+    if (pipe2(stopPipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        std::cerr << "Error: Cannot create a pipe\n";
+        close(inotify);
+        return EXIT_FAILURE;
+    }
+    watchStopPipe = stopPipe[1];
+    struct sigaction action = {};
+    action.sa_handler = stopWatching;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
 
-            // Check against the function table
-            if (functionTable.find(functionName.value) != functionTable.end()) {
-                auto &signature = functionTable[functionName.value];
-                if (signature.argumentTypes.size() != arguments.size()) {
-                    writeIndentedLine("-- Error: Function '" + functionName.value + "' at line " +
-                                      std::to_string(signature.line) + " expects " +
-                                      std::to_string(signature.argumentTypes.size()) + " arguments, but " +
-                                      std::to_string(arguments.size()) + " were provided.");
+    alignas(inotify_event) char buffer[65536];
+    bool stopped = false;
+    Status status;
+    while (!stopped && status) {
+        // Collect events until the directory has been quiet for a moment, so an editor's
+        // write-and-rename save is handled once
+        std::set<std::string> changed;
+        pollfd descriptors[2] = {{inotify, POLLIN, 0}, {stopPipe[0], POLLIN, 0}};
+        int timeout = -1;
+        while (true) {
+            int ready = poll(descriptors, 2, timeout);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready < 0) status = Status::failure("Cannot poll for file changes");
+            if (ready <= 0) break;
+            if (descriptors[1].revents) {
+                stopped = true;
+                break;
+            }
+            ssize_t length = read(inotify, buffer, sizeof(buffer));
+            if (length < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            if (length <= 0) {
+                status = Status::failure("Cannot read file change events");
+                break;
+            }
+            for (char *cursor = buffer; cursor < buffer + length;) {
+                const auto *event = reinterpret_cast<const inotify_event *>(cursor);
+                cursor += sizeof(inotify_event) + event->len;
+                auto directory = directories.find(event->wd);
+                if (directory == directories.end() || event->len == 0) continue;
+                std::filesystem::path path = directory->second / event->name;
+                if (event->mask & IN_ISDIR) {
+                    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                        watchDirectory(path);
+                        std::error_code error;
+                        for (const auto &entry : std::filesystem::recursive_directory_iterator(path, error)) {
+                            if (entry.is_directory()) watchDirectory(entry.path());
+                            else if (tracked(entry.path())) changed.insert(entry.path().string());
+                        }
+                    }
+                } else if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)) &&
+                           tracked(path)) {
+                    changed.insert(path.string());
                 }
-            } else {
-                writeIndentedLine("-- Error: Unknown function '" + functionName.value + "' at line " +
-                                  std::to_string(functionName.line) + ".");
             }
+            timeout = 10;
+        }
+        if (stopped || !status || changed.empty()) continue;
+
+        auto start = std::chrono::steady_clock::now();
+        auto before = describeFunctions(symbols.functions);
+        std::vector<size_t> reparsed;
+        for (const auto &path : changed) reparsed.push_back(addFile(path));
+        pool.parallelFor(reparsed.size(), [&](size_t n) { parseFile(reparsed[n]); });
+        rebuildSymbols();
+        auto after = describeFunctions(symbols.functions);
+
+        std::set<std::string> changedFunctions;
+        for (const auto &entry : before) {
+            auto match = after.find(entry.first);
+            if (match == after.end() || match->second != entry.second) changedFunctions.insert(entry.first);
+        }
+        for (const auto &entry : after) {
+            if (!before.count(entry.first)) changedFunctions.insert(entry.first);
         }
 
-        writeIndentedLine(");");
+        std::set<std::pair<size_t, size_t>> units;
+        std::set<size_t> checked(reparsed.begin(), reparsed.end());
+        for (size_t i = 0; i < files.size(); ++i) {
+            const ParsedFile &file = files[i].parsed;
+            for (size_t u = 0; u < file.units.size(); ++u) {
+                if (checked.count(i) || callsAny(file.tokens, file.units[u], changedFunctions)) units.insert({i, u});
+            }
+        }
+        std::vector<std::pair<size_t, size_t>> work(units.begin(), units.end());
+        pool.parallelFor(work.size(), [&](size_t n) { validateUnit(work[n].first, work[n].second); });
+        for (const auto &unit : work) checked.insert(unit.first);
+        if (Status status = report(checked, errorCount); !status) {
+            std::cerr << "Error: " << status.message << "\n";
+            return EXIT_FAILURE;
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        summary << "Checked " << changed.size() << " changed and " << checked.size() - reparsed.size()
+                << " dependent files in " << elapsed.count() << " ms (" << errorCount << " errors)\n"
+                << std::flush;
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    watchStopPipe = -1;
+    close(stopPipe[0]);
+    close(stopPipe[1]);
+    close(inotify);
+    if (!status) {
+        std::cerr << "Error: " << status.message << "\n";
+        return EXIT_FAILURE;
+    }
+    summary << "Stopped watching\n";
+    return EXIT_SUCCESS;
+}
+
+// Language server
+
+// JSON value, just enough for the language server protocol
+class Json {
+public:
+    enum Kind { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+
+    Kind kind = NUL;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<Json> array;
+    std::vector<std::pair<std::string, Json>> object; // Members in insertion order
+
+    Json() = default;
+    Json(bool value) : kind(BOOLEAN), boolean(value) {}
+    Json(int value) : kind(NUMBER), number(value) {}
+    Json(double value) : kind(NUMBER), number(value) {}
+    Json(const char *value) : kind(STRING), string(value) {}
+    Json(std::string value) : kind(STRING), string(std::move(value)) {}
+
+    static Json makeArray() {
+        Json value;
+        value.kind = ARRAY;
+        return value;
+    }
+
+    static Json makeObject() {
+        Json value;
+        value.kind = OBJECT;
+        return value;
+    }
+
+    const Json &operator[](const std::string &key) const {
+        static const Json null;
+        for (const auto &member : object) {
+            if (member.first == key) return member.second;
+        }
+        return null;
     }
 
-    void parseStatement(bool isFirstPass) {
-        Token token = peek();
-        if (token.type == IDENTIFIER && peek().value != "(") {
-            if (isFirstPass) {
-                detectFunctionCall();
+    Json &set(const std::string &key, Json value) {
+        kind = OBJECT;
+        object.emplace_back(key, std::move(value));
+        return *this;
+    }
+
+    Json &push(Json value) {
+        kind = ARRAY;
+        array.push_back(std::move(value));
+        return *this;
+    }
+
+    bool isNull() const { return kind == NUL; }
+    int asInt() const { return static_cast<int>(number); }
+
+    std::string dump() const {
+        std::string out;
+        dumpInto(out);
+        return out;
+    }
+
+    // Parses a complete JSON text; false when it is malformed
+    static bool parse(std::string_view text, Json &value) {
+        size_t position = 0;
+        return parseValue(text, position, value, 0) && (skipSpace(text, position), position == text.size());
+    }
+
+private:
+    void dumpInto(std::string &out) const {
+        switch (kind) {
+        case NUL:
+            out += "null";
+            break;
+        case BOOLEAN:
+            out += boolean ? "true" : "false";
+            break;
+        case NUMBER: {
+            char buffer[32];
+            if (number == static_cast<double>(static_cast<long long>(number))) {
+                snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(number));
             } else {
-                validateFunctionCall();
+                snprintf(buffer, sizeof(buffer), "%.17g", number);
+            }
+            out += buffer;
+            break;
+        }
+        case STRING:
+            appendJsonString(out, string);
+            break;
+        case ARRAY:
+            out += '[';
+            for (size_t i = 0; i < array.size(); ++i) {
+                if (i > 0) out += ',';
+                array[i].dumpInto(out);
+            }
+            out += ']';
+            break;
+        case OBJECT:
+            out += '{';
+            for (size_t i = 0; i < object.size(); ++i) {
+                if (i > 0) out += ',';
+                appendJsonString(out, object[i].first);
+                out += ':';
+                object[i].second.dumpInto(out);
             }
-        } else if (token.type == KEYWORD) {
-            advance();
-            writeIndentedLine(token.value);
+            out += '}';
+            break;
+        }
+    }
+
+    static void skipSpace(std::string_view text, size_t &position) {
+        while (position < text.size() && isspace(static_cast<unsigned char>(text[position]))) position++;
+    }
+
+    static void appendUtf8(std::string &out, uint32_t code) {
+        if (code < 0x80) {
+            out += static_cast<char>(code);
+        } else if (code < 0x800) {
+            out += static_cast<char>(0xC0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        } else if (code < 0x10000) {
+            out += static_cast<char>(0xE0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
         } else {
-            advance();
-            writeIndentedLine(token.value + ";");
+            out += static_cast<char>(0xF0 | (code >> 18));
+            out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+
+    static bool parseHex(std::string_view text, size_t &position, uint32_t &code) {
+        if (position + 4 > text.size()) return false;
+        code = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = text[position++];
+            code <<= 4;
+            if (isdigit(static_cast<unsigned char>(c))) code |= c - '0';
+            else if (c >= 'a' && c <= 'f') code |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') code |= c - 'A' + 10;
+            else return false;
+        }
+        return true;
+    }
+
+    static bool parseString(std::string_view text, size_t &position, std::string &out) {
+        position++; // Skip the opening quote
+        while (position < text.size() && text[position] != '"') {
+            char c = text[position++];
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (position >= text.size()) return false;
+            char escape = text[position++];
+            switch (escape) {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'r': out += '\r'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'u': {
+                uint32_t code;
+                if (!parseHex(text, position, code)) return false;
+                // A surrogate pair encodes one character outside the basic plane
+                if (code >= 0xD800 && code < 0xDC00 && text.substr(position, 2) == "\\u") {
+                    uint32_t low;
+                    position += 2;
+                    if (!parseHex(text, position, low)) return false;
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+                appendUtf8(out, code);
+                break;
+            }
+            default: out += escape; break;
+            }
+        }
+        if (position >= text.size()) return false;
+        position++; // Skip the closing quote
+        return true;
+    }
+
+    static bool parseValue(std::string_view text, size_t &position, Json &value, int depth) {
+        if (depth > 256) return false;
+        skipSpace(text, position);
+        if (position >= text.size()) return false;
+        char c = text[position];
+        if (c == '{') {
+            value = makeObject();
+            position++;
+            skipSpace(text, position);
+            if (position < text.size() && text[position] == '}') return ++position, true;
+            while (true) {
+                skipSpace(text, position);
+                std::string key;
+                if (position >= text.size() || text[position] != '"' || !parseString(text, position, key)) return false;
+                skipSpace(text, position);
+                if (position >= text.size() || text[position++] != ':') return false;
+                Json member;
+                if (!parseValue(text, position, member, depth + 1)) return false;
+                value.object.emplace_back(std::move(key), std::move(member));
+                skipSpace(text, position);
+                if (position >= text.size()) return false;
+                if (text[position] == '}') return ++position, true;
+                if (text[position++] != ',') return false;
+            }
+        }
+        if (c == '[') {
+            value = makeArray();
+            position++;
+            skipSpace(text, position);
+            if (position < text.size() && text[position] == ']') return ++position, true;
+            while (true) {
+                Json element;
+                if (!parseValue(text, position, element, depth + 1)) return false;
+                value.array.push_back(std::move(element));
+                skipSpace(text, position);
+                if (position >= text.size()) return false;
+                if (text[position] == ']') return ++position, true;
+                if (text[position++] != ',') return false;
+            }
+        }
+        if (c == '"') {
+            value = Json("");
+            return parseString(text, position, value.string);
+        }
+        for (const char *word : {"true", "false", "null"}) {
+            if (text.substr(position, strlen(word)) == word) {
+                position += strlen(word);
+                value = word[0] == 'n' ? Json() : Json(word[0] == 't');
+                return true;
+            }
+        }
+        size_t end = position;
+        while (end < text.size() && (isdigit(static_cast<unsigned char>(text[end])) || strchr("+-.eE", text[end]))) {
+            end++;
+        }
+        if (end == position) return false;
+        value = Json(std::strtod(std::string(text.substr(position, end - position)).c_str(), nullptr));
+        position = end;
+        return true;
+    }
+};
+
+// Text of an open document as a rope of bounded chunks: an edit rewrites the chunks it
+// touches instead of moving the whole text, and prefix sums of chunk sizes and newline
+// counts map offsets and lines to chunks by binary search
+class Rope {
+private:
+    static const size_t maxChunk = 4096;
+
+    struct Chunk {
+        std::string text;
+        int newlines;
+    };
+    std::vector<Chunk> chunks;
+    std::vector<size_t> starts; // Offset each chunk starts at
+    std::vector<int> lines;     // Newlines before each chunk
+    size_t length = 0;
+
+    static std::vector<Chunk> cut(std::string_view text) {
+        std::vector<Chunk> pieces;
+        for (size_t start = 0; start < text.size(); start += maxChunk / 2) {
+            std::string piece(text.substr(start, maxChunk / 2));
+            int newlines = static_cast<int>(std::count(piece.begin(), piece.end(), '\n'));
+            pieces.push_back({std::move(piece), newlines});
         }
+        return pieces;
+    }
+
+    // Recomputes the prefix sums from chunk first on
+    void reindex(size_t first) {
+        starts.resize(chunks.size());
+        lines.resize(chunks.size());
+        for (size_t i = first; i < chunks.size(); ++i) {
+            starts[i] = i == 0 ? 0 : starts[i - 1] + chunks[i - 1].text.size();
+            lines[i] = i == 0 ? 0 : lines[i - 1] + chunks[i - 1].newlines;
+        }
+    }
+
+    // Index of the chunk holding offset, with the offset the chunk starts at; offsets at
+    // the end of the text belong to the last chunk
+    size_t locate(size_t offset, size_t &chunkStart) const {
+        if (chunks.empty()) {
+            chunkStart = 0;
+            return 0;
+        }
+        size_t i = static_cast<size_t>(std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin());
+        i = i > 0 ? i - 1 : 0;
+        chunkStart = starts[i];
+        return i;
     }
 
 public:
-    Parser(const std::vector<Token> &tokens) : tokens(tokens) {}
+    explicit Rope(std::string_view text = "") { assign(text); }
+
+    void assign(std::string_view text) {
+        chunks = cut(text);
+        length = text.size();
+        reindex(0);
+    }
+
+    size_t size() const { return length; }
 
-    void firstPass() {
-        while (peek().type != END_OF_FILE) {
-            parseStatement(true);
+    std::string substr(size_t offset, size_t count) const {
+        std::string result;
+        size_t chunkStart;
+        count = std::min(count, length - std::min(offset, length));
+        for (size_t i = locate(offset, chunkStart); i < chunks.size() && result.size() < count; ++i) {
+            size_t from = offset > chunkStart ? offset - chunkStart : 0;
+            result.append(chunks[i].text, from, count - result.size());
+            chunkStart += chunks[i].text.size();
         }
+        return result;
     }
 
-    std::string secondPass() {
-        position = 0; // Reset position for second pass
-        while (peek().type != END_OF_FILE) {
-            parseStatement(false);
+    std::string str() const { return substr(0, length); }
+
+    // Replaces count bytes at offset with text
+    void replace(size_t offset, size_t count, std::string_view text) {
+        if (chunks.empty()) {
+            assign(text);
+            return;
+        }
+        size_t firstStart, lastStart;
+        size_t first = locate(offset, firstStart);
+        size_t last = locate(offset + count, lastStart);
+        std::string piece;
+        for (size_t i = first; i <= last; ++i) piece += chunks[i].text;
+        piece.replace(offset - firstStart, count, text);
+        // A piece that shrank takes in a neighbour, so the chunk count stays proportional
+        // to the text size
+        if (piece.size() < maxChunk / 4 && first > 0) {
+            piece.insert(0, chunks[--first].text);
+        } else if (piece.size() < maxChunk / 4 && last + 1 < chunks.size()) {
+            piece += chunks[++last].text;
         }
-        return formattedCode.str();
+        std::vector<Chunk> pieces;
+        if (piece.size() <= maxChunk) {
+            int newlines = static_cast<int>(std::count(piece.begin(), piece.end(), '\n'));
+            if (!piece.empty()) pieces.push_back({std::move(piece), newlines});
+        } else {
+            pieces = cut(piece);
+        }
+        chunks.erase(chunks.begin() + first, chunks.begin() + last + 1);
+        chunks.insert(chunks.begin() + first, pieces.begin(), pieces.end());
+        length = length - count + text.size();
+        reindex(first);
     }
+
+    // Offset where the zero-based line starts, or the text size past the last line
+    size_t lineStart(int line) const {
+        if (line <= 0) return 0;
+        // The last chunk with fewer than line newlines before it holds the line-th newline
+        size_t i = static_cast<size_t>(std::lower_bound(lines.begin(), lines.end(), line) - lines.begin());
+        if (i == 0) return length;
+        const Chunk &chunk = chunks[--i];
+        if (lines[i] + chunk.newlines < line) return length;
+        size_t position = 0;
+        for (int n = lines[i]; n < line; ++n) position = chunk.text.find('\n', position) + 1;
+        return starts[i] + position;
+    }
+
+    // Zero-based line of offset
+    int lineOf(size_t offset) const {
+        if (chunks.empty()) return 0;
+        size_t chunkStart;
+        size_t i = locate(offset, chunkStart);
+        const std::string &text = chunks[i].text;
+        size_t end = std::min(offset - chunkStart, text.size());
+        return lines[i] + static_cast<int>(std::count(text.begin(), text.begin() + end, '\n'));
+    }
+};
+
+// Open or workspace document known to the language server
+struct Document {
+    std::string uri;
+    Rope text;
+    bool open = false;       // Opened by the client, which then owns the text
+    bool usesMacros = false; // Has #define lines, so tokens refer to the preprocessed text
+    std::vector<Token> tokens;
+    std::vector<TokenRange> units;
+    struct Unit {
+        std::vector<FunctionSignature> functions;
+        std::vector<TableDefinition> tables;
+        std::vector<TypeDefinition> types;
+        std::vector<Diagnostic> diagnostics;
+        bool stale = true; // Parsed again but not validated since
+    };
+    std::vector<Unit> unitStates;
 };
 
-// File I/O functions
-std::string readFile(const std::string &filename) {
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        std::cerr << "Error: Cannot open file " << filename << "\n";
-        exit(EXIT_FAILURE);
+std::string uriToPath(const std::string &uri) {
+    std::string path;
+    size_t start = uri.compare(0, 7, "file://") == 0 ? 7 : 0;
+    for (size_t i = start; i < uri.size(); ++i) {
+        if (uri[i] == '%' && i + 2 < uri.size()) {
+            path += static_cast<char>(std::stoi(uri.substr(i + 1, 2), nullptr, 16));
+            i += 2;
+        } else {
+            path += uri[i];
+        }
     }
-    std::ostringstream buffer;
-    buffer << file.rdbuf();
-    return buffer.str();
+    return path;
 }
 
-void writeFile(const std::string &filename, const std::string &content) {
-    std::ofstream file(filename);
-    if (!file.is_open()) {
-        std::cerr << "Error: Cannot write to file " << filename << "\n";
-        exit(EXIT_FAILURE);
+std::string pathToUri(const std::string &path) {
+    std::string uri = "file://";
+    for (unsigned char c : canonicalPath(path)) {
+        if (isalnum(c) || strchr("/-_.~", c)) {
+            uri += static_cast<char>(c);
+        } else {
+            char buffer[4];
+            snprintf(buffer, sizeof(buffer), "%%%02X", c);
+            uri += buffer;
+        }
     }
-    file << content;
+    return uri;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <filename>\n";
-        return EXIT_FAILURE;
+// Stdio JSON-RPC language server. Documents are re-lexed only over the top-level units an
+// edit touches and only those units are parsed again; the global function index is
+// rebuilt, and callers elsewhere validated again, only when a document's signatures
+// change.
+class LanguageServer {
+private:
+    friend struct LanguageServerCheck; // tests/check.cpp compares edited documents with fresh ones
+
+    ThreadPool &pool;
+    const Options &options;
+    std::istream &in;
+    std::ostream &out;
+    std::deque<Document> documents; // Signatures refer to documents by index
+    std::unordered_map<std::string, size_t> byUri;
+    SymbolTable symbols;
+    SymbolTable snapshot;
+    bool shutdownRequested = false;
+    static const size_t completionLimit = 200;
+
+    void send(const Json &message) {
+        std::string body = message.dump();
+        out << "Content-Length: " << body.size() << "\r\n\r\n" << body << std::flush;
+    }
+
+    void respond(const Json &id, Json result) {
+        send(Json::makeObject().set("jsonrpc", "2.0").set("id", id).set("result", std::move(result)));
+    }
+
+    void respondError(const Json &id, int code, const std::string &message) {
+        send(Json::makeObject().set("jsonrpc", "2.0").set("id", id).set(
+            "error", Json::makeObject().set("code", code).set("message", message)));
     }
 
-    std::string filename = argv[1];
-    std::string sourceCode = readFile(filename);
+    // LSP positions count UTF-16 code units within a line
+    static size_t utf8Length(unsigned char lead) {
+        return lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+    }
 
-    // Preprocess the input
-    std::string preprocessedCode = Preprocessor::process(sourceCode);
+    size_t offsetAt(const Document &document, const Json &position) const {
+        int line = position["line"].asInt();
+        size_t start = document.text.lineStart(line);
+        // A UTF-16 code unit takes at most three bytes, and a character cut at the limit one
+        // more, so only that much of the line is read
+        size_t lineLength = document.text.lineStart(line + 1) - start;
+        size_t character = static_cast<size_t>(std::max(position["character"].asInt(), 0));
+        std::string content = document.text.substr(start, std::min(lineLength, character * 3 + 1));
+        size_t offset = 0;
+        for (int units = 0; offset < content.size() && content[offset] != '\n' &&
+                            units < position["character"].asInt();) {
+            size_t length = utf8Length(content[offset]);
+            units += length == 4 ? 2 : 1;
+            offset += length;
+        }
+        return start + std::min(offset, content.size());
+    }
 
-    Lexer lexer(preprocessedCode);
-    auto tokens = lexer.tokenize();
+    Json positionAt(const Document &document, size_t offset) const {
+        int line = document.text.lineOf(offset);
+        size_t start = document.text.lineStart(line);
+        std::string content = document.text.substr(start, offset - start);
+        int character = 0;
+        for (size_t i = 0; i < content.size(); i += utf8Length(content[i])) {
+            character += utf8Length(content[i]) == 4 ? 2 : 1;
+        }
+        return Json::makeObject().set("line", line).set("character", character);
+    }
 
-    Parser parser(tokens);
+    // Range of a token; with macros the offset is in the preprocessed text, so the range
+    // falls back to the start of the line
+    Json rangeOf(const Document &document, size_t offset, size_t length, int line) const {
+        if (document.usesMacros) {
+            Json position = Json::makeObject().set("line", line - 1).set("character", 0);
+            return Json::makeObject().set("start", position).set("end", position);
+        }
+        return Json::makeObject()
+            .set("start", positionAt(document, offset))
+            .set("end", positionAt(document, offset + length));
+    }
 
-    // First pass: Build the function table
-    parser.firstPass();
+    Json location(size_t index, size_t offset, size_t length, int line) const {
+        return Json::makeObject()
+            .set("uri", documents[index].uri)
+            .set("range", rangeOf(documents[index], offset, length, line));
+    }
+
+    void firstPass(Document &document, size_t unit) {
+        Parser parser(document.tokens, document.units[unit].begin, document.units[unit].end);
+        parser.firstPass();
+        document.unitStates[unit].functions = parser.getFunctionTable().signatures();
+        document.unitStates[unit].tables = parser.getTables();
+        document.unitStates[unit].types = parser.getTypes();
+    }
 
-    // Second pass: Validate functions and generate formatted output
-    std::string formattedCode = parser.secondPass();
+    void validate(Document &document, size_t unit) {
+        Parser parser(document.tokens, document.units[unit].begin, document.units[unit].end);
+        parser.setSymbols(symbols);
+        parser.secondPass();
+        document.unitStates[unit].diagnostics = parser.getDiagnostics();
+        document.unitStates[unit].stale = false;
+    }
 
-    std::string outputFilename = filename + ".formatted";
-    writeFile(outputFilename, formattedCode);
+    // Lexes and first-passes the whole document
+    void analyze(Document &document) {
+        std::string text = document.text.str();
+        document.usesMacros = text.find("#define") != std::string::npos;
+        if (document.usesMacros) text = Preprocessor().process(text);
+        document.tokens = Lexer(text).tokenize();
+        document.units = splitUnits(document.tokens);
+        document.unitStates.assign(document.units.size(), {});
+        for (size_t u = 0; u < document.units.size(); ++u) firstPass(document, u);
+    }
 
-    std::cout << "Formatted and validated code written to " << outputFilename << "\n";
+    // Offset where unit u starts; the whitespace before the next unit belongs to u
+    static size_t unitStart(const Document &document, size_t unit) {
+        return unit < document.units.size() ? document.tokens[document.units[unit].begin].offset
+                                            : document.tokens.back().offset;
+    }
+
+    // Applies one edit and re-lexes the units it touches, which are left stale
+    void edit(Document &document, size_t start, size_t end, const std::string &text) {
+        std::string removed = document.text.substr(start, end - start);
+        document.text.replace(start, end - start, text);
+        if (document.usesMacros || text.find("#define") != std::string::npos ||
+            removed.find("#define") != std::string::npos || document.units.empty()) {
+            analyze(document);
+            return;
+        }
+
+        // Units [first, last) cover the edit; an edit at a unit boundary also re-lexes the
+        // unit before it
+        size_t first = 0;
+        while (first + 1 < document.units.size() && unitStart(document, first + 1) < start) first++;
+        size_t last = first;
+        while (last < document.units.size() && unitStart(document, last) <= end) last++;
+        size_t regionStart = first == 0 ? 0 : unitStart(document, first);
+        size_t regionEnd = unitStart(document, last) + text.size() - removed.size();
+
+        std::string region = document.text.substr(regionStart, regionEnd - regionStart);
+        Lexer lexer(region, document.text.lineOf(regionStart) + 1);
+        std::vector<Token> tokens;
+        lexer.lexInto(tokens);
+        for (auto &token : tokens) token.offset += regionStart;
+        tokens.push_back({END_OF_FILE, "", 0, regionEnd});
+        bool closed;
+        std::vector<TokenRange> units = splitUnits(tokens, &closed);
+        tokens.pop_back();
+        // A region that now ends inside a string, comment or body changes later units too
+        if (last < document.units.size() && (lexer.endedInsideToken() || !closed)) {
+            analyze(document);
+            return;
+        }
+
+        size_t tokenBegin = document.units[first].begin;
+        size_t tokenEnd = last < document.units.size() ? document.units[last].begin : document.tokens.size() - 1;
+        long tokenDelta = static_cast<long>(tokens.size()) - static_cast<long>(tokenEnd - tokenBegin);
+        long offsetDelta = static_cast<long>(text.size()) - static_cast<long>(removed.size());
+        int lineDelta = static_cast<int>(std::count(text.begin(), text.end(), '\n') -
+                                         std::count(removed.begin(), removed.end(), '\n'));
+        document.tokens.erase(document.tokens.begin() + tokenBegin, document.tokens.begin() + tokenEnd);
+        document.tokens.insert(document.tokens.begin() + tokenBegin, tokens.begin(), tokens.end());
+        for (size_t i = tokenBegin + tokens.size(); i < document.tokens.size(); ++i) {
+            document.tokens[i].offset += offsetDelta;
+            document.tokens[i].line += lineDelta;
+        }
+        for (size_t u = last; u < document.units.size(); ++u) {
+            document.units[u].begin += tokenDelta;
+            document.units[u].end += tokenDelta;
+            for (auto &function : document.unitStates[u].functions) function.line += lineDelta;
+            for (auto &diagnostic : document.unitStates[u].diagnostics) {
+                diagnostic.line += lineDelta;
+                diagnostic.offset += offsetDelta;
+            }
+            // Messages quote line numbers, so moved diagnostics need the second pass again
+            if (lineDelta != 0 && !document.unitStates[u].diagnostics.empty()) document.unitStates[u].stale = true;
+        }
+        for (auto &unit : units) {
+            unit.begin += tokenBegin;
+            unit.end += tokenBegin;
+        }
+        document.units.erase(document.units.begin() + first, document.units.begin() + last);
+        document.units.insert(document.units.begin() + first, units.begin(), units.end());
+        document.unitStates.erase(document.unitStates.begin() + first, document.unitStates.begin() + last);
+        document.unitStates.insert(document.unitStates.begin() + first, units.size(), {});
+        for (size_t u = first; u < first + units.size(); ++u) firstPass(document, u);
+    }
+
+    // Functions of the document as describeFunctions sees them, plus its table and type
+    // names under a key no call can match, so that new names reach the index too
+    std::map<std::string, std::vector<std::string>> describeDocument(Document &document) {
+        FunctionTable table;
+        std::vector<std::string> names;
+        for (auto &state : document.unitStates) {
+            for (const auto &function : state.functions) table.add(function);
+            for (const auto &definition : state.tables) {
+                names.push_back(definition.name);
+                for (const auto &column : definition.columns) names.push_back(column.name);
+            }
+            for (const auto &definition : state.types) names.push_back(definition.name);
+        }
+        auto description = describeFunctions(table);
+        if (!names.empty()) description[" names"] = std::move(names);
+        return description;
+    }
+
+    void rebuildSymbols() {
+        symbols = SymbolTable();
+        for (size_t i = 0; i < documents.size(); ++i) {
+            for (const auto &state : documents[i].unitStates) {
+                for (auto function : state.functions) {
+                    function.file = static_cast<uint32_t>(i);
+                    symbols.functions.add(std::move(function));
+                }
+            }
+        }
+        for (const auto &function : snapshot.functions.signatures()) symbols.functions.add(function);
+        symbols.tables = snapshot.tables;
+        symbols.types = snapshot.types;
+        for (const auto &document : documents) {
+            for (const auto &state : document.unitStates) {
+                symbols.tables.insert(symbols.tables.end(), state.tables.begin(), state.tables.end());
+                symbols.types.insert(symbols.types.end(), state.types.begin(), state.types.end());
+            }
+        }
+        indexSymbols(symbols);
+    }
+
+    void publish(const Document &document) {
+        Json diagnostics = Json::makeArray();
+        for (const auto &state : document.unitStates) {
+            for (const auto &diagnostic : state.diagnostics) {
+                diagnostics.push(Json::makeObject()
+                                     .set("range", rangeOf(document, diagnostic.offset, diagnostic.length,
+                                                           diagnostic.line))
+                                     .set("severity", diagnostic.severity == Diagnostic::WARNING ? 2 : 1)
+                                     .set("code", diagnosticCodeName(diagnostic.code))
+                                     .set("source", "plpgsql")
+                                     .set("message", diagnostic.message));
+            }
+        }
+        send(Json::makeObject()
+                 .set("jsonrpc", "2.0")
+                 .set("method", "textDocument/publishDiagnostics")
+                 .set("params", Json::makeObject().set("uri", document.uri).set("diagnostics", diagnostics)));
+    }
+
+    // Validates the stale units of open documents and, when the signatures of document
+    // index changed, every unit of an open document calling one of the changed functions
+    void refresh(size_t index, const std::map<std::string, std::vector<std::string>> &before) {
+        auto after = describeDocument(documents[index]);
+        std::set<std::string> changed;
+        for (const auto &entry : before) {
+            auto match = after.find(entry.first);
+            if (match == after.end() || match->second != entry.second) changed.insert(entry.first);
+        }
+        for (const auto &entry : after) {
+            if (!before.count(entry.first)) changed.insert(entry.first);
+        }
+        if (!changed.empty()) rebuildSymbols();
+
+        std::set<size_t> touched;
+        for (size_t i = 0; i < documents.size(); ++i) {
+            Document &document = documents[i];
+            if (!document.open) continue;
+            for (size_t u = 0; u < document.units.size(); ++u) {
+                if (document.unitStates[u].stale || callsAny(document.tokens, document.units[u], changed)) {
+                    validate(document, u);
+                    touched.insert(i);
+                }
+            }
+        }
+        for (size_t i : touched) {
+            if (documents[i].open) publish(documents[i]);
+        }
+    }
+
+    size_t addDocument(const std::string &uri) {
+        auto entry = byUri.emplace(uri, documents.size());
+        if (entry.second) {
+            documents.emplace_back();
+            documents.back().uri = uri;
+        }
+        return entry.first->second;
+    }
+
+    // Identifier under the cursor, or nullptr
+    const Token *tokenAt(const Document &document, const Json &position) const {
+        size_t offset = offsetAt(document, position);
+        auto it = std::upper_bound(document.tokens.begin(), document.tokens.end(), offset,
+                                   [](size_t value, const Token &token) { return value < token.offset; });
+        if (it == document.tokens.begin()) return nullptr;
+        const Token &token = *(it - 1);
+        if (token.type != IDENTIFIER || offset > token.offset + token.value.size()) return nullptr;
+        return &token;
+    }
+
+    // Indexes the files of inputs; files that cannot be read are reported to the client
+    // and left out
+    void loadWorkspace(const std::vector<std::string> &inputs) {
+        std::vector<std::string> filenames = collectInputFiles(inputs);
+        std::vector<std::string> contents(filenames.size());
+        std::vector<Status> statuses(filenames.size());
+        pool.parallelFor(filenames.size(), [&](size_t n) { statuses[n] = readFile(filenames[n], contents[n]); });
+        std::vector<size_t> loaded;
+        for (size_t n = 0; n < filenames.size(); ++n) {
+            if (!statuses[n]) {
+                send(Json::makeObject()
+                         .set("jsonrpc", "2.0")
+                         .set("method", "window/logMessage")
+                         .set("params", Json::makeObject().set("type", 2).set("message", statuses[n].message)));
+                continue;
+            }
+            size_t index = addDocument(pathToUri(filenames[n]));
+            if (documents[index].open) continue; // The client's text wins
+            documents[index].text.assign(contents[n]);
+            loaded.push_back(index);
+        }
+        pool.parallelFor(loaded.size(), [&](size_t n) { analyze(documents[loaded[n]]); });
+        rebuildSymbols();
+    }
+
+    void handle(const Json &message) {
+        const std::string &method = message["method"].string;
+        const Json &id = message["id"];
+        const Json &params = message["params"];
+        if (method == "initialize") {
+            std::vector<std::string> inputs = options.inputs;
+            if (!params["rootUri"].isNull()) inputs.push_back(uriToPath(params["rootUri"].string));
+            else if (!params["rootPath"].isNull()) inputs.push_back(params["rootPath"].string);
+            loadWorkspace(inputs);
+            Json capabilities = Json::makeObject()
+                                    .set("textDocumentSync", Json::makeObject().set("openClose", true).set("change", 2))
+                                    .set("completionProvider", Json::makeObject())
+                                    .set("definitionProvider", true)
+                                    .set("referencesProvider", true)
+                                    .set("documentRangeFormattingProvider", true);
+            respond(id, Json::makeObject()
+                            .set("capabilities", capabilities)
+                            .set("serverInfo", Json::makeObject().set("name", "plpgsql-parser")));
+        } else if (method == "shutdown") {
+            shutdownRequested = true;
+            respond(id, Json());
+        } else if (method == "textDocument/didOpen") {
+            size_t index = addDocument(params["textDocument"]["uri"].string);
+            Document &document = documents[index];
+            auto before = describeDocument(document);
+            document.open = true;
+            document.text.assign(params["textDocument"]["text"].string);
+            analyze(document);
+            refresh(index, before);
+        } else if (method == "textDocument/didChange") {
+            auto found = byUri.find(params["textDocument"]["uri"].string);
+            if (found == byUri.end()) return;
+            Document &document = documents[found->second];
+            auto before = describeDocument(document);
+            for (const auto &change : params["contentChanges"].array) {
+                if (change["range"].isNull()) {
+                    document.text.assign(change["text"].string);
+                    analyze(document);
+                    continue;
+                }
+                size_t start = offsetAt(document, change["range"]["start"]);
+                size_t end = offsetAt(document, change["range"]["end"]);
+                edit(document, start, std::max(start, end), change["text"].string);
+            }
+            refresh(found->second, before);
+        } else if (method == "textDocument/didClose") {
+            auto found = byUri.find(params["textDocument"]["uri"].string);
+            if (found == byUri.end()) return;
+            Document &document = documents[found->second];
+            auto before = describeDocument(document);
+            document.open = false;
+            send(Json::makeObject()
+                     .set("jsonrpc", "2.0")
+                     .set("method", "textDocument/publishDiagnostics")
+                     .set("params", Json::makeObject().set("uri", document.uri).set("diagnostics", Json::makeArray())));
+            // The file on disk is authoritative again; one that cannot be read defines nothing
+            std::string content;
+            if (!readFile(uriToPath(document.uri), content)) content.clear();
+            document.text.assign(content);
+            analyze(document);
+            refresh(found->second, before);
+        } else if (method == "textDocument/completion") {
+            auto found = byUri.find(params["textDocument"]["uri"].string);
+            Json items = Json::makeArray();
+            if (found != byUri.end()) {
+                const Document &document = documents[found->second];
+                size_t offset = offsetAt(document, params["position"]);
+                size_t lineStart = document.text.lineStart(document.text.lineOf(offset));
+                std::string line = document.text.substr(lineStart, offset - lineStart);
+                size_t start = line.size();
+                while (start > 0 && (isalnum(static_cast<unsigned char>(line[start - 1])) || line[start - 1] == '_')) {
+                    start--;
+                }
+                const unsigned allKinds = SymbolIndex::FUNCTION | SymbolIndex::BUILTIN | SymbolIndex::TABLE |
+                                          SymbolIndex::COLUMN | SymbolIndex::TYPE;
+                for (const auto &match : symbols.index.complete(line.substr(start), allKinds, completionLimit)) {
+                    // CompletionItemKind: Function, Struct, Field, Class
+                    int kind = match.kind == SymbolIndex::TABLE    ? 22
+                               : match.kind == SymbolIndex::COLUMN ? 5
+                               : match.kind == SymbolIndex::TYPE   ? 7
+                                                                   : 3;
+                    items.push(Json::makeObject().set("label", match.name).set("kind", kind));
+                }
+            }
+            respond(id, Json::makeObject()
+                            .set("isIncomplete", items.array.size() >= completionLimit)
+                            .set("items", items));
+        } else if (method == "textDocument/definition" || method == "textDocument/references") {
+            auto found = byUri.find(params["textDocument"]["uri"].string);
+            const Token *token = found == byUri.end() ? nullptr : tokenAt(documents[found->second], params["position"]);
+            Json locations = Json::makeArray();
+            if (token && method == "textDocument/definition") {
+                symbols.functions.forEachOverload(token->value, [&](const FunctionSignature &signature) {
+                    if (signature.file >= documents.size()) return;
+                    const Document &document = documents[signature.file];
+                    size_t offset = document.usesMacros ? 0 : document.text.lineStart(signature.line - 1);
+                    locations.push(location(signature.file, offset, 0, signature.line));
+                });
+            } else if (token) {
+                std::set<std::string> name = {lowercase(token->value)};
+                for (size_t i = 0; i < documents.size(); ++i) {
+                    const auto &tokens = documents[i].tokens;
+                    for (size_t t = 0; t + 1 < tokens.size(); ++t) {
+                        if (tokens[t].type == IDENTIFIER && tokens[t + 1].value == "(" &&
+                            name.count(lowercase(tokens[t].value))) {
+                            locations.push(location(i, tokens[t].offset, tokens[t].value.size(), tokens[t].line));
+                        }
+                    }
+                }
+            }
+            respond(id, locations);
+        } else if (method == "textDocument/rangeFormatting") {
+            // Offsets of documents with macros refer to the preprocessed text, so they are
+            // left alone
+            auto found = byUri.find(params["textDocument"]["uri"].string);
+            Json edits = Json::makeArray();
+            if (found != byUri.end() && !documents[found->second].usesMacros) {
+                const Document &document = documents[found->second];
+                size_t start = offsetAt(document, params["range"]["start"]);
+                size_t end = std::max(start, offsetAt(document, params["range"]["end"]));
+                std::string text = document.text.str();
+                // The editor's indentation settings win over the command line's
+                FormatOptions format = options.format;
+                const Json &settings = params["options"];
+                if (settings["tabSize"].kind == Json::NUMBER) {
+                    format.indentWidth = std::max(settings["tabSize"].asInt(), 1);
+                }
+                if (settings["insertSpaces"].kind == Json::BOOLEAN) {
+                    format.tabs = !settings["insertSpaces"].boolean;
+                }
+                TextEdit edit = formatRange(document.tokens, document.units, text, start, end - start, format, pool);
+                if (edit.length > 0 || !edit.text.empty()) {
+                    edits.push(Json::makeObject()
+                                   .set("range", Json::makeObject()
+                                                     .set("start", positionAt(document, edit.offset))
+                                                     .set("end", positionAt(document, edit.offset + edit.length)))
+                                   .set("newText", edit.text));
+                }
+            }
+            respond(id, edits);
+        } else if (!id.isNull()) {
+            respondError(id, -32601, "Method not found: " + method);
+        }
+    }
+
+public:
+    LanguageServer(ThreadPool &pool, const Options &options, std::istream &in = std::cin, std::ostream &out = std::cout)
+        : pool(pool), options(options), in(in), out(out) {}
+
+    // Serves requests from in until the client sends exit
+    int run() {
+        std::ios::sync_with_stdio(false);
+        if (!options.snapshotPath.empty()) {
+            if (Status status = loadSnapshot(options.snapshotPath, snapshot, {}); !status) {
+                std::cerr << "Error: " << status.message << "\n";
+                return EXIT_FAILURE;
+            }
+        }
+        while (true) {
+            size_t contentLength = 0;
+            bool validLength = true;
+            std::string header;
+            while (std::getline(in, header) && header != "\r" && !header.empty()) {
+                if (header.compare(0, 15, "Content-Length:") != 0) continue;
+                size_t begin = std::min(header.find_first_not_of(' ', 15), header.size());
+                size_t end = std::max(header.find_last_not_of(" \r") + 1, begin);
+                const char *last = header.data() + end;
+                validLength = begin < end && std::from_chars(header.data() + begin, last, contentLength).ptr == last;
+            }
+            if (!in) return EXIT_FAILURE;
+            if (!validLength) {
+                // Without a length the body cannot be found, so only the headers are skipped
+                respondError(Json(), -32700, "Parse error: invalid Content-Length header");
+                continue;
+            }
+
+            std::string body(contentLength, '\0');
+            if (!in.read(body.data(), static_cast<std::streamsize>(contentLength))) return EXIT_FAILURE;
+            Json message;
+            if (!Json::parse(body, message)) {
+                respondError(Json(), -32700, "Parse error");
+                continue;
+            }
+            if (message["method"].string == "exit") return shutdownRequested ? EXIT_SUCCESS : EXIT_FAILURE;
+            handle(message);
+        }
+    }
+};
+
+// Parses "a:b" into two numbers
+bool parsePair(const std::string &text, uintmax_t &a, uintmax_t &b) {
+    char *end;
+    a = std::strtoull(text.c_str(), &end, 10);
+    if (end == text.c_str() || *end != ':') return false;
+    const char *second = end + 1;
+    b = std::strtoull(second, &end, 10);
+    return end != second && *end == '\0';
+}
+
+// Range mode: only the statements overlapping the line or byte range of the one input are
+// formatted, without being validated, and the edit applying their formatted code to the
+// file is printed as {"offset", "length", "text"} JSON. Nothing is written.
+int runRange(const std::string &filename, const Options &options, ThreadPool &pool) {
+    std::string content;
+    if (Status status = readFile(filename, content); !status) {
+        std::cerr << "Error: " << status.message << "\n";
+        return EXIT_FAILURE;
+    }
+    uintmax_t offset, length;
+    if (!options.lineRange.empty()) {
+        uintmax_t first, last;
+        if (!parsePair(options.lineRange, first, last) || first == 0 || last < first) {
+            std::cerr << "Error: --lines expects first:last, counted from 1\n";
+            return EXIT_FAILURE;
+        }
+        Rope lines(content);
+        offset = lines.lineStart(static_cast<int>(std::min<uintmax_t>(first - 1, INT_MAX)));
+        length = lines.lineStart(static_cast<int>(std::min<uintmax_t>(last, INT_MAX))) - offset;
+    } else if (!parsePair(options.byteRange, offset, length)) {
+        std::cerr << "Error: --bytes expects offset:length\n";
+        return EXIT_FAILURE;
+    }
+
+    ParsedFile file;
+    file.format = options.format;
+    loadSource(file, content, pool, true);
+    if (file.directives) {
+        std::cerr << "Error: " << filename << " has #define directives, so ranges cannot be formatted\n";
+        return EXIT_FAILURE;
+    }
+    TextEdit edit = formatRange(file.tokens, file.units, content, offset, length, file.format, pool);
+    std::cout << Json::makeObject()
+                     .set("offset", static_cast<double>(edit.offset))
+                     .set("length", static_cast<double>(edit.length))
+                     .set("text", edit.text)
+                     .dump()
+              << "\n";
     return EXIT_SUCCESS;
 }
+
+#ifndef PARSER_NO_MAIN // Defined by tests/check.cpp, which includes this file
+int main(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        if (argument == "-j" && i + 1 < argc) {
+            options.threads = static_cast<unsigned>(std::max(1, atoi(argv[++i])));
+        } else if (argument == "--snapshot" && i + 1 < argc) {
+            options.snapshotPath = argv[++i];
+        } else if (argument == "--write-snapshot" && i + 1 < argc) {
+            options.writeSnapshotPath = argv[++i];
+        } else if (argument == "--cache" && i + 1 < argc) {
+            options.cachePath = argv[++i];
+        } else if (argument == "--cache-size" && i + 1 < argc) {
+            options.cacheSize = std::strtoull(argv[++i], nullptr, 10);
+        } else if (argument == "--stream-threshold" && i + 1 < argc) {
+            options.streamThreshold = std::strtoull(argv[++i], nullptr, 10);
+        } else if (argument == "--width" && i + 1 < argc) {
+            options.format.lineWidth = std::max(1, atoi(argv[++i]));
+        } else if (argument == "--indent" && i + 1 < argc) {
+            options.format.indentWidth = std::max(1, atoi(argv[++i]));
+        } else if (argument == "--tabs") {
+            options.format.tabs = true;
+        } else if (argument == "--keyword-case" && i + 1 < argc) {
+            std::string keywordCase = argv[++i];
+            if (keywordCase != "upper" && keywordCase != "lower" && keywordCase != "preserve") {
+                std::cerr << "Error: --keyword-case expects upper, lower or preserve\n";
+                return EXIT_FAILURE;
+            }
+            options.format.keywordCase = keywordCase == "upper"   ? FormatOptions::UPPER
+                                         : keywordCase == "lower" ? FormatOptions::LOWER
+                                                                  : FormatOptions::PRESERVE;
+        } else if (argument == "--leading-commas") {
+            options.format.leadingCommas = true;
+        } else if (argument == "--diff" && i + 1 < argc) {
+            options.diffRange = argv[++i];
+        } else if (argument == "--in-place") {
+            options.inPlace = true;
+        } else if (argument == "--patch") {
+            options.patch = true;
+        } else if (argument == "--lines" && i + 1 < argc) {
+            options.lineRange = argv[++i];
+        } else if (argument == "--bytes" && i + 1 < argc) {
+            options.byteRange = argv[++i];
+        } else if (argument == "--diagnostics" && i + 1 < argc) {
+            std::string format = argv[++i];
+            if (format != "text" && format != "jsonl" && format != "sarif") {
+                std::cerr << "Error: --diagnostics expects text, jsonl or sarif\n";
+                return EXIT_FAILURE;
+            }
+            options.diagnostics = format == "jsonl"   ? DiagnosticWriter::JSON_LINES
+                                  : format == "sarif" ? DiagnosticWriter::SARIF
+                                                      : DiagnosticWriter::TEXT;
+        } else if (argument == "--diagnostics-file" && i + 1 < argc) {
+            options.diagnosticsPath = argv[++i];
+        } else if (argument == "--check") {
+            options.check = true;
+        } else if (argument == "--watch") {
+            options.watch = true;
+        } else if (argument == "--lsp") {
+            options.languageServer = true;
+        } else {
+            options.inputs.push_back(argument);
+        }
+    }
+    // Each mode runs on its own, and --in-place only applies to formatting files
+    std::vector<std::string> modes;
+    if (options.languageServer) modes.push_back("--lsp");
+    if (options.watch) modes.push_back("--watch");
+    if (options.check) modes.push_back("--check");
+    if (options.patch) modes.push_back("--patch");
+    if (!options.diffRange.empty()) modes.push_back("--diff");
+    if (!options.lineRange.empty()) modes.push_back("--lines");
+    if (!options.byteRange.empty()) modes.push_back("--bytes");
+    if (options.inPlace && !modes.empty()) modes.insert(modes.begin(), "--in-place");
+    if (modes.size() > 1) {
+        std::cerr << "Error: " << modes[0] << " cannot be combined with " << modes[1] << "\n";
+        return EXIT_FAILURE;
+    }
+    if (options.watch && options.diagnostics == DiagnosticWriter::SARIF) {
+        std::cerr << "Error: --watch reports each save as it happens, so it cannot write one SARIF log\n";
+        return EXIT_FAILURE;
+    }
+    if (options.languageServer) {
+        ThreadPool pool(options.threads);
+        return LanguageServer(pool, options).run();
+    }
+    if (options.inputs.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [-j threads] [--snapshot file] [--write-snapshot file]"
+                  << " [--cache dir [--cache-size MiB]] [--stream-threshold MiB] [--width columns]"
+                  << " [--indent columns] [--tabs] [--keyword-case upper|lower|preserve] [--leading-commas]"
+                  << " [--diagnostics text|jsonl|sarif] [--diagnostics-file file]"
+                  << " [--in-place] [--check] [--patch] [--lines first:last | --bytes offset:length]"
+                  << " [--diff base[..head]] [--watch] [--lsp] <filename|directory|glob>...\n";
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> filenames = collectInputFiles(options.inputs);
+    if (filenames.empty()) {
+        std::cerr << "Error: No input files found\n";
+        return EXIT_FAILURE;
+    }
+    ThreadPool pool(options.threads);
+    if (!options.lineRange.empty() || !options.byteRange.empty()) {
+        if (filenames.size() != 1) {
+            std::cerr << "Error: A range is formatted in exactly one file\n";
+            return EXIT_FAILURE;
+        }
+        return runRange(filenames[0], options, pool);
+    }
+    if (options.check) return runCheck(filenames, options, pool);
+    if (options.patch) return runPatch(filenames, options, pool);
+    if (!options.diffRange.empty()) return runDiff(filenames, options, pool);
+    if (options.watch) return runWatch(filenames, options, pool);
+    return runProject(filenames, options, pool);
+}
+#endif
@@ -0,0 +1,1373 @@
+#include "plpgsql_internal.h"
+
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iterator>
+#include <sys/stat.h>
+
+namespace plpgsql {
+
+std::string lowercase(std::string_view value) {
+    std::string result(value);
+    std::transform(result.begin(), result.end(), result.begin(), ::tolower);
+    return result;
+}
+
+// Type id of a pg_type OID; polymorphic pseudo-types and unlisted types are UNKNOWN_TYPE
+constexpr TypeId typeForOid(unsigned oid) {
+    for (size_t i = 0; i < sizeof(builtinTypes) / sizeof(builtinTypes[0]); ++i) {
+        if (builtinTypes[i].oid == oid) return static_cast<TypeId>(i);
+    }
+    return UNKNOWN_TYPE;
+}
+
+TypeTable &typeTable() {
+    static TypeTable table;
+    return table;
+}
+
+// Canonical spellings of type aliases
+const std::unordered_map<std::string, std::string> typeAliases = {
+    {"int", "integer"}, {"int4", "integer"}, {"int2", "smallint"}, {"int8", "bigint"},
+    {"decimal", "numeric"}, {"float4", "real"}, {"float8", "double precision"}, {"float", "double precision"},
+    {"varchar", "character varying"}, {"char", "character"}, {"bool", "boolean"},
+    {"timestamptz", "timestamp with time zone"}, {"timestamp without time zone", "timestamp"},
+    {"timetz", "time with time zone"}, {"time without time zone", "time"}, {"varbit", "bit varying"}
+};
+
+TypeId internTypeName(const std::string &declared) {
+    std::string name = lowercase(declared);
+    bool isArray = name.size() > 2 && name.compare(name.size() - 2, 2, "[]") == 0;
+    if (isArray) name.resize(name.size() - 2);
+    if (name.empty() || name.compare(0, 3, "any") == 0 || name.find('%') != std::string::npos) {
+        return UNKNOWN_TYPE;
+    }
+    auto alias = typeAliases.find(name);
+    if (alias != typeAliases.end()) name = alias->second;
+    return typeTable().intern(isArray ? name + "[]" : name);
+}
+
+// Set of keywords
+const std::set<std::string> keywords = {
+    "select", "insert", "update", "delete", "create", "table", "begin", "end", "declare", "do", "values"
+};
+
+// Reserved SQL words and PL/pgSQL statement words; names that are also common column
+// names, such as key or type, are left alone
+const std::unordered_map<std::string, std::string> casedKeywords = [] {
+    static const char *const words[] = {
+        "all", "alter", "and", "any", "array", "as", "asc", "begin", "between", "both", "by", "cascade", "case",
+        "cast", "check", "close", "collate", "column", "commit", "constant", "constraint", "continue", "create",
+        "cross", "current_date", "current_time", "current_timestamp", "current_user", "cursor", "declare",
+        "default", "delete", "desc", "diagnostics", "distinct", "do", "drop", "each", "else", "elseif", "elsif",
+        "end", "except", "exception", "execute", "exists", "exit", "false", "fetch", "for", "foreach", "foreign",
+        "from", "full", "function", "get", "grant", "group", "having", "if", "ilike", "immutable", "in", "inner",
+        "inout", "insert", "intersect", "into", "is", "join", "language", "lateral", "leading", "left", "like",
+        "limit", "loop", "natural", "not", "notice", "notnull", "null", "of", "offset", "on", "only", "open", "or",
+        "order", "out", "outer", "over", "partition", "perform", "primary", "procedure", "raise", "references",
+        "replace", "return", "returning", "returns", "reverse", "right", "rollback", "select", "set", "setof",
+        "stable", "strict", "table", "then", "to", "trailing", "trigger", "true", "union", "unique", "update",
+        "using", "values", "variadic", "view", "volatile", "warning", "when", "where", "while", "window", "with"};
+    std::unordered_map<std::string, std::string> spellings;
+    for (const char *word : words) {
+        std::string upper = word;
+        std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+        spellings.emplace(word, std::move(upper));
+    }
+    return spellings;
+}();
+
+// Parallel lexing: the buffer is cut into newline-aligned chunks that are lexed
+// speculatively as if each started in plain code. Strings and comments are the only
+// tokens that can cross a newline, so a chunk is only wrong when its predecessor ended
+// inside one; that chunk is re-lexed from the start of the unterminated token. A chunk
+// starting inside a dollar quote is re-lexed too, but only when a string or comment in it
+// met a '$' and could have ended at the closing delimiter.
+const size_t parallelLexThreshold = 1 << 20;
+const size_t minLexChunkSize = 256 << 10;
+
+std::vector<Token> tokenizeParallel(const std::string &input, ThreadPool &pool) {
+    size_t chunkCount = std::min(pool.size() * 4, input.size() / minLexChunkSize);
+    if (input.size() < parallelLexThreshold || pool.size() < 2 || chunkCount < 2) {
+        return Lexer(input).tokenize();
+    }
+
+    struct Chunk {
+        size_t begin = 0;
+        size_t end = 0;
+        std::vector<Token> tokens;
+        bool truncated = false;
+        size_t truncatedStart = 0;
+        bool tagDependent = false;
+        std::vector<std::string> tags; // Dollar-quote delimiters lexed, in order
+        int lineBase = 0;
+    };
+    std::vector<Chunk> chunks(chunkCount);
+    size_t boundary = 0;
+    for (size_t i = 0; i < chunkCount; ++i) {
+        chunks[i].begin = boundary;
+        if (i + 1 == chunkCount) {
+            boundary = input.size();
+        } else {
+            boundary = std::max(boundary, input.size() / chunkCount * (i + 1));
+            size_t newline = input.find('\n', boundary);
+            boundary = newline == std::string::npos ? input.size() : newline + 1;
+        }
+        chunks[i].end = boundary;
+    }
+
+    auto lexChunk = [&](Chunk &chunk, const std::string &openTag) {
+        Lexer lexer(std::string_view(input).substr(chunk.begin, chunk.end - chunk.begin), 1, openTag);
+        chunk.tokens.clear();
+        lexer.lexInto(chunk.tokens);
+        chunk.truncated = lexer.endedInsideToken();
+        chunk.truncatedStart = chunk.begin + lexer.unterminatedOffset();
+        chunk.tagDependent = lexer.dependsOnOpenTag();
+        chunk.tags.clear();
+        for (const auto &token : chunk.tokens) {
+            if (token.type == SYMBOL && token.value.size() > 1 && token.value[0] == '$') {
+                chunk.tags.push_back(token.value);
+            }
+        }
+    };
+    pool.parallelFor(chunkCount, [&](size_t i) { lexChunk(chunks[i], ""); });
+
+    // Fix-up in order, following the dollar quote each chunk starts in: the unterminated
+    // last token of a chunk absorbs the start of the next one
+    std::string openTag;
+    bool relex = false;
+    for (size_t i = 0; i < chunkCount; ++i) {
+        Chunk &chunk = chunks[i];
+        if (relex || (!openTag.empty() && chunk.tagDependent)) lexChunk(chunk, openTag);
+        for (const auto &tag : chunk.tags) {
+            if (openTag.empty()) openTag = tag;
+            else if (openTag == tag) openTag.clear();
+        }
+        relex = chunk.truncated && i + 1 < chunkCount;
+        if (!relex) continue;
+        while (!chunk.tokens.empty() && chunk.begin + chunk.tokens.back().offset >= chunk.truncatedStart) {
+            chunk.tokens.pop_back();
+        }
+        chunk.end = chunk.truncatedStart;
+        chunks[i + 1].begin = chunk.truncatedStart;
+    }
+
+    // Token lines are chunk-relative until shifted by the newlines preceding each chunk
+    std::vector<size_t> offsets(chunkCount + 1, 0);
+    pool.parallelFor(chunkCount, [&](size_t i) {
+        chunks[i].lineBase = static_cast<int>(std::count(input.begin() + chunks[i].begin,
+                                                         input.begin() + chunks[i].end, '\n'));
+    });
+    int lineBase = 0;
+    for (size_t i = 0; i < chunkCount; ++i) {
+        int newlines = chunks[i].lineBase;
+        chunks[i].lineBase = lineBase;
+        lineBase += newlines;
+        offsets[i + 1] = offsets[i] + chunks[i].tokens.size();
+    }
+
+    std::vector<Token> tokens(offsets[chunkCount]);
+    pool.parallelFor(chunkCount, [&](size_t i) {
+        size_t out = offsets[i];
+        for (auto &token : chunks[i].tokens) {
+            token.line += chunks[i].lineBase;
+            token.offset += chunks[i].begin;
+            tokens[out++] = std::move(token);
+        }
+    });
+    tokens.push_back({END_OF_FILE, "", lineBase + 1, input.size()});
+    return tokens;
+}
+
+// Built-in function catalog, compiled from pg_proc.inc for the PostgreSQL major version
+// selected with -DPG_CATALOG_VERSION. Rows are filtered by version and indexed by a
+// hash-and-displace perfect hash at compile time, so lookups need no startup work.
+#ifndef PG_CATALOG_VERSION
+#define PG_CATALOG_VERSION 16
+#endif
+
+struct CatalogRow {
+    const char *name;
+    const char *argumentOids; // proargtypes
+    int defaults;             // pronargdefaults
+    unsigned variadicOid;     // provariadic
+    char volatility;          // provolatile
+    char parallel;            // proparallel
+    int since;
+};
+
+constexpr CatalogRow catalogRows[] = {
+#define PG_PROC(name, argumentOids, defaults, variadicOid, volatility, parallel, since) \
+    {name, argumentOids, defaults, variadicOid, volatility, parallel, since},
+#include "pg_proc.inc"
+#undef PG_PROC
+};
+
+const size_t maxBuiltinArguments = 8;
+
+struct BuiltinFunction {
+    std::string_view name;
+    TypeId argumentTypes[maxBuiltinArguments] = {};
+    size_t argumentCount = 0;
+    size_t requiredArguments = 0;
+    bool variadic = false;
+    char volatility = 'v';
+    char parallel = 'u';
+    int line = 0; // Built-ins have no definition line
+
+    bool acceptsArity(size_t count) const {
+        return count >= requiredArguments && (variadic || count <= argumentCount);
+    }
+
+    TypeId parameterType(size_t index) const {
+        return argumentTypes[std::min(index, argumentCount - 1)];
+    }
+
+    std::string describeArity() const {
+        if (variadic) return concat("at least ", requiredArguments);
+        if (requiredArguments == argumentCount) return concat(requiredArguments);
+        return concat(requiredArguments, " to ", argumentCount);
+    }
+};
+
+// Overloads of one name: functions[first, first + count)
+struct BuiltinName {
+    std::string_view name;
+    uint16_t first = 0;
+    uint16_t count = 0;
+};
+
+constexpr char asciiLower(char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+constexpr bool sameCatalogName(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (asciiLower(a[i]) != asciiLower(b[i])) return false;
+    }
+    return true;
+}
+
+// Seeded FNV-1a over the lowercase name with a final avalanche, so each seed gives an
+// independent placement
+constexpr uint32_t catalogHash(std::string_view name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (char c : name) {
+        hash = (hash ^ static_cast<unsigned char>(asciiLower(c))) * 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+constexpr bool rowAvailable(const CatalogRow &row) {
+    return row.since <= PG_CATALOG_VERSION;
+}
+
+constexpr size_t catalogRowCount = sizeof(catalogRows) / sizeof(catalogRows[0]);
+
+constexpr size_t countBuiltinFunctions() {
+    size_t count = 0;
+    for (const auto &row : catalogRows) count += rowAvailable(row);
+    return count;
+}
+
+constexpr size_t countBuiltinNames() {
+    size_t count = 0;
+    std::string_view previous;
+    for (const auto &row : catalogRows) {
+        if (!rowAvailable(row) || previous == row.name) continue;
+        previous = row.name;
+        count++;
+    }
+    return count;
+}
+
+constexpr bool catalogOverloadsAdjacent() {
+    for (size_t i = 1; i < catalogRowCount; ++i) {
+        if (std::string_view(catalogRows[i].name) == catalogRows[i - 1].name) continue;
+        for (size_t j = 0; j + 1 < i; ++j) {
+            if (std::string_view(catalogRows[j].name) == catalogRows[i].name) return false;
+        }
+    }
+    return true;
+}
+static_assert(catalogOverloadsAdjacent(), "overloads in pg_proc.inc must be adjacent");
+
+constexpr size_t builtinFunctionCount = countBuiltinFunctions();
+constexpr size_t builtinNameCount = countBuiltinNames();
+
+constexpr size_t catalogSlotCount() {
+    size_t slots = 1;
+    while (slots < builtinNameCount * 2) slots *= 2;
+    return slots;
+}
+
+constexpr size_t builtinSlotCount = catalogSlotCount();
+constexpr size_t builtinBucketCount = builtinNameCount / 4 + 1;
+
+struct BuiltinCatalog {
+    std::array<BuiltinFunction, builtinFunctionCount> functions{};
+    std::array<BuiltinName, builtinNameCount> names{};
+    std::array<uint16_t, builtinSlotCount> slots{};     // Name index + 1, 0 when empty
+    std::array<uint32_t, builtinBucketCount> seeds{};   // Displacement seed per bucket
+
+    const BuiltinName *find(std::string_view name) const {
+        uint32_t seed = seeds[catalogHash(name, 0) % builtinBucketCount];
+        uint16_t entry = slots[catalogHash(name, seed) % builtinSlotCount];
+        if (entry == 0 || !sameCatalogName(names[entry - 1].name, name)) return nullptr;
+        return &names[entry - 1];
+    }
+};
+
+constexpr BuiltinFunction makeBuiltinFunction(const CatalogRow &row) {
+    BuiltinFunction function;
+    function.name = row.name;
+    unsigned oid = 0;
+    bool inNumber = false;
+    for (const char *c = row.argumentOids;; ++c) {
+        if (*c >= '0' && *c <= '9') {
+            oid = oid * 10 + static_cast<unsigned>(*c - '0');
+            inNumber = true;
+        } else if (inNumber) {
+            if (function.argumentCount == maxBuiltinArguments) throw "too many arguments in pg_proc.inc row";
+            function.argumentTypes[function.argumentCount++] = typeForOid(oid);
+            oid = 0;
+            inNumber = false;
+        }
+        if (*c == '\0') break;
+    }
+    function.requiredArguments = function.argumentCount - static_cast<size_t>(row.defaults);
+    if (row.variadicOid != 0) {
+        function.variadic = true;
+        function.argumentTypes[function.argumentCount - 1] = typeForOid(row.variadicOid);
+    }
+    function.volatility = row.volatility;
+    function.parallel = row.parallel;
+    return function;
+}
+
+constexpr BuiltinCatalog buildBuiltinCatalog() {
+    BuiltinCatalog catalog;
+    size_t functionCount = 0;
+    size_t nameCount = 0;
+    for (const auto &row : catalogRows) {
+        if (!rowAvailable(row)) continue;
+        if (nameCount == 0 || catalog.names[nameCount - 1].name != row.name) {
+            catalog.names[nameCount++] = {row.name, static_cast<uint16_t>(functionCount), 0};
+        }
+        catalog.names[nameCount - 1].count++;
+        catalog.functions[functionCount++] = makeBuiltinFunction(row);
+    }
+
+    // Hash and displace: place the largest buckets first, searching for a seed that maps
+    // every name of the bucket to a distinct free slot
+    std::array<size_t, builtinNameCount> bucketOf{};
+    std::array<size_t, builtinBucketCount> bucketSize{};
+    size_t largestBucket = 0;
+    for (size_t i = 0; i < builtinNameCount; ++i) {
+        bucketOf[i] = catalogHash(catalog.names[i].name, 0) % builtinBucketCount;
+        largestBucket = std::max(largestBucket, ++bucketSize[bucketOf[i]]);
+    }
+    for (size_t size = largestBucket; size > 0; --size) {
+        for (size_t bucket = 0; bucket < builtinBucketCount; ++bucket) {
+            if (bucketSize[bucket] != size) continue;
+            for (uint32_t seed = 1;; ++seed) {
+                if (seed > 1000000) throw "no perfect hash seed found for pg_proc.inc";
+                std::array<size_t, builtinNameCount> placed{};
+                size_t placedCount = 0;
+                bool fits = true;
+                for (size_t i = 0; i < builtinNameCount && fits; ++i) {
+                    if (bucketOf[i] != bucket) continue;
+                    size_t slot = catalogHash(catalog.names[i].name, seed) % builtinSlotCount;
+                    fits = catalog.slots[slot] == 0;
+                    for (size_t p = 0; p < placedCount && fits; ++p) {
+                        fits = catalogHash(catalog.names[placed[p]].name, seed) % builtinSlotCount != slot;
+                    }
+                    placed[placedCount++] = i;
+                }
+                if (!fits) continue;
+                for (size_t p = 0; p < placedCount; ++p) {
+                    size_t slot = catalogHash(catalog.names[placed[p]].name, seed) % builtinSlotCount;
+                    catalog.slots[slot] = static_cast<uint16_t>(placed[p] + 1);
+                }
+                catalog.seeds[bucket] = seed;
+                break;
+            }
+        }
+    }
+    return catalog;
+}
+
+constexpr BuiltinCatalog builtinCatalog = buildBuiltinCatalog();
+
+Resolution resolveBuiltin(std::string_view name, const std::vector<TypeId> &argumentTypes) {
+    const BuiltinName *entry = builtinCatalog.find(name);
+    if (!entry) return {Resolution::UNKNOWN_FUNCTION, 0, 0, ""};
+    return resolveOverloads(
+        entry->count,
+        [&](auto visit) {
+            for (size_t i = entry->first; i < entry->first + entry->count; ++i) visit(builtinCatalog.functions[i]);
+        },
+        argumentTypes);
+}
+
+const uint32_t builtinCatalogVersion = PG_CATALOG_VERSION;
+
+void indexSymbols(SymbolTable &symbols) {
+    symbols.index = SymbolIndex();
+    for (const auto &signature : symbols.functions.signatures()) {
+        symbols.index.insert(signature.name, SymbolIndex::FUNCTION);
+    }
+    if (!symbols.outer) {
+        for (const auto &name : builtinCatalog.names) symbols.index.insert(name.name, SymbolIndex::BUILTIN);
+    }
+    for (const auto &table : symbols.tables) {
+        symbols.index.insert(table.name, SymbolIndex::TABLE);
+        for (const auto &column : table.columns) symbols.index.insert(column.name, SymbolIndex::COLUMN);
+    }
+    for (const auto &type : symbols.types) symbols.index.insert(type.name, SymbolIndex::TYPE);
+}
+
+std::vector<TokenRange> splitUnits(const std::vector<Token> &tokens, bool *endsAtBoundary) {
+    std::vector<TokenRange> units;
+    size_t unitBegin = 0;
+    int depth = 0;
+    std::string openTag; // Delimiter of the enclosing dollar-quoted body, if any
+    for (size_t i = 0; i < tokens.size() && tokens[i].type != END_OF_FILE; ++i) {
+        const Token &token = tokens[i];
+        if (token.type != SYMBOL) continue;
+        if (token.value.size() > 1 && token.value[0] == '$') {
+            if (openTag.empty()) openTag = token.value;
+            else if (openTag == token.value) openTag.clear();
+        } else if (token.value == "(") {
+            depth++;
+        } else if (token.value == ")") {
+            depth = std::max(depth - 1, 0);
+        } else if (token.value == ";" && depth == 0 && openTag.empty()) {
+            units.push_back({unitBegin, i + 1});
+            unitBegin = i + 1;
+        }
+    }
+    size_t last = tokens.empty() ? 0 : tokens.size() - 1;
+    if (unitBegin < last) units.push_back({unitBegin, last});
+    if (endsAtBoundary) *endsAtBoundary = unitBegin >= last;
+    return units;
+}
+
+uint64_t hashBytes(std::string_view data, uint64_t hash) {
+    for (char c : data) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+uint64_t hashValue(uint64_t value, uint64_t hash) {
+    return hashBytes(std::string_view(reinterpret_cast<const char *>(&value), sizeof(value)), hash);
+}
+
+void prepareUnits(ParsedFile &file) {
+    prepareUnits(file, splitUnits(file.tokens));
+}
+
+void prepareUnits(ParsedFile &file, std::vector<TokenRange> units) {
+    file.units = std::move(units);
+    file.parsers.resize(file.units.size());
+    file.unitOutputs.clear(); // Earlier outputs may borrow from text that is gone
+    file.unitOutputs.resize(file.units.size());
+    file.unitKeys.resize(file.units.size());
+    file.cacheEntries.resize(file.units.size());
+}
+
+int unitLine(const ParsedFile &file, size_t unit) {
+    return file.tokens[file.units[unit].begin].line;
+}
+
+std::string_view unitSource(const ParsedFile &file, size_t unit) {
+    const TokenRange &range = file.units[unit];
+    size_t begin = unit > 0 ? file.tokens[file.units[unit - 1].end - 1].offset + 1 : file.codeOffset;
+    size_t end = file.tokens[range.end].offset; // The next unit or the END_OF_FILE marker
+    begin = std::min(begin - file.codeOffset, file.preprocessedCode.size());
+    end = std::clamp(end - file.codeOffset, begin, file.preprocessedCode.size());
+    return std::string_view(file.preprocessedCode).substr(begin, end - begin);
+}
+
+void firstPassUnit(ParsedFile &file, size_t unit, AnalysisCache *cache) {
+    if (cache) {
+        file.unitKeys[unit] = AnalysisCache::unitKey(file.tokens, file.units[unit].begin, file.units[unit].end,
+                                                     unitSource(file, unit), file.format);
+        file.cacheEntries[unit] = std::make_unique<CacheEntry>();
+        if (cache->load(file.unitKeys[unit], *file.cacheEntries[unit])) return;
+    }
+    file.parsers[unit] = std::make_unique<Parser>(file.tokens, file.units[unit].begin, file.units[unit].end);
+    Parser &parser = *file.parsers[unit];
+    parser.firstPass();
+    if (cache) {
+        CacheEntry &entry = *file.cacheEntries[unit];
+        int base = unitLine(file, unit);
+        entry.functions = parser.getFunctionTable().signatures();
+        for (auto &function : entry.functions) function.line -= base;
+        entry.tables = parser.getTables();
+        for (auto &table : entry.tables) table.line -= base;
+        entry.types = parser.getTypes();
+        for (auto &type : entry.types) type.line -= base;
+    }
+}
+
+void secondPassUnit(ParsedFile &file, size_t unit, const SymbolTable &symbols, AnalysisCache *cache) {
+    int base = unitLine(file, unit);
+    if (cache) {
+        CacheEntry &entry = *file.cacheEntries[unit];
+        if (entry.loaded) {
+            if (entry.dependencyHash == AnalysisCache::dependencyHash(entry.dependencies, symbols) &&
+                (entry.diagnostics.empty() || entry.baseLine == base)) {
+                for (auto &diagnostic : entry.diagnostics) {
+                    diagnostic.line += base;
+                    diagnostic.offset += file.tokens[file.units[unit].begin].offset;
+                }
+                file.unitOutputs[unit] = OutputBuffer(std::move(entry.output));
+                cache->hits++;
+                return;
+            }
+            file.parsers[unit] = std::make_unique<Parser>(file.tokens, file.units[unit].begin, file.units[unit].end);
+            cache->revalidated++;
+        } else {
+            cache->misses++;
+        }
+    }
+    Parser &parser = *file.parsers[unit];
+    parser.setSymbols(symbols);
+    parser.secondPass();
+    file.unitOutputs[unit] = formatUnit(file.tokens, file.preprocessedCode, file.codeOffset, file.units[unit].begin,
+                                        file.units[unit].end, file.format);
+    if (cache) {
+        CacheEntry &entry = *file.cacheEntries[unit];
+        entry.baseLine = base;
+        entry.dependencies = parser.getDependencies();
+        entry.dependencyHash = AnalysisCache::dependencyHash(entry.dependencies, symbols);
+        entry.output = file.unitOutputs[unit].str();
+        entry.diagnostics = parser.getDiagnostics();
+        for (auto &diagnostic : entry.diagnostics) {
+            diagnostic.line -= base;
+            diagnostic.offset -= file.tokens[file.units[unit].begin].offset;
+        }
+        cache->store(file.unitKeys[unit], entry);
+    }
+}
+
+void mergeSymbols(ParsedFile &file, uint32_t fileIndex, SymbolTable &symbols) {
+    for (size_t unit = 0; unit < file.units.size(); ++unit) {
+        if (!file.parsers[unit]) { // Served from the cache
+            const CacheEntry &entry = *file.cacheEntries[unit];
+            int base = unitLine(file, unit);
+            for (auto signature : entry.functions) {
+                signature.line += base;
+                signature.file = fileIndex;
+                symbols.functions.add(std::move(signature));
+            }
+            for (auto table : entry.tables) {
+                table.line += base;
+                table.file = fileIndex;
+                symbols.tables.push_back(std::move(table));
+            }
+            for (auto type : entry.types) {
+                type.line += base;
+                type.file = fileIndex;
+                symbols.types.push_back(std::move(type));
+            }
+            continue;
+        }
+        auto &parser = file.parsers[unit];
+        for (auto &signature : parser->getFunctionTable().signatures()) {
+            signature.file = fileIndex;
+            symbols.functions.add(std::move(signature));
+        }
+        for (auto &table : parser->getTables()) {
+            table.file = fileIndex;
+            symbols.tables.push_back(std::move(table));
+        }
+        for (auto &type : parser->getTypes()) {
+            type.file = fileIndex;
+            symbols.types.push_back(std::move(type));
+        }
+    }
+}
+
+void assembleOutput(ParsedFile &file) {
+    for (size_t i = 0; i < file.units.size(); ++i) {
+        file.formattedCode.append(std::move(file.unitOutputs[i]));
+        auto &diagnostics = file.parsers[i] ? file.parsers[i]->getDiagnostics() : file.cacheEntries[i]->diagnostics;
+        std::move(diagnostics.begin(), diagnostics.end(), std::back_inserter(file.diagnostics));
+    }
+    file.parsers.clear();
+    file.cacheEntries.clear();
+    file.unitOutputs.clear();
+}
+
+void loadSource(ParsedFile &file, std::string_view sourceCode, ThreadPool &pool, bool parallelLex) {
+    file.size = sourceCode.size();
+    file.contentHash = hashBytes(sourceCode);
+    Preprocessor preprocessor;
+    file.preprocessedCode = preprocessor.process(sourceCode);
+    file.directives = preprocessor.substituted();
+    file.tokens = parallelLex ? tokenizeParallel(file.preprocessedCode, pool) : Lexer(file.preprocessedCode).tokenize();
+    prepareUnits(file);
+}
+
+std::vector<WorkItem> scheduleWork(const std::vector<ParsedFile> &files, size_t workers) {
+    size_t totalCost = 0;
+    for (const auto &file : files) totalCost += file.tokens.size();
+    size_t shareCost = std::max<size_t>(totalCost / (workers * 4), 1);
+
+    std::vector<WorkItem> items;
+    for (size_t f = 0; f < files.size(); ++f) {
+        const auto &units = files[f].units;
+        if (units.empty()) continue;
+        if (files[f].tokens.size() <= shareCost) {
+            items.push_back({f, 0, units.size(), files[f].tokens.size()});
+            continue;
+        }
+        WorkItem item{f, 0, 0, 0};
+        for (size_t u = 0; u < units.size(); ++u) {
+            size_t unitCost = units[u].end - units[u].begin;
+            if (item.cost > 0 && item.cost + unitCost > shareCost) {
+                items.push_back(item);
+                item = {f, u, u, 0};
+            }
+            item.endUnit = u + 1;
+            item.cost += unitCost;
+        }
+        items.push_back(item);
+    }
+    std::stable_sort(items.begin(), items.end(),
+                     [](const WorkItem &a, const WorkItem &b) { return a.cost > b.cost; });
+    return items;
+}
+
+// File I/O functions
+Status readFile(const std::string &path, std::string &content) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) return Status::failure("Cannot open file " + path);
+    std::ostringstream buffer;
+    buffer << file.rdbuf();
+    content = buffer.str();
+    return {};
+}
+
+Status collectStreamed(ParsedFile &file, uint32_t fileIndex, SymbolTable &symbols, ThreadPool &pool) {
+    StatementReader reader(file.path);
+    ParsedFile batch;
+    while (reader.next(batch)) {
+        pool.parallelFor(batch.units.size(), [&](size_t unit) { firstPassUnit(batch, unit, nullptr); });
+        mergeSymbols(batch, fileIndex, symbols);
+    }
+    file.size = reader.size();
+    file.contentHash = reader.contentHash();
+    file.directives = reader.directives();
+    return reader.status();
+}
+
+Status formatStreamed(const ParsedFile &file, const std::string &outputPath, const SymbolTable &symbols,
+                      ThreadPool &pool, const std::function<void(const std::vector<Diagnostic> &)> &report,
+                      uint64_t *outputHash) {
+    int fd = open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) return Status::failure("Cannot write to file " + outputPath);
+    std::vector<std::string> sources; // Batch text the pending output borrows from
+    uint64_t hash = hashBytes("");
+    auto flush = [&](OutputBuffer &output) {
+        if (outputHash) hash = hashOutput(output, hash);
+        bool flushed = writeAll(fd, output);
+        output.clear();
+        sources.clear();
+        return flushed;
+    };
+
+    StatementReader reader(file.path);
+    ParsedFile batch;
+    OutputBuffer output;
+    bool written = true;
+    while (written && reader.next(batch)) {
+        pool.parallelFor(batch.units.size(), [&](size_t unit) {
+            batch.parsers[unit] = std::make_unique<Parser>(batch.tokens, batch.units[unit].begin, batch.units[unit].end);
+            secondPassUnit(batch, unit, symbols, nullptr);
+        });
+        assembleOutput(batch);
+        report(batch.diagnostics);
+        output.append(std::move(batch.formattedCode));
+        if (output.borrows()) sources.push_back(std::move(batch.preprocessedCode));
+        if (output.size() >= outputFlushSize) written = flush(output);
+    }
+    written = written && flush(output);
+    if (close(fd) != 0 || !written) return Status::failure("Cannot write to file " + outputPath);
+    if (outputHash) *outputHash = hash;
+    return reader.status();
+}
+
+// Formats the units of file window by window and feeds the output to checker, each window
+// followed by the text it should match; the rest of the text is fed at the end
+void checkUnits(const ParsedFile &file, ThreadPool &pool, FormatChecker &checker) {
+    std::string_view text = file.preprocessedCode;
+    size_t windowSize = pool.size() * 4;
+    std::vector<OutputBuffer> outputs(windowSize);
+    size_t outputSize = 0;
+    size_t textFed = 0;
+    for (size_t first = 0; first < file.units.size() && !checker.differs(); first += windowSize) {
+        size_t count = std::min(windowSize, file.units.size() - first);
+        pool.parallelFor(count, [&](size_t n) {
+            const TokenRange &range = file.units[first + n];
+            outputs[n] = formatUnit(file.tokens, text, file.codeOffset, range.begin, range.end, file.format);
+        });
+        for (size_t n = 0; n < count; ++n) {
+            checker.output(outputs[n]);
+            outputSize += outputs[n].size();
+            outputs[n].clear();
+        }
+        size_t due = std::min(outputSize, text.size());
+        if (due > textFed) checker.text(text.substr(textFed, due - textFed));
+        textFed = std::max(textFed, due);
+    }
+    checker.text(text.substr(textFed));
+}
+
+FormatDifference checkFormatted(const ParsedFile &file, ThreadPool &pool) {
+    FormatChecker checker;
+    checkUnits(file, pool, checker);
+    return checker.finish();
+}
+
+Status checkStreamed(const ParsedFile &file, ThreadPool &pool, FormatDifference &difference) {
+    StatementReader reader(file.path);
+    ParsedFile batch;
+    batch.format = file.format;
+    FormatChecker checker;
+    while (!checker.differs() && reader.next(batch)) checkUnits(batch, pool, checker);
+    difference = checker.finish();
+    return reader.status();
+}
+
+OutputBuffer formatUnit(const std::vector<Token> &tokens, std::string_view source, size_t sourceOffset, size_t begin,
+                        size_t end, const FormatOptions &options) {
+    auto run = [&](auto style) {
+        return Formatter<decltype(style)>(tokens, source, sourceOffset, begin, end, options).format();
+    };
+    if (DefaultStyle::matches(options)) return run(DefaultStyle(options));
+    if (UpperCaseStyle::matches(options)) return run(UpperCaseStyle(options));
+    if (LowerCaseStyle::matches(options)) return run(LowerCaseStyle(options));
+    if (TwoSpaceStyle::matches(options)) return run(TwoSpaceStyle(options));
+    if (TabStyle::matches(options)) return run(TabStyle(options));
+    return run(RuntimeStyle(options));
+}
+
+OutputBuffer formatUnvalidated(const ParsedFile &file, ThreadPool &pool) {
+    std::vector<OutputBuffer> outputs(file.units.size());
+    pool.parallelFor(file.units.size(), [&](size_t unit) {
+        outputs[unit] = formatUnit(file.tokens, file.preprocessedCode, file.codeOffset, file.units[unit].begin,
+                                   file.units[unit].end, file.format);
+    });
+    OutputBuffer formatted;
+    for (auto &output : outputs) formatted.append(std::move(output));
+    return formatted;
+}
+
+TextEdit formatRange(const std::vector<Token> &tokens, const std::vector<TokenRange> &units, std::string_view source,
+                     size_t offset, size_t length, const FormatOptions &format, ThreadPool &pool) {
+    offset = std::min(offset, source.size());
+    size_t rangeEnd = offset + std::min(length, source.size() - offset);
+    // Unit u spans from its first token to the first token of the next; an empty range
+    // still selects the unit it lies in
+    auto unitStart = [&](size_t u) { return u < units.size() ? tokens[units[u].begin].offset : source.size(); };
+    size_t first = 0;
+    while (first + 1 < units.size() && unitStart(first + 1) <= offset) first++;
+    size_t last = first;
+    while (last < units.size() && (last == first || unitStart(last) < rangeEnd)) last++;
+    if (first == last) return {offset, 0, ""};
+
+    std::vector<OutputBuffer> outputs(last - first);
+    pool.parallelFor(outputs.size(), [&](size_t n) {
+        outputs[n] = formatUnit(tokens, source, 0, units[first + n].begin, units[first + n].end, format);
+    });
+
+    // Every unit but the last ends with its ';'
+    size_t start = first > 0 ? tokens[units[first - 1].end - 1].offset + 1 : 0;
+    size_t end = last < units.size() ? tokens[units[last - 1].end - 1].offset + 1 : source.size();
+    start = std::min(start, source.size());
+    end = std::clamp(end, start, source.size());
+    // Formatted units each end with a newline, so the edit starts with the one of the unit
+    // before and leaves out its own last one, unless nothing follows
+    std::string text = first > 0 ? "\n" : "";
+    for (auto &output : outputs) text += output.str();
+    if (last < units.size() && !text.empty() && text.back() == '\n') text.pop_back();
+
+    // Only the bytes that change are replaced
+    std::string_view original = source.substr(start, end - start);
+    size_t prefix = 0;
+    while (prefix < original.size() && prefix < text.size() && original[prefix] == text[prefix]) prefix++;
+    size_t suffix = 0;
+    while (suffix < original.size() - prefix && suffix < text.size() - prefix &&
+           original[original.size() - 1 - suffix] == text[text.size() - 1 - suffix]) {
+        suffix++;
+    }
+    return {start + prefix, original.size() - prefix - suffix, text.substr(prefix, text.size() - prefix - suffix)};
+}
+
+std::vector<std::string_view> splitLines(std::string_view text) {
+    std::vector<std::string_view> lines;
+    while (!text.empty()) {
+        size_t newline = text.find('\n');
+        size_t length = newline == std::string_view::npos ? text.size() : newline + 1;
+        lines.push_back(text.substr(0, length));
+        text.remove_prefix(length);
+    }
+    return lines;
+}
+
+// Myers' difference algorithm in its linear-space form: each step finds the middle snake
+// of the remaining ranges, searching from both ends at once, and splits the problem there.
+// Lines are compared by hash first. Past maxCost differences on one range the search stops
+// at the furthest point the forward search reached; the result is then still a correct
+// diff, only not always a minimal one.
+class LineDiffer {
+private:
+    static const long maxCost = 1024;
+    const std::vector<std::string_view> &a;
+    const std::vector<std::string_view> &b;
+    std::vector<uint64_t> aHashes;
+    std::vector<uint64_t> bHashes;
+    std::vector<long> forward;  // Furthest x reached per diagonal, from the start
+    std::vector<long> backward; // Furthest x reached per diagonal, from the end
+    std::vector<LineChange> changes;
+
+    bool equal(size_t i, size_t j) const { return aHashes[i] == bHashes[j] && a[i] == b[j]; }
+
+    void change(size_t aBegin, size_t aEnd, size_t bBegin, size_t bEnd) {
+        if (aBegin == aEnd && bBegin == bEnd) return;
+        if (!changes.empty() && changes.back().aEnd == aBegin && changes.back().bEnd == bBegin) {
+            changes.back().aEnd = aEnd;
+            changes.back().bEnd = bEnd;
+            return;
+        }
+        changes.push_back({aBegin, aEnd, bBegin, bEnd});
+    }
+
+    // Point of a[aBegin, aEnd) and b[bBegin, bEnd), relative to their starts, that a
+    // shortest edit script passes through; both ranges are non-empty and differ in their
+    // first and last lines
+    std::pair<long, long> middleSnake(size_t aBegin, size_t aEnd, size_t bBegin, size_t bEnd) {
+        long n = static_cast<long>(aEnd - aBegin);
+        long m = static_cast<long>(bEnd - bBegin);
+        long maxD = (n + m + 1) / 2;
+        long offset = maxD + 1;
+        forward.assign(static_cast<size_t>(2 * offset + 1), -1);
+        backward.assign(static_cast<size_t>(2 * offset + 1), -1);
+        forward[static_cast<size_t>(offset + 1)] = 0;
+        backward[static_cast<size_t>(offset + 1)] = 0;
+        long delta = n - m;
+        bool odd = (delta & 1) != 0;
+        // Diagonals that ran off an edge are skipped from then on
+        long forwardStart = 0, forwardEnd = 0, backwardStart = 0, backwardEnd = 0;
+        std::pair<long, long> furthest{0, 0};
+        for (long d = 0; d < maxD && d <= maxCost; ++d) {
+            for (long k = -d + forwardStart; k <= d - forwardEnd; k += 2) {
+                size_t at = static_cast<size_t>(offset + k);
+                long x = k == -d || (k != d && forward[at - 1] < forward[at + 1]) ? forward[at + 1] : forward[at - 1] + 1;
+                long y = x - k;
+                while (x < n && y < m && equal(aBegin + static_cast<size_t>(x), bBegin + static_cast<size_t>(y))) {
+                    x++;
+                    y++;
+                }
+                forward[at] = x;
+                if (x > n) {
+                    forwardEnd += 2;
+                } else if (y > m) {
+                    forwardStart += 2;
+                } else {
+                    if (x + y > furthest.first + furthest.second) furthest = {x, y};
+                    long opposite = offset + delta - k;
+                    if (odd && opposite >= 0 && opposite < static_cast<long>(backward.size()) &&
+                        backward[static_cast<size_t>(opposite)] != -1 && x >= n - backward[static_cast<size_t>(opposite)]) {
+                        return {x, y};
+                    }
+                }
+            }
+            for (long k = -d + backwardStart; k <= d - backwardEnd; k += 2) {
+                size_t at = static_cast<size_t>(offset + k);
+                long x = k == -d || (k != d && backward[at - 1] < backward[at + 1]) ? backward[at + 1]
+                                                                                     : backward[at - 1] + 1;
+                long y = x - k;
+                while (x < n && y < m &&
+                       equal(aEnd - 1 - static_cast<size_t>(x), bEnd - 1 - static_cast<size_t>(y))) {
+                    x++;
+                    y++;
+                }
+                backward[at] = x;
+                if (x > n) {
+                    backwardEnd += 2;
+                } else if (y > m) {
+                    backwardStart += 2;
+                } else if (!odd) {
+                    long opposite = offset + delta - k;
+                    if (opposite >= 0 && opposite < static_cast<long>(forward.size()) &&
+                        forward[static_cast<size_t>(opposite)] != -1) {
+                        long forwardX = forward[static_cast<size_t>(opposite)];
+                        if (forwardX >= n - x) return {forwardX, forwardX - (opposite - offset)};
+                    }
+                }
+            }
+        }
+        return furthest;
+    }
+
+    void compare(size_t aBegin, size_t aEnd, size_t bBegin, size_t bEnd) {
+        while (aBegin < aEnd && bBegin < bEnd && equal(aBegin, bBegin)) {
+            aBegin++;
+            bBegin++;
+        }
+        while (aBegin < aEnd && bBegin < bEnd && equal(aEnd - 1, bEnd - 1)) {
+            aEnd--;
+            bEnd--;
+        }
+        if (aBegin == aEnd || bBegin == bEnd) {
+            change(aBegin, aEnd, bBegin, bEnd);
+            return;
+        }
+        auto [x, y] = middleSnake(aBegin, aEnd, bBegin, bEnd);
+        size_t aSplit = aBegin + static_cast<size_t>(x);
+        size_t bSplit = bBegin + static_cast<size_t>(y);
+        if ((aSplit == aBegin && bSplit == bBegin) || (aSplit == aEnd && bSplit == bEnd)) {
+            change(aBegin, aEnd, bBegin, bEnd); // Nothing in common that the search found
+            return;
+        }
+        compare(aBegin, aSplit, bBegin, bSplit);
+        compare(aSplit, aEnd, bSplit, bEnd);
+    }
+
+public:
+    LineDiffer(const std::vector<std::string_view> &a, const std::vector<std::string_view> &b) : a(a), b(b) {
+        for (std::string_view line : a) aHashes.push_back(hashBytes(line));
+        for (std::string_view line : b) bHashes.push_back(hashBytes(line));
+    }
+
+    std::vector<LineChange> run() {
+        compare(0, a.size(), 0, b.size());
+        return std::move(changes);
+    }
+};
+
+std::vector<LineChange> diffLines(const std::vector<std::string_view> &a, const std::vector<std::string_view> &b) {
+    return LineDiffer(a, b).run();
+}
+
+void writeUnifiedDiff(OutputBuffer &out, std::string_view path, const std::vector<std::string_view> &a,
+                      const std::vector<std::string_view> &b, const std::vector<LineChange> &changes,
+                      size_t context) {
+    if (changes.empty()) return;
+    out.append("--- ");
+    out.append(path);
+    out.append("\n+++ ");
+    out.append(path);
+    out.append('\n');
+    auto line = [&](char prefix, std::string_view text) {
+        out.append(prefix);
+        out.append(text);
+        if (text.empty() || text.back() != '\n') out.append("\n\\ No newline at end of file\n");
+    };
+    for (size_t first = 0; first < changes.size();) {
+        // A hunk takes in every change whose context touches the one before
+        size_t last = first;
+        while (last + 1 < changes.size() && changes[last + 1].aBegin - changes[last].aEnd <= 2 * context) last++;
+        size_t aBegin = changes[first].aBegin - std::min(changes[first].aBegin, context);
+        size_t aEnd = std::min(changes[last].aEnd + context, a.size());
+        size_t bBegin = changes[first].bBegin - (changes[first].aBegin - aBegin);
+        size_t bEnd = changes[last].bEnd + (aEnd - changes[last].aEnd);
+        out.append("@@ -");
+        out.appendNumber(static_cast<long long>(aEnd > aBegin ? aBegin + 1 : aBegin));
+        out.append(',');
+        out.appendNumber(static_cast<long long>(aEnd - aBegin));
+        out.append(" +");
+        out.appendNumber(static_cast<long long>(bEnd > bBegin ? bBegin + 1 : bBegin));
+        out.append(',');
+        out.appendNumber(static_cast<long long>(bEnd - bBegin));
+        out.append(" @@\n");
+        size_t i = aBegin;
+        for (size_t c = first; c <= last; ++c) {
+            for (; i < changes[c].aBegin; ++i) line(' ', a[i]);
+            for (size_t j = changes[c].aBegin; j < changes[c].aEnd; ++j) line('-', a[j]);
+            for (size_t j = changes[c].bBegin; j < changes[c].bEnd; ++j) line('+', b[j]);
+            i = changes[c].aEnd;
+        }
+        for (; i < aEnd; ++i) line(' ', a[i]);
+        first = last + 1;
+    }
+}
+
+bool writeAll(int fd, std::vector<iovec> pieces) {
+    size_t next = 0;
+    while (next < pieces.size()) {
+        ssize_t written = writev(fd, &pieces[next], static_cast<int>(std::min<size_t>(pieces.size() - next, IOV_MAX)));
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        // Skip what was written, resuming inside a partly written piece
+        for (size_t remaining = static_cast<size_t>(written); next < pieces.size(); ++next) {
+            if (remaining < pieces[next].iov_len) {
+                pieces[next].iov_base = static_cast<char *>(pieces[next].iov_base) + remaining;
+                pieces[next].iov_len -= remaining;
+                break;
+            }
+            remaining -= pieces[next].iov_len;
+        }
+    }
+    return true;
+}
+
+bool writeAll(int fd, const OutputBuffer &content) {
+    std::vector<iovec> pieces;
+    for (std::string_view piece : content.pieces()) pieces.push_back({const_cast<char *>(piece.data()), piece.size()});
+    return writeAll(fd, std::move(pieces));
+}
+
+Status writeFile(const std::string &path, const OutputBuffer &content) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) return Status::failure("Cannot write to file " + path);
+    bool written = writeAll(fd, content);
+    if (close(fd) != 0 || !written) return Status::failure("Cannot write to file " + path);
+    return {};
+}
+
+uint64_t hashOutput(const OutputBuffer &content, uint64_t hash) {
+    for (std::string_view piece : content.pieces()) hash = hashBytes(piece, hash);
+    return hash;
+}
+
+// The file path names, following symbolic links, so that replacing it replaces the file
+// a link points to rather than the link; path itself when it cannot be resolved
+static std::string resolvedPath(const std::string &path) {
+    char *resolved = realpath(path.c_str(), nullptr);
+    if (!resolved) return path;
+    std::string target(resolved);
+    free(resolved);
+    return target;
+}
+
+Status createTemporary(const std::string &path, std::string &temporary) {
+    std::string name = resolvedPath(path) + ".XXXXXX";
+    int fd = mkstemp(name.data());
+    if (fd < 0) return Status::failure("Cannot create a temporary file next to " + path);
+    close(fd);
+    temporary = std::move(name);
+    return {};
+}
+
+// Permissions of a newly created file, 0666 less the umask. Reading the umask means
+// setting it, so it is read once.
+static mode_t newFileMode() {
+    static const mode_t mode = [] {
+        mode_t mask = umask(0);
+        umask(mask);
+        return static_cast<mode_t>(0666 & ~mask);
+    }();
+    return mode;
+}
+
+Status commitTemporary(const std::string &temporary, const std::string &path) {
+    std::string target = resolvedPath(path);
+    struct stat original;
+    // The content reaches the disk before the rename does, so that a crash leaves the old
+    // file or the new one, never an empty one
+    int fd = open(temporary.c_str(), O_RDONLY | O_CLOEXEC);
+    bool synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    // mkstemp creates the file readable by its owner only; a new file gets the usual mode
+    mode_t mode = stat(target.c_str(), &original) == 0 ? original.st_mode & 07777 : newFileMode();
+    bool failed = !synced || chmod(temporary.c_str(), mode) != 0 || rename(temporary.c_str(), target.c_str()) != 0;
+    if (!failed) return {};
+    unlink(temporary.c_str());
+    return Status::failure("Cannot replace file " + path);
+}
+
+Status replaceFile(const std::string &path, const OutputBuffer &content) {
+    std::string temporary;
+    Status status = createTemporary(path, temporary);
+    if (!status) return status;
+    status = writeFile(temporary, content);
+    if (!status) {
+        unlink(temporary.c_str());
+        return status;
+    }
+    return commitTemporary(temporary, path);
+}
+
+Status writeFile(const std::string &path, std::string_view content) {
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open()) return Status::failure("Cannot write to file " + path);
+    file.write(content.data(), static_cast<std::streamsize>(content.size()));
+    if (!file.flush()) return Status::failure("Cannot write to file " + path);
+    return {};
+}
+
+const char *diagnosticCodeName(Diagnostic::Code code) {
+    switch (code) {
+    case Diagnostic::UNCLOSED_CALL:
+        return "unclosed-call";
+    case Diagnostic::UNKNOWN_FUNCTION:
+        return "unknown-function";
+    case Diagnostic::ARGUMENT_COUNT:
+        return "argument-count";
+    case Diagnostic::NO_OVERLOAD_ARITY:
+        return "no-overload-arity";
+    case Diagnostic::NO_OVERLOAD_TYPES:
+        return "no-overload-types";
+    }
+    return "unknown";
+}
+
+const char *severityName(Diagnostic::Severity severity) {
+    return severity == Diagnostic::WARNING ? "warning" : "error";
+}
+
+void appendJsonString(std::string &out, std::string_view value) {
+    out += '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if (c == '\t') {
+            out += "\\t";
+        } else if (c == '\r') {
+            out += "\\r";
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buffer[8];
+            snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            out += buffer;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+// Path as a relative or absolute URI reference, for SARIF artifact locations
+static std::string pathUri(const std::string &path) {
+    static const char digits[] = "0123456789ABCDEF";
+    std::string uri;
+    for (unsigned char c : path) {
+        if (isalnum(c) || strchr("-._~/", c)) {
+            uri += static_cast<char>(c);
+        } else {
+            uri += '%';
+            uri += digits[c >> 4];
+            uri += digits[c & 15];
+        }
+    }
+    return uri;
+}
+
+DiagnosticWriter::DiagnosticWriter(std::ostream &out, Format format) : out(out), format(format) {
+    if (format != SARIF) return;
+    pending = "{\"version\":\"2.1.0\",\"$schema\":\"https://json.schemastore.org/sarif-2.1.0.json\",\"runs\":[{"
+              "\"tool\":{\"driver\":{\"name\":\"plpgsql-parser\",\"rules\":[";
+    for (int code = 0; code <= Diagnostic::NO_OVERLOAD_TYPES; ++code) {
+        if (code > 0) pending += ',';
+        pending += "{\"id\":";
+        appendJsonString(pending, diagnosticCodeName(static_cast<Diagnostic::Code>(code)));
+        pending += '}';
+    }
+    pending += "]}},\"results\":[";
+}
+
+void DiagnosticWriter::flush(size_t threshold) {
+    if (pending.size() < threshold) return;
+    out.write(pending.data(), static_cast<std::streamsize>(pending.size()));
+    pending.clear();
+}
+
+size_t DiagnosticWriter::addFile(const std::string &path, bool hasDirectives) {
+    size_t file = paths.size();
+    paths.push_back(path);
+    preprocessed.push_back(hasDirectives);
+    if (format == JSON_LINES) {
+        pending += "{\"type\":\"file\",\"file\":";
+        pending += std::to_string(file);
+        pending += ",\"path\":";
+        appendJsonString(pending, path);
+        pending += "}\n";
+    }
+    return file;
+}
+
+void DiagnosticWriter::write(size_t file, const std::vector<Diagnostic> &diagnostics) {
+    for (const auto &diagnostic : diagnostics) {
+        std::string code = diagnosticCodeName(diagnostic.code);
+        std::string severity = severityName(diagnostic.severity);
+        std::string line = std::to_string(diagnostic.line);
+        bool offsets = !preprocessed[file];
+        if (format == TEXT) {
+            appendParts(pending, paths[file], ":", line, ": ", severity, ": ", diagnostic.message, "\n");
+            continue;
+        }
+        std::string args;
+        for (const auto &arg : diagnostic.args) {
+            args += args.empty() ? "[" : ",";
+            appendJsonString(args, arg);
+        }
+        args += args.empty() ? "[]" : "]";
+        if (format == JSON_LINES) {
+            appendParts(pending, "{\"type\":\"diagnostic\",\"file\":", file, ",\"code\":\"", code,
+                        "\",\"severity\":\"", severity, "\",\"line\":", line);
+            if (offsets) appendParts(pending, ",\"offset\":", diagnostic.offset, ",\"length\":", diagnostic.length);
+            appendParts(pending, ",\"args\":", args, ",\"message\":");
+            appendJsonString(pending, diagnostic.message);
+            pending += "}\n";
+        } else {
+            if (results++ > 0) pending += ',';
+            appendParts(pending, "{\"ruleId\":\"", code, "\",\"ruleIndex\":", static_cast<int>(diagnostic.code),
+                        ",\"level\":\"", severity, "\",\"message\":{\"text\":");
+            appendJsonString(pending, diagnostic.message);
+            appendParts(pending, "},\"locations\":[{\"physicalLocation\":{\"artifactLocation\":{\"uri\":");
+            appendJsonString(pending, pathUri(paths[file]));
+            appendParts(pending, ",\"index\":", file, "},\"region\":{\"startLine\":", line);
+            if (offsets) appendParts(pending, ",\"charOffset\":", diagnostic.offset, ",\"charLength\":", diagnostic.length);
+            appendParts(pending, "}}}],\"properties\":{\"args\":", args, "}}");
+        }
+    }
+    flush(outputFlushSize);
+}
+
+Status DiagnosticWriter::finish() {
+    if (format == SARIF) {
+        pending += "],\"artifacts\":[";
+        for (size_t file = 0; file < paths.size(); ++file) {
+            if (file > 0) pending += ',';
+            pending += "{\"location\":{\"uri\":";
+            appendJsonString(pending, pathUri(paths[file]));
+            pending += "}}";
+        }
+        pending += "]}]}\n";
+    }
+    flush(0);
+    out.flush();
+    if (!out) return Status::failure("Cannot write diagnostics");
+    return {};
+}
+
+struct Context::State {
+    ThreadPool pool;
+    SymbolTable definitions;
+    uint32_t sourceCount = 0; // Sources defined so far, numbering the definitions
+    FormatOptions format;
+
+    explicit State(unsigned threads) : pool(threads) { indexSymbols(definitions); }
+
+    // Preprocesses, lexes and first-passes source into file
+    void parse(ParsedFile &file, std::string_view source) {
+        loadSource(file, source, pool, true);
+        pool.parallelFor(file.units.size(), [&](size_t unit) { firstPassUnit(file, unit, nullptr); });
+    }
+};
+
+Context::Context(unsigned threads) : state(std::make_unique<State>(threads)) {}
+
+Context::~Context() = default;
+
+void Context::define(std::string_view source) {
+    ParsedFile file;
+    state->parse(file, source);
+    mergeSymbols(file, state->sourceCount++, state->definitions);
+    indexSymbols(state->definitions);
+}
+
+Status Context::defineFile(const std::string &path) {
+    std::string source;
+    Status status = readFile(path, source);
+    if (status) define(source);
+    return status;
+}
+
+void Context::clearDefinitions() {
+    state->definitions = SymbolTable();
+    state->sourceCount = 0;
+    indexSymbols(state->definitions);
+}
+
+void Context::setFormatOptions(const FormatOptions &options) {
+    state->format = options;
+}
+
+// "(a, b)" from the names of items
+template <typename Items, typename Describe>
+static std::string describeList(const Items &items, Describe describe) {
+    std::string text = "(";
+    for (const auto &item : items) {
+        if (text.size() > 1) text += ", ";
+        text += describe(item);
+    }
+    return text + ")";
+}
+
+// The buffer's own symbols go into a table whose outer table holds the context's
+// definitions, so neither those nor the built-in names are copied or indexed per call
+Analysis Context::analyze(std::string_view source) {
+    ParsedFile file;
+    file.format = state->format;
+    state->parse(file, source);
+    SymbolTable symbols;
+    mergeSymbols(file, 0, symbols);
+    symbols.outer = &state->definitions;
+    indexSymbols(symbols);
+    state->pool.parallelFor(file.units.size(), [&](size_t unit) { secondPassUnit(file, unit, symbols, nullptr); });
+    assembleOutput(file);
+
+    Analysis analysis;
+    for (const auto &unit : file.units) analysis.statements.push_back({unit.begin, unit.end, file.tokens[unit.begin].line});
+    for (const auto &signature : symbols.functions.signatures()) {
+        size_t index = 0;
+        std::string detail = describeList(signature.argumentTypes, [&](TypeId type) {
+            bool variadic = signature.variadic && ++index == signature.argumentTypes.size();
+            return (variadic ? "variadic " : "") + typeTable().name(type);
+        });
+        analysis.symbols.push_back({Symbol::FUNCTION, signature.name, signature.line, std::move(detail)});
+    }
+    for (const auto &table : symbols.tables) {
+        std::string detail = describeList(table.columns, [](const TableColumn &column) {
+            return column.name + " " + typeTable().name(column.type);
+        });
+        analysis.symbols.push_back({Symbol::TABLE, table.name, table.line, std::move(detail)});
+    }
+    for (const auto &type : symbols.types) analysis.symbols.push_back({Symbol::TYPE, type.name, type.line, ""});
+    std::stable_sort(analysis.symbols.begin(), analysis.symbols.end(),
+                     [](const Symbol &a, const Symbol &b) { return a.line < b.line; });
+
+    analysis.formatted = file.formattedCode.str(); // Before the source it may borrow from moves
+    analysis.preprocessedSource = std::move(file.preprocessedCode);
+    analysis.tokens = std::move(file.tokens);
+    analysis.diagnostics = std::move(file.diagnostics);
+    return analysis;
+}
+
+Status Context::analyzeFile(const std::string &path, Analysis &analysis) {
+    std::string source;
+    Status status = readFile(path, source);
+    if (status) analysis = analyze(source);
+    return status;
+}
+
+// Only lexing covers the whole source; nothing is parsed, and only the selected units
+// are formatted
+Status Context::formatRange(std::string_view source, size_t offset, size_t length, TextEdit &edit) {
+    ParsedFile file;
+    loadSource(file, source, state->pool, true);
+    if (file.directives) return Status::failure("Cannot format a range of source with #define directives");
+    edit = plpgsql::formatRange(file.tokens, file.units, source, offset, length, state->format, state->pool);
+    return {};
+}
+
+} // namespace plpgsql
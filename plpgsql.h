@@ -0,0 +1,161 @@
+#ifndef PLPGSQL_H
+#define PLPGSQL_H
+
+// libplpgsql: lexes, validates and formats PL/pgSQL source held in memory. Nothing in the
+// library writes to stdout or ends the process; failures come back as Status values.
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef PLPGSQL_API
+#define PLPGSQL_API __attribute__((visibility("default")))
+#endif
+
+namespace plpgsql {
+
+// Token types
+enum TokenType {
+    KEYWORD,
+    IDENTIFIER,
+    LITERAL,
+    OPERATOR,
+    SYMBOL,
+    COMMENT,
+    STRING_LITERAL,
+    END_OF_FILE
+};
+
+// Token structure
+struct Token {
+    TokenType type;
+    std::string value;
+    int line;
+    size_t offset = 0; // Byte offset of the token start in the lexed text
+};
+
+// Diagnostic reported by the second pass. Tools should go by code and args, the names and
+// numbers the message is made of; the message is for people.
+struct Diagnostic {
+    enum Code {
+        UNCLOSED_CALL,      // args: function
+        UNKNOWN_FUNCTION,   // args: function, then the suggested name if there is one
+        ARGUMENT_COUNT,     // args: function, accepted argument count as in the message, provided count
+        NO_OVERLOAD_ARITY,  // args: function, provided argument count
+        NO_OVERLOAD_TYPES   // args: function, provided argument types as "(a, b)"
+    };
+    enum Severity { ERROR, WARNING };
+
+    int line;
+    std::string message;
+    size_t offset = 0; // Byte range of the offending token in the lexed text
+    size_t length = 0;
+    Code code = UNKNOWN_FUNCTION;
+    Severity severity = ERROR;
+    std::vector<std::string> args;
+};
+
+// Stable name of a diagnostic code, such as "unknown-function", and of a severity
+PLPGSQL_API const char *diagnosticCodeName(Diagnostic::Code code);
+PLPGSQL_API const char *severityName(Diagnostic::Severity severity);
+
+// Outcome of an operation that can fail; message says why when it did
+struct Status {
+    bool ok = true;
+    std::string message;
+
+    static Status failure(std::string message) { return {false, std::move(message)}; }
+
+    explicit operator bool() const { return ok; }
+};
+
+// Function, procedure, table or type defined by analyzed source
+struct Symbol {
+    enum Kind { FUNCTION, TABLE, TYPE };
+
+    Kind kind;
+    std::string name;
+    int line;
+    std::string detail; // Argument types of a function or columns of a table, as "(a, b)"
+};
+
+// Top-level statement: tokens[firstToken, endToken), starting at line
+struct Statement {
+    size_t firstToken;
+    size_t endToken;
+    int line;
+};
+
+// Layout of formatted code
+struct FormatOptions {
+    enum KeywordCase { PRESERVE, UPPER, LOWER };
+
+    int lineWidth = 80;                 // Lines are broken to stay within this many columns where possible
+    int indentWidth = 4;                // Columns per indentation level
+    bool tabs = false;                  // Indentation is written as tabs of indentWidth columns
+    KeywordCase keywordCase = PRESERVE; // Spelling of SQL and PL/pgSQL keywords
+    bool leadingCommas = false;         // Items of broken lists start with their comma
+};
+
+// Replacement of bytes [offset, offset + length) of a buffer by text
+struct TextEdit {
+    size_t offset = 0;
+    size_t length = 0;
+    std::string text;
+};
+
+// Everything known about one analyzed buffer. Token offsets and diagnostic ranges refer to
+// preprocessedSource, which only differs from the input where #define substitutions apply.
+struct Analysis {
+    std::string preprocessedSource;
+    std::vector<Token> tokens; // Ends with an END_OF_FILE token
+    std::vector<Statement> statements;
+    std::vector<Symbol> symbols; // In source order
+    std::vector<Diagnostic> diagnostics;
+    std::string formatted;
+};
+
+// Reusable analysis state. Definitions added to a context are parsed and indexed once and
+// consulted by every later analyze call, which then only pays for its own buffer. A
+// context must not be used from several threads at once; create one per thread instead.
+class PLPGSQL_API Context {
+public:
+    // threads > 1 lexes large buffers in parallel
+    explicit Context(unsigned threads = 1);
+    ~Context();
+    Context(const Context &) = delete;
+    Context &operator=(const Context &) = delete;
+
+    // Adds the functions, tables and types defined by source, such as the rest of a schema,
+    // to what analyzed code is checked against. Earlier definitions of an overload win.
+    void define(std::string_view source);
+    Status defineFile(const std::string &path);
+    void clearDefinitions();
+
+    // Layout of the formatted code of later analyze and formatRange calls
+    void setFormatOptions(const FormatOptions &options);
+
+    // Analyzes source against its own definitions, then the context's, then the built-in
+    // catalog
+    Analysis analyze(std::string_view source);
+    Status analyzeFile(const std::string &path, Analysis &analysis);
+
+    // Formats only the top-level statements overlapping bytes [offset, offset + length) of
+    // source, without validating them, into the edit that applies their formatted code.
+    // The edit is empty when they are already formatted. Fails on #define directives,
+    // since offsets would then refer to the preprocessed text.
+    Status formatRange(std::string_view source, size_t offset, size_t length, TextEdit &edit);
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+PLPGSQL_API Status readFile(const std::string &path, std::string &content);
+PLPGSQL_API Status writeFile(const std::string &path, std::string_view content);
+
+} // namespace plpgsql
+
+#endif
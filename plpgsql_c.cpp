@@ -0,0 +1,203 @@
+#include "plpgsql_c.h"
+#include "plpgsql.h"
+
+#include <algorithm>
+#include <new>
+
+struct plpgsql_context {
+    plpgsql::Context context;
+    plpgsql::FormatOptions format; // As last passed to the context
+    std::string error;             // Message of the last failed call
+
+    explicit plpgsql_context(unsigned threads) : context(threads) {}
+};
+
+struct plpgsql_analysis {
+    plpgsql::Analysis analysis;
+};
+
+namespace {
+
+plpgsql_string view(const std::string &value) {
+    return {value.data(), value.size()};
+}
+
+// Runs body, turning exceptions into a status recorded on context
+template <typename Body>
+plpgsql_status guarded(plpgsql_context *context, Body body) {
+    try {
+        plpgsql::Status status = body();
+        if (status) {
+            context->error.clear();
+            return PLPGSQL_OK;
+        }
+        context->error = status.message;
+        return PLPGSQL_ERROR_IO;
+    } catch (const std::bad_alloc &) {
+        context->error = "Out of memory";
+        return PLPGSQL_ERROR_MEMORY;
+    } catch (const std::exception &error) {
+        context->error = error.what();
+        return PLPGSQL_ERROR_INTERNAL;
+    } catch (...) {
+        context->error = "Unknown error";
+        return PLPGSQL_ERROR_INTERNAL;
+    }
+}
+
+// Element index of one of the analysis vectors, converted by convert
+template <typename Items, typename Out, typename Convert>
+plpgsql_status element(const plpgsql_analysis *analysis, const Items plpgsql::Analysis::*items, size_t index,
+                       Out *out, Convert convert) {
+    if (!analysis || !out || index >= (analysis->analysis.*items).size()) return PLPGSQL_ERROR_ARGUMENT;
+    *out = convert((analysis->analysis.*items)[index]);
+    return PLPGSQL_OK;
+}
+
+} // namespace
+
+extern "C" {
+
+uint32_t plpgsql_abi_version(void) {
+    return PLPGSQL_ABI_VERSION;
+}
+
+plpgsql_context *plpgsql_context_new(uint32_t threads) {
+    try {
+        return new plpgsql_context(threads);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void plpgsql_context_free(plpgsql_context *context) {
+    delete context;
+}
+
+plpgsql_status plpgsql_context_define(plpgsql_context *context, const char *source, size_t size) {
+    if (!context || (!source && size > 0)) return PLPGSQL_ERROR_ARGUMENT;
+    return guarded(context, [&] {
+        context->context.define(std::string_view(source ? source : "", size));
+        return plpgsql::Status();
+    });
+}
+
+plpgsql_status plpgsql_context_define_file(plpgsql_context *context, const char *path) {
+    if (!context || !path) return PLPGSQL_ERROR_ARGUMENT;
+    return guarded(context, [&] { return context->context.defineFile(path); });
+}
+
+plpgsql_status plpgsql_context_clear_definitions(plpgsql_context *context) {
+    if (!context) return PLPGSQL_ERROR_ARGUMENT;
+    return guarded(context, [&] {
+        context->context.clearDefinitions();
+        return plpgsql::Status();
+    });
+}
+
+plpgsql_status plpgsql_context_set_line_width(plpgsql_context *context, uint32_t width) {
+    if (!context || width == 0) return PLPGSQL_ERROR_ARGUMENT;
+    return guarded(context, [&] {
+        context->format.lineWidth = static_cast<int>(std::min<uint32_t>(width, INT32_MAX));
+        context->context.setFormatOptions(context->format);
+        return plpgsql::Status();
+    });
+}
+
+plpgsql_status plpgsql_context_set_style(plpgsql_context *context, uint32_t indent_width, int32_t tabs,
+                                         int32_t keyword_case, int32_t leading_commas) {
+    if (!context || indent_width == 0 || indent_width > 64 || keyword_case < PLPGSQL_KEYWORD_CASE_PRESERVE ||
+        keyword_case > PLPGSQL_KEYWORD_CASE_LOWER) {
+        return PLPGSQL_ERROR_ARGUMENT;
+    }
+    return guarded(context, [&] {
+        context->format.indentWidth = static_cast<int>(indent_width);
+        context->format.tabs = tabs != 0;
+        context->format.keywordCase = static_cast<plpgsql::FormatOptions::KeywordCase>(keyword_case);
+        context->format.leadingCommas = leading_commas != 0;
+        context->context.setFormatOptions(context->format);
+        return plpgsql::Status();
+    });
+}
+
+plpgsql_string plpgsql_context_error(const plpgsql_context *context) {
+    return context ? view(context->error) : plpgsql_string{"", 0};
+}
+
+plpgsql_analysis *plpgsql_analyze(plpgsql_context *context, const char *source, size_t size) {
+    if (!context || (!source && size > 0)) return nullptr;
+    plpgsql_analysis *result = nullptr;
+    guarded(context, [&] {
+        result = new plpgsql_analysis{context->context.analyze(std::string_view(source ? source : "", size))};
+        return plpgsql::Status();
+    });
+    return result;
+}
+
+plpgsql_analysis *plpgsql_analyze_file(plpgsql_context *context, const char *path) {
+    if (!context || !path) return nullptr;
+    plpgsql_analysis *result = nullptr;
+    guarded(context, [&] {
+        auto analysis = std::make_unique<plpgsql_analysis>();
+        plpgsql::Status status = context->context.analyzeFile(path, analysis->analysis);
+        if (status) result = analysis.release();
+        return status;
+    });
+    return result;
+}
+
+void plpgsql_analysis_free(plpgsql_analysis *analysis) {
+    delete analysis;
+}
+
+plpgsql_string plpgsql_analysis_formatted(const plpgsql_analysis *analysis) {
+    return analysis ? view(analysis->analysis.formatted) : plpgsql_string{"", 0};
+}
+
+plpgsql_string plpgsql_analysis_source(const plpgsql_analysis *analysis) {
+    return analysis ? view(analysis->analysis.preprocessedSource) : plpgsql_string{"", 0};
+}
+
+size_t plpgsql_analysis_token_count(const plpgsql_analysis *analysis) {
+    return analysis ? analysis->analysis.tokens.size() : 0;
+}
+
+plpgsql_status plpgsql_analysis_token(const plpgsql_analysis *analysis, size_t index, plpgsql_token *out) {
+    return element(analysis, &plpgsql::Analysis::tokens, index, out, [](const plpgsql::Token &token) {
+        return plpgsql_token{token.type, token.line, token.offset, view(token.value)};
+    });
+}
+
+size_t plpgsql_analysis_statement_count(const plpgsql_analysis *analysis) {
+    return analysis ? analysis->analysis.statements.size() : 0;
+}
+
+plpgsql_status plpgsql_analysis_statement(const plpgsql_analysis *analysis, size_t index, plpgsql_statement *out) {
+    return element(analysis, &plpgsql::Analysis::statements, index, out, [](const plpgsql::Statement &statement) {
+        return plpgsql_statement{statement.firstToken, statement.endToken, statement.line};
+    });
+}
+
+size_t plpgsql_analysis_symbol_count(const plpgsql_analysis *analysis) {
+    return analysis ? analysis->analysis.symbols.size() : 0;
+}
+
+plpgsql_status plpgsql_analysis_symbol(const plpgsql_analysis *analysis, size_t index, plpgsql_symbol *out) {
+    return element(analysis, &plpgsql::Analysis::symbols, index, out, [](const plpgsql::Symbol &symbol) {
+        return plpgsql_symbol{symbol.kind, symbol.line, view(symbol.name), view(symbol.detail)};
+    });
+}
+
+size_t plpgsql_analysis_diagnostic_count(const plpgsql_analysis *analysis) {
+    return analysis ? analysis->analysis.diagnostics.size() : 0;
+}
+
+plpgsql_status plpgsql_analysis_diagnostic(const plpgsql_analysis *analysis, size_t index,
+                                           plpgsql_diagnostic *out) {
+    return element(analysis, &plpgsql::Analysis::diagnostics, index, out, [](const plpgsql::Diagnostic &diagnostic) {
+        return plpgsql_diagnostic{diagnostic.line, diagnostic.offset, diagnostic.length, view(diagnostic.message),
+                                  diagnostic.code, diagnostic.severity};
+    });
+}
+
+} // extern "C"
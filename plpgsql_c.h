@@ -0,0 +1,151 @@
+#ifndef PLPGSQL_C_H
+#define PLPGSQL_C_H
+
+/* C interface to libplpgsql, for callers that cannot use the C++ API in plpgsql.h.
+ * Handles are opaque, and struct layouts and signatures only change together with
+ * PLPGSQL_ABI_VERSION. Strings point into the analysis that returned them: they are not
+ * NUL-terminated and stay valid until that analysis is freed. No call lets a C++
+ * exception escape. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef PLPGSQL_API
+#define PLPGSQL_API __attribute__((visibility("default")))
+#endif
+
+#define PLPGSQL_ABI_VERSION 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct plpgsql_context plpgsql_context;
+typedef struct plpgsql_analysis plpgsql_analysis;
+
+typedef enum {
+    PLPGSQL_OK = 0,
+    PLPGSQL_ERROR_IO = 1,       /* A file could not be read */
+    PLPGSQL_ERROR_MEMORY = 2,   /* Allocation failed */
+    PLPGSQL_ERROR_ARGUMENT = 3, /* Null handle, index out of range or invalid value */
+    PLPGSQL_ERROR_INTERNAL = 4  /* Unexpected failure inside the analyzer */
+} plpgsql_status;
+
+/* Bytes [data, data + size); data is never NULL */
+typedef struct {
+    const char *data;
+    size_t size;
+} plpgsql_string;
+
+/* Values match plpgsql::TokenType */
+typedef struct {
+    int32_t type;
+    int32_t line;
+    size_t offset;         /* In the preprocessed source */
+    plpgsql_string value;
+} plpgsql_token;
+
+/* Top-level statement: tokens [first_token, end_token) */
+typedef struct {
+    size_t first_token;
+    size_t end_token;
+    int32_t line;
+} plpgsql_statement;
+
+typedef enum {
+    PLPGSQL_SYMBOL_FUNCTION = 0,
+    PLPGSQL_SYMBOL_TABLE = 1,
+    PLPGSQL_SYMBOL_TYPE = 2
+} plpgsql_symbol_kind;
+
+typedef struct {
+    int32_t kind;          /* plpgsql_symbol_kind */
+    int32_t line;
+    plpgsql_string name;
+    plpgsql_string detail; /* Argument types of a function or columns of a table */
+} plpgsql_symbol;
+
+/* Values match plpgsql::Diagnostic::Code */
+typedef enum {
+    PLPGSQL_DIAGNOSTIC_UNCLOSED_CALL = 0,
+    PLPGSQL_DIAGNOSTIC_UNKNOWN_FUNCTION = 1,
+    PLPGSQL_DIAGNOSTIC_ARGUMENT_COUNT = 2,
+    PLPGSQL_DIAGNOSTIC_NO_OVERLOAD_ARITY = 3,
+    PLPGSQL_DIAGNOSTIC_NO_OVERLOAD_TYPES = 4
+} plpgsql_diagnostic_code;
+
+typedef enum {
+    PLPGSQL_SEVERITY_ERROR = 0,
+    PLPGSQL_SEVERITY_WARNING = 1
+} plpgsql_severity;
+
+typedef struct {
+    int32_t line;
+    size_t offset;         /* Byte range of the offending token in the preprocessed source */
+    size_t length;
+    plpgsql_string message;
+    int32_t code;          /* plpgsql_diagnostic_code */
+    int32_t severity;      /* plpgsql_severity */
+} plpgsql_diagnostic;
+
+/* PLPGSQL_ABI_VERSION of the loaded library */
+PLPGSQL_API uint32_t plpgsql_abi_version(void);
+
+/* Context reused across calls; threads > 1 lexes large buffers in parallel. NULL when
+ * allocation fails. A context must not be used from several threads at once. */
+PLPGSQL_API plpgsql_context *plpgsql_context_new(uint32_t threads);
+PLPGSQL_API void plpgsql_context_free(plpgsql_context *context);
+
+/* Adds the functions, tables and types defined by a buffer or file to what later
+ * analyses are checked against */
+PLPGSQL_API plpgsql_status plpgsql_context_define(plpgsql_context *context, const char *source, size_t size);
+PLPGSQL_API plpgsql_status plpgsql_context_define_file(plpgsql_context *context, const char *path);
+PLPGSQL_API plpgsql_status plpgsql_context_clear_definitions(plpgsql_context *context);
+
+/* Column limit the formatted code of later analyses is laid out to; 80 by default */
+PLPGSQL_API plpgsql_status plpgsql_context_set_line_width(plpgsql_context *context, uint32_t width);
+
+/* Values match plpgsql::FormatOptions::KeywordCase */
+typedef enum {
+    PLPGSQL_KEYWORD_CASE_PRESERVE = 0,
+    PLPGSQL_KEYWORD_CASE_UPPER = 1,
+    PLPGSQL_KEYWORD_CASE_LOWER = 2
+} plpgsql_keyword_case;
+
+/* Style of the formatted code of later analyses: columns per indentation level (1 to 64,
+ * 4 by default), indentation with tabs rather than spaces, keyword_case as
+ * plpgsql_keyword_case, and commas at the start rather than the end of list items */
+PLPGSQL_API plpgsql_status plpgsql_context_set_style(plpgsql_context *context, uint32_t indent_width, int32_t tabs,
+                                                     int32_t keyword_case, int32_t leading_commas);
+
+/* Message of the last failed call on context; empty when none failed */
+PLPGSQL_API plpgsql_string plpgsql_context_error(const plpgsql_context *context);
+
+/* Analyzes a buffer or file; NULL on failure, see plpgsql_context_error. The analysis
+ * does not refer to the context and may outlive it. */
+PLPGSQL_API plpgsql_analysis *plpgsql_analyze(plpgsql_context *context, const char *source, size_t size);
+PLPGSQL_API plpgsql_analysis *plpgsql_analyze_file(plpgsql_context *context, const char *path);
+PLPGSQL_API void plpgsql_analysis_free(plpgsql_analysis *analysis);
+
+PLPGSQL_API plpgsql_string plpgsql_analysis_formatted(const plpgsql_analysis *analysis);
+PLPGSQL_API plpgsql_string plpgsql_analysis_source(const plpgsql_analysis *analysis);
+
+/* Element counts, and element index written to *out */
+PLPGSQL_API size_t plpgsql_analysis_token_count(const plpgsql_analysis *analysis);
+PLPGSQL_API plpgsql_status plpgsql_analysis_token(const plpgsql_analysis *analysis, size_t index,
+                                                  plpgsql_token *out);
+PLPGSQL_API size_t plpgsql_analysis_statement_count(const plpgsql_analysis *analysis);
+PLPGSQL_API plpgsql_status plpgsql_analysis_statement(const plpgsql_analysis *analysis, size_t index,
+                                                      plpgsql_statement *out);
+PLPGSQL_API size_t plpgsql_analysis_symbol_count(const plpgsql_analysis *analysis);
+PLPGSQL_API plpgsql_status plpgsql_analysis_symbol(const plpgsql_analysis *analysis, size_t index,
+                                                   plpgsql_symbol *out);
+PLPGSQL_API size_t plpgsql_analysis_diagnostic_count(const plpgsql_analysis *analysis);
+PLPGSQL_API plpgsql_status plpgsql_analysis_diagnostic(const plpgsql_analysis *analysis, size_t index,
+                                                       plpgsql_diagnostic *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
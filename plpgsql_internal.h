@@ -0,0 +1,3004 @@
+#ifndef PLPGSQL_INTERNAL_H
+#define PLPGSQL_INTERNAL_H
+
+// Internals of libplpgsql shared by the library and the command line tool: the lexer,
+// parser, symbol tables and per-unit pipeline behind plpgsql.h. Not a stable interface.
+
+#include "plpgsql.h"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace plpgsql {
+
+// Type ids of function arguments; UNKNOWN_TYPE matches any type
+using TypeId = uint16_t;
+const TypeId UNKNOWN_TYPE = 0;
+const TypeId INTEGER_TYPE = 1; // Inferred for numeric literals
+const TypeId TEXT_TYPE = 2;    // Inferred for string literals
+const TypeId FIRST_NUMERIC_TYPE = 3;
+const TypeId LAST_NUMERIC_TYPE = 8;
+
+std::string lowercase(std::string_view value);
+
+inline void appendPart(std::string &text, std::string_view part) {
+    text += part;
+}
+
+template <typename Integer, std::enable_if_t<std::is_integral_v<Integer>, int> = 0>
+void appendPart(std::string &text, Integer value) {
+    char digits[24];
+    text.append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr);
+}
+
+// Appends parts in order, integers formatted with to_chars, without temporary strings
+template <typename... Parts>
+void appendParts(std::string &text, const Parts &...parts) {
+    (appendPart(text, parts), ...);
+}
+
+template <typename... Parts>
+std::string concat(const Parts &...parts) {
+    std::string text;
+    appendParts(text, parts...);
+    return text;
+}
+
+// Built-in types with fixed ids: a type's id is its index here, so catalog entries can
+// name types by id at compile time. Ids 3 to 8 are the numeric types.
+struct BuiltinType {
+    unsigned oid;
+    const char *name;
+};
+
+constexpr BuiltinType builtinTypes[] = {
+    {705, "unknown"}, {23, "integer"}, {25, "text"}, {21, "smallint"}, {20, "bigint"}, {1700, "numeric"},
+    {700, "real"}, {701, "double precision"}, {26, "oid"}, {16, "boolean"}, {17, "bytea"}, {19, "name"},
+    {1042, "character"}, {1043, "character varying"}, {1082, "date"}, {1083, "time"}, {1114, "timestamp"},
+    {1184, "timestamp with time zone"}, {1186, "interval"}, {114, "json"}, {3802, "jsonb"},
+    {4072, "jsonpath"}, {1007, "integer[]"}, {1009, "text[]"}, {2205, "regclass"}, {2249, "record"},
+    {2950, "uuid"}, {3734, "regconfig"}, {869, "inet"}, {2278, "void"}
+};
+
+// Interned type names shared by all parsers. Built-in types, including those a numeric
+// literal can be passed to, have fixed ids, so the resolver checks them without locking.
+class TypeTable {
+private:
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, TypeId> ids;
+    std::vector<std::string> names;
+
+public:
+    TypeTable() {
+        for (const auto &type : builtinTypes) {
+            intern(type.name);
+        }
+    }
+
+    // Interns a lowercase type name with aliases already resolved
+    TypeId intern(const std::string &name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto entry = ids.find(name);
+        if (entry != ids.end()) return entry->second;
+        TypeId id = static_cast<TypeId>(names.size());
+        ids.emplace(name, id);
+        names.push_back(name);
+        return id;
+    }
+
+    std::string name(TypeId id) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return id < names.size() ? names[id] : "unknown";
+    }
+
+    static bool isNumeric(TypeId id) {
+        return id == INTEGER_TYPE || (id >= FIRST_NUMERIC_TYPE && id <= LAST_NUMERIC_TYPE);
+    }
+};
+
+TypeTable &typeTable();
+
+// Interns a declared type name such as "character varying" or "int[]"; polymorphic
+// pseudo-types and %TYPE references resolve to UNKNOWN_TYPE
+TypeId internTypeName(const std::string &declared);
+
+// Function signature structure
+struct FunctionSignature {
+    std::string name;
+    std::vector<TypeId> argumentTypes; // Input parameters; a variadic one holds its element type
+    int line;                          // Line where the function is defined
+    size_t requiredArguments = 0;      // Parameters without a default
+    bool variadic = false;             // Last parameter takes any number of arguments
+    uint32_t file = 0;                 // Index of the defining file in the run
+
+    bool acceptsArity(size_t count) const {
+        return count >= requiredArguments && (variadic || count <= argumentTypes.size());
+    }
+
+    // Declared type of the argument at index, repeating the variadic element type
+    TypeId parameterType(size_t index) const {
+        return index < argumentTypes.size() ? argumentTypes[index] : argumentTypes.back();
+    }
+
+    std::string describeArity() const {
+        if (variadic) return concat("at least ", requiredArguments);
+        if (requiredArguments == argumentTypes.size()) return concat(requiredArguments);
+        return concat(requiredArguments, " to ", argumentTypes.size());
+    }
+};
+
+// Set of keywords
+extern const std::set<std::string> keywords;
+
+// Keywords whose case the formatter sets, in lowercase, mapped to their uppercase spelling
+extern const std::unordered_map<std::string, std::string> casedKeywords;
+
+// Fixed-size worker pool shared by the parallel lexing and parsing stages
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::mutex submitMutex; // Serializes parallelFor callers
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(size_t)> *job = nullptr;
+    size_t jobCount = 0;
+    std::atomic<size_t> next{0};
+    size_t active = 0;
+    unsigned long generation = 0;
+    bool stopping = false;
+
+    static bool &insideWorker() {
+        thread_local bool inside = false;
+        return inside;
+    }
+
+    void runJob(const std::function<void(size_t)> &fn, size_t count) {
+        for (size_t i = next++; i < count; i = next++) {
+            fn(i);
+        }
+    }
+
+    void workerLoop() {
+        insideWorker() = true;
+        unsigned long seen = 0;
+        while (true) {
+            const std::function<void(size_t)> *current;
+            size_t count;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                current = job;
+                count = jobCount;
+            }
+            runJob(*current, count);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--active == 0) done.notify_one();
+        }
+    }
+
+public:
+    explicit ThreadPool(unsigned threads = std::thread::hardware_concurrency()) {
+        // The calling thread takes part in every job, so spawn one worker less
+        for (unsigned i = 1; i < std::max(threads, 1u); ++i) {
+            workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers) worker.join();
+    }
+
+    size_t size() const { return workers.size() + 1; }
+
+    // Calls fn(i) for every i in [0, count) and returns once all calls have finished.
+    // Indices are claimed in increasing order, so callers control dispatch order. A call
+    // made from inside fn, on any thread, runs sequentially on that thread.
+    void parallelFor(size_t count, const std::function<void(size_t)> &fn) {
+        if (workers.empty() || count < 2 || insideWorker()) {
+            for (size_t i = 0; i < count; ++i) fn(i);
+            return;
+        }
+        std::lock_guard<std::mutex> submit(submitMutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            jobCount = count;
+            next = 0;
+            active = workers.size();
+            ++generation;
+        }
+        wake.notify_all();
+        insideWorker() = true; // The caller takes a share of the work as well
+        runJob(fn, count);
+        insideWorker() = false;
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return active == 0; });
+        job = nullptr;
+    }
+};
+
+// Lexer class
+class Lexer {
+private:
+    std::string_view input;
+    size_t position = 0;
+    int line;
+    bool truncated = false;    // Input ended inside a string or comment
+    size_t truncatedStart = 0; // Offset where that unterminated token began
+    std::string openTag;       // Delimiter of the dollar quote lexed text is in, if any
+    bool tagDependent = false; // A string or comment met a '$', so lexing depended on openTag
+
+    char peek(size_t ahead = 0) {
+        return position + ahead < input.length() ? input[position + ahead] : '\0';
+    }
+
+    char advance() {
+        char current = peek();
+        position++;
+        if (current == '\n') line++;
+        return current;
+    }
+
+    void skipWhitespace() {
+        while (isspace(peek())) advance();
+    }
+
+    void markTruncated(size_t start) {
+        if (position >= input.length()) {
+            truncated = true;
+            truncatedStart = start;
+        }
+    }
+
+    // Whether the closing delimiter of the open dollar quote starts at the current position.
+    // PostgreSQL ends a dollar quote there whatever it holds, so no string or comment lexed
+    // inside one runs past it.
+    bool atClosingTag() {
+        if (peek() != '$') return false;
+        tagDependent = true;
+        return !openTag.empty() && input.compare(position, openTag.size(), openTag) == 0;
+    }
+
+    // A quote whose string would run past the closing delimiter is a stray character of a
+    // dollar-quoted constant, such as the apostrophe of it's
+    Token strayQuote(size_t start, int startLine) {
+        position = start;
+        line = startLine;
+        return handleSymbol();
+    }
+
+    Token handleIdentifierOrKeyword() {
+        std::string value;
+        while (isalnum(peek()) || peek() == '_') {
+            value += advance();
+        }
+        std::string lowercaseValue = value;
+        std::transform(lowercaseValue.begin(), lowercaseValue.end(), lowercaseValue.begin(), ::tolower);
+        if (keywords.count(lowercaseValue)) {
+            return {KEYWORD, value, line};
+        }
+        return {IDENTIFIER, value, line};
+    }
+
+    Token handleLiteral() {
+        std::string value;
+        while (isdigit(peek())) {
+            value += advance();
+        }
+        return {LITERAL, value, line};
+    }
+
+    Token handleSymbol() {
+        return {SYMBOL, std::string(1, advance()), line};
+    }
+
+    Token handleStringLiteral() {
+        size_t start = position;
+        int startLine = line;
+        std::string value;
+        advance(); // Skip the opening quote
+        while (peek() != '"' && peek() != '\0') {
+            if (atClosingTag()) return strayQuote(start, startLine);
+            value += advance();
+        }
+        if (peek() == '"') advance(); // Skip the closing quote
+        else markTruncated(start);
+        return {STRING_LITERAL, value, line};
+    }
+
+    // 'text' with '' as an escaped quote; in an E'text' escape string a backslash escapes
+    // the character after it too, and is kept in the value with it
+    Token handleQuotedLiteral(bool escapes) {
+        size_t start = position;
+        int startLine = line;
+        std::string value;
+        advance(); // Skip the opening quote
+        while (position < input.length()) {
+            if (atClosingTag()) return strayQuote(start, startLine);
+            if (peek() == '\'') {
+                if (peek(1) != '\'') break;
+                advance(); // Keep one quote of the escaped pair
+            } else if (escapes && peek() == '\\' && position + 1 < input.length()) {
+                value += advance();
+            }
+            value += advance();
+        }
+        if (peek() == '\'') advance(); // Skip the closing quote
+        else markTruncated(escapes ? start - 1 : start); // Lexing resumes at the E prefix
+        return {STRING_LITERAL, value, line};
+    }
+
+    // Whether the quote at the current position opens an escape string: it follows a lone
+    // E or e, which is lexed as an identifier of its own
+    bool escapePrefix() {
+        if (position == 0 || (input[position - 1] != 'E' && input[position - 1] != 'e')) return false;
+        if (position == 1) return true;
+        char before = input[position - 2];
+        return !isalnum(static_cast<unsigned char>(before)) && before != '_';
+    }
+
+    Token handleLineComment() {
+        std::string value;
+        while (peek() != '\n' && position < input.length() && !atClosingTag()) {
+            value += advance();
+        }
+        return {COMMENT, value, line};
+    }
+
+    // Block comments nest in PostgreSQL
+    Token handleBlockComment() {
+        size_t start = position;
+        std::string value;
+        int depth = 0;
+        while (position < input.length() && !atClosingTag()) {
+            if (peek() == '/' && peek(1) == '*') {
+                depth++;
+                value += advance();
+            } else if (peek() == '*' && peek(1) == '/') {
+                depth--;
+                value += advance();
+                value += advance();
+                if (depth == 0) break;
+                continue;
+            }
+            value += advance();
+        }
+        if (depth != 0) markTruncated(start);
+        return {COMMENT, value, line};
+    }
+
+    // Length of a $tag$ dollar-quote delimiter at the current position, or 0
+    size_t dollarTagLength() {
+        size_t length = 1;
+        if (isalpha(peek(length)) || peek(length) == '_') {
+            while (isalnum(peek(length)) || peek(length) == '_') length++;
+        }
+        return peek(length) == '$' ? length + 1 : 0;
+    }
+
+    // Dollar-quoted bodies are lexed as code so calls inside PL/pgSQL bodies stay visible;
+    // only the delimiter itself becomes a single token
+    Token handleDollarTag(size_t length) {
+        std::string value;
+        for (size_t i = 0; i < length; ++i) value += advance();
+        if (openTag.empty()) openTag = value;
+        else if (openTag == value) openTag.clear();
+        return {SYMBOL, value, line};
+    }
+
+public:
+    // Lexes input as text starting at firstLine, inside the dollar quote delimited by
+    // openTag when it is not empty
+    Lexer(std::string_view input, int firstLine = 1, std::string openTag = "")
+        : input(input), line(firstLine), openTag(std::move(openTag)) {}
+
+    // Appends the tokens of the whole input, without the END_OF_FILE marker
+    void lexInto(std::vector<Token> &tokens) {
+        while (position < input.length()) {
+            skipWhitespace();
+            char current = peek();
+            size_t tagLength;
+            size_t start = position;
+            size_t count = tokens.size();
+            if (isalpha(current) || current == '_') {
+                tokens.push_back(handleIdentifierOrKeyword());
+            } else if (isdigit(current)) {
+                tokens.push_back(handleLiteral());
+            } else if (current == '"') {
+                tokens.push_back(handleStringLiteral());
+            } else if (current == '\'') {
+                tokens.push_back(handleQuotedLiteral(escapePrefix()));
+            } else if (current == '-' && peek(1) == '-') {
+                tokens.push_back(handleLineComment());
+            } else if (current == '/' && peek(1) == '*') {
+                tokens.push_back(handleBlockComment());
+            } else if (current == '$' && (tagLength = dollarTagLength()) != 0) {
+                tokens.push_back(handleDollarTag(tagLength));
+            } else if (ispunct(current)) {
+                tokens.push_back(handleSymbol());
+            } else {
+                advance();
+            }
+            if (tokens.size() > count) tokens.back().offset = start;
+        }
+    }
+
+    std::vector<Token> tokenize() {
+        std::vector<Token> tokens;
+        lexInto(tokens);
+        tokens.push_back({END_OF_FILE, "", line, input.length()});
+        return tokens;
+    }
+
+    bool endedInsideToken() const { return truncated; }
+    // Where lexing must resume to lex the unterminated token again, the prefix of an
+    // escape string included; every token from there on is incomplete
+    size_t unterminatedOffset() const { return truncatedStart; }
+    // Whether the tokens could differ if lexing had started in another dollar quote
+    bool dependsOnOpenTag() const { return tagDependent; }
+};
+
+// Lexes input in newline-aligned chunks on the pool when it is large enough to pay off
+std::vector<Token> tokenizeParallel(const std::string &input, ThreadPool &pool);
+
+// Preprocessor class; each instance keeps the #define substitutions of one file
+class Preprocessor {
+private:
+    std::unordered_map<std::string, std::string> preprocessorMap;
+
+public:
+    // Whether a directive has been seen, so that the output differs from the input
+    bool substituted() const { return !preprocessorMap.empty(); }
+
+    std::string process(std::string_view input) {
+        // Without directives the output is the input with its last line terminated
+        if (preprocessorMap.empty() && input.find("#define") == std::string_view::npos) {
+            std::string output(input);
+            if (!output.empty() && output.back() != '\n') output += '\n';
+            return output;
+        }
+        std::istringstream stream{std::string(input)};
+        std::ostringstream processedCode;
+        std::string line;
+
+        while (std::getline(stream, line)) {
+            // Check for #define directive
+            if (line.find("#define") == 0) {
+                std::istringstream defineStream(line);
+                std::string directive, key, value;
+                defineStream >> directive >> key;
+                std::getline(defineStream, value);
+                value = std::regex_replace(value, std::regex("^\\s+|\\s+$"), ""); // Trim whitespace
+                preprocessorMap[key] = value;
+                processedCode << "\n"; // Keep line numbers in step with the source
+            } else {
+                // Replace macros in the line
+                for (const auto &entry : preprocessorMap) {
+                    size_t pos = 0;
+                    while ((pos = line.find(entry.first, pos)) != std::string::npos) {
+                        line.replace(pos, entry.first.length(), entry.second);
+                        pos += entry.second.length();
+                    }
+                }
+                processedCode << line << "\n";
+            }
+        }
+
+        return processedCode.str();
+    }
+};
+
+// Outcome of matching a call against the overloads of a function
+struct Resolution {
+    enum Status {
+        FOUND,
+        UNKNOWN_FUNCTION,
+        ARITY_MISMATCH,
+        TYPE_MISMATCH
+    } status;
+    size_t overloadCount;
+    int line;          // Definition line of the match or of the only overload, 0 for built-ins
+    std::string arity; // Argument count the only overload accepts, set on an arity mismatch
+};
+
+// Whether an argument of type actual can be passed for a parameter of type declared;
+// string literals are untyped in PostgreSQL and coerce to any parameter type
+inline bool argumentCompatible(TypeId declared, TypeId actual) {
+    if (declared == UNKNOWN_TYPE || actual == UNKNOWN_TYPE || actual == TEXT_TYPE) return true;
+    if (actual == INTEGER_TYPE) return TypeTable::isNumeric(declared);
+    return declared == actual;
+}
+
+// Picks the overload accepting argumentTypes.size() arguments whose declared types match
+// the inferred argument types most closely. forEachCandidate(visit) calls visit on every
+// overload; candidates provide acceptsArity, parameterType, describeArity and line.
+template <typename ForEachCandidate>
+Resolution resolveOverloads(size_t overloadCount, ForEachCandidate forEachCandidate,
+                            const std::vector<TypeId> &argumentTypes) {
+    int bestScore = -1;
+    int bestLine = 0;
+    int sameArityLine = -1;
+    Resolution mismatch{Resolution::ARITY_MISMATCH, overloadCount, 0, ""};
+    forEachCandidate([&](const auto &candidate) {
+        if (!candidate.acceptsArity(argumentTypes.size())) {
+            if (mismatch.arity.empty()) {
+                mismatch.arity = candidate.describeArity();
+                mismatch.line = candidate.line;
+            }
+            return;
+        }
+        sameArityLine = candidate.line;
+        int score = 0;
+        for (size_t i = 0; i < argumentTypes.size(); ++i) {
+            TypeId declared = candidate.parameterType(i);
+            if (!argumentCompatible(declared, argumentTypes[i])) return;
+            if (declared == argumentTypes[i]) score++;
+        }
+        if (score > bestScore) {
+            bestScore = score;
+            bestLine = candidate.line;
+        }
+    });
+    if (bestScore >= 0) return {Resolution::FOUND, overloadCount, bestLine, ""};
+    if (sameArityLine >= 0) return {Resolution::TYPE_MISMATCH, overloadCount, sameArityLine, ""};
+    return mismatch;
+}
+
+// Function table built by the first pass: an open-addressing hash table from the
+// case-folded function name to its overload set. A slot is 16 bytes holding the name hash
+// and up to two signature indices inline, so a typical lookup touches a single cache line
+// and only compares names on a hash match.
+class FunctionTable {
+private:
+    static const uint32_t inlineCandidates = 2;
+
+    struct Slot {
+        uint32_t hash = 0; // 0 marks an empty slot
+        uint32_t count = 0;
+        // Signature indices; with more than two overloads candidates[1] indexes overflowSets
+        uint32_t candidates[inlineCandidates] = {0, 0};
+    };
+
+    std::vector<Slot> slots;
+    std::vector<FunctionSignature> signatureList;
+    std::vector<std::vector<uint32_t>> overflowSets;
+    size_t nameCount = 0;
+
+    static uint32_t hashName(std::string_view name) {
+        uint32_t hash = 2166136261u; // FNV-1a over the lowercase name
+        for (char c : name) {
+            hash = (hash ^ static_cast<unsigned char>(tolower(c))) * 16777619u;
+        }
+        return hash == 0 ? 1 : hash;
+    }
+
+    static bool sameName(std::string_view a, std::string_view b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+            return tolower(x) == tolower(y);
+        });
+    }
+
+    const Slot *findSlot(std::string_view name) const {
+        if (slots.empty()) return nullptr;
+        uint32_t hash = hashName(name);
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            const Slot &slot = slots[i];
+            if (slot.hash == 0) return nullptr;
+            if (slot.hash == hash && sameName(signatureList[slot.candidates[0]].name, name)) return &slot;
+        }
+    }
+
+    void grow() {
+        std::vector<Slot> old = std::move(slots);
+        slots.assign(std::max<size_t>(old.size() * 2, 64), Slot());
+        size_t mask = slots.size() - 1;
+        for (const Slot &slot : old) {
+            if (slot.hash == 0) continue;
+            size_t i = slot.hash & mask;
+            while (slots[i].hash != 0) i = (i + 1) & mask;
+            slots[i] = slot;
+        }
+    }
+
+    template <typename Visit>
+    void forEachCandidate(const Slot &slot, Visit visit) const {
+        if (slot.count <= inlineCandidates) {
+            for (uint32_t i = 0; i < slot.count; ++i) visit(signatureList[slot.candidates[i]]);
+        } else {
+            visit(signatureList[slot.candidates[0]]);
+            for (uint32_t index : overflowSets[slot.candidates[1]]) visit(signatureList[index]);
+        }
+    }
+
+public:
+    // Adds an overload of signature.name unless one with the same argument types exists,
+    // so the first definition of a replaced function wins
+    bool add(FunctionSignature signature) {
+        if (const Slot *slot = findSlot(signature.name)) {
+            bool duplicate = false;
+            forEachCandidate(*slot, [&](const FunctionSignature &candidate) {
+                duplicate = duplicate || (candidate.argumentTypes == signature.argumentTypes &&
+                                          candidate.variadic == signature.variadic);
+            });
+            if (duplicate) return false;
+        }
+        if ((nameCount + 1) * 4 > slots.size() * 3) grow();
+        uint32_t hash = hashName(signature.name);
+        uint32_t index = static_cast<uint32_t>(signatureList.size());
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i].hash != 0 &&
+               !(slots[i].hash == hash && sameName(signatureList[slots[i].candidates[0]].name, signature.name))) {
+            i = (i + 1) & mask;
+        }
+        signatureList.push_back(std::move(signature));
+
+        Slot &slot = slots[i];
+        if (slot.hash == 0) {
+            slot.hash = hash;
+            nameCount++;
+        }
+        if (slot.count < inlineCandidates) {
+            slot.candidates[slot.count] = index;
+        } else if (slot.count == inlineCandidates) {
+            overflowSets.push_back({slot.candidates[1], index});
+            slot.candidates[1] = static_cast<uint32_t>(overflowSets.size() - 1);
+        } else {
+            overflowSets[slot.candidates[1]].push_back(index);
+        }
+        slot.count++;
+        return true;
+    }
+
+    bool contains(std::string_view name) const {
+        return findSlot(name) != nullptr;
+    }
+
+    Resolution resolve(std::string_view name, const std::vector<TypeId> &argumentTypes) const {
+        const Slot *slot = findSlot(name);
+        if (!slot) return {Resolution::UNKNOWN_FUNCTION, 0, 0, ""};
+        return resolveOverloads(
+            slot->count, [&](auto visit) { forEachCandidate(*slot, visit); }, argumentTypes);
+    }
+
+    // Calls visit for every overload of name
+    template <typename Visit>
+    void forEachOverload(std::string_view name, Visit visit) const {
+        if (const Slot *slot = findSlot(name)) forEachCandidate(*slot, visit);
+    }
+
+    size_t size() const { return signatureList.size(); }
+    std::vector<FunctionSignature> &signatures() { return signatureList; }
+    const std::vector<FunctionSignature> &signatures() const { return signatureList; }
+};
+
+// Resolves a call against the built-in function catalog
+Resolution resolveBuiltin(std::string_view name, const std::vector<TypeId> &argumentTypes);
+
+// PG_CATALOG_VERSION the built-in catalog was compiled for
+extern const uint32_t builtinCatalogVersion;
+
+// Column of a table defined by CREATE TABLE
+struct TableColumn {
+    std::string name;
+    TypeId type;
+};
+
+// Table defined by CREATE TABLE
+struct TableDefinition {
+    std::string name;
+    std::vector<TableColumn> columns;
+    int line;
+    uint32_t file = 0;
+};
+
+// Type or domain defined by CREATE TYPE / CREATE DOMAIN
+struct TypeDefinition {
+    std::string name;
+    int line;
+    uint32_t file = 0;
+};
+
+// Compressed trie over case-folded symbol names, answering completion by prefix and
+// "did you mean" by bounded edit distance without visiting every name. Each node holds
+// the label of the edge leading to it; children are kept sorted by first character. A
+// name can be several kinds of symbol at once, a table and a function say, so a node
+// keeps one entry per kind.
+class SymbolIndex {
+public:
+    enum Kind : uint8_t { FUNCTION = 1, BUILTIN = 2, TABLE = 4, COLUMN = 8, TYPE = 16 };
+
+    struct Match {
+        std::string name; // As first spelled in the source or catalog
+        Kind kind;
+        int distance;
+    };
+
+private:
+    struct Entry {
+        std::string name; // As first spelled for this kind
+        Kind kind;
+    };
+
+    struct Node {
+        std::string label;
+        std::vector<uint32_t> children;
+        std::vector<Entry> entries; // Names ending here, at most one per kind
+    };
+    std::vector<Node> nodes = std::vector<Node>(1); // nodes[0] is the root
+
+    // Position in node's children where a child starting with c is or would go
+    std::vector<uint32_t>::iterator childSlot(uint32_t node, char c) {
+        auto &children = nodes[node].children;
+        return std::lower_bound(children.begin(), children.end(), c,
+                                [&](uint32_t child, char value) { return nodes[child].label[0] < value; });
+    }
+
+    int findChild(uint32_t node, char c) const {
+        for (uint32_t child : nodes[node].children) {
+            if (nodes[child].label[0] == c) return static_cast<int>(child);
+        }
+        return -1;
+    }
+
+    void collect(uint32_t node, unsigned kinds, size_t limit, std::vector<Match> &matches) const {
+        for (const Entry &entry : nodes[node].entries) {
+            if (matches.size() >= limit) return;
+            if (entry.kind & kinds) matches.push_back({entry.name, entry.kind, 0});
+        }
+        for (uint32_t child : nodes[node].children) {
+            if (matches.size() >= limit) return;
+            collect(child, kinds, limit, matches);
+        }
+    }
+
+    // Extends the edit distance row at depth by each character of the node label,
+    // abandoning the subtree once no cell is within maxDistance. rows holds one row per
+    // trie depth, so the search allocates nothing once it has grown.
+    void search(uint32_t node, const std::string &word, std::vector<int> &rows, size_t depth, unsigned kinds,
+                int maxDistance, std::vector<Match> &matches) const {
+        size_t width = word.size() + 1;
+        for (char c : nodes[node].label) {
+            if (rows.size() < (depth + 2) * width) rows.resize((depth + 2) * width);
+            const int *row = &rows[depth * width];
+            int *next = &rows[(depth + 1) * width];
+            next[0] = row[0] + 1;
+            int best = next[0];
+            for (size_t i = 1; i < width; ++i) {
+                next[i] = std::min({next[i - 1] + 1, row[i] + 1, row[i - 1] + (word[i - 1] == c ? 0 : 1)});
+                best = std::min(best, next[i]);
+            }
+            depth++;
+            if (best > maxDistance) return;
+        }
+        int distance = rows[depth * width + width - 1];
+        for (const Entry &entry : nodes[node].entries) {
+            if ((entry.kind & kinds) && distance <= maxDistance) matches.push_back({entry.name, entry.kind, distance});
+        }
+        for (uint32_t child : nodes[node].children) search(child, word, rows, depth, kinds, maxDistance, matches);
+    }
+
+public:
+    // Adds a name of the given kind; the first spelling added for each kind is kept
+    void insert(std::string_view name, Kind kind) {
+        std::string key = lowercase(std::string(name));
+        if (key.empty()) return;
+        uint32_t node = 0;
+        size_t i = 0;
+        while (i < key.size()) {
+            auto slot = childSlot(node, key[i]);
+            if (slot == nodes[node].children.end() || nodes[*slot].label[0] != key[i]) {
+                Node leaf;
+                leaf.label = key.substr(i);
+                nodes[node].children.insert(slot, static_cast<uint32_t>(nodes.size()));
+                nodes.push_back(std::move(leaf));
+                node = static_cast<uint32_t>(nodes.size() - 1);
+                i = key.size();
+                break;
+            }
+            uint32_t child = *slot;
+            const std::string &label = nodes[child].label;
+            size_t common = 0;
+            while (common < label.size() && i + common < key.size() && label[common] == key[i + common]) common++;
+            if (common < label.size()) {
+                // Split the edge: a new node takes the shared part of the label
+                Node middle;
+                middle.label = label.substr(0, common);
+                middle.children.push_back(child);
+                nodes[child].label.erase(0, common);
+                *slot = static_cast<uint32_t>(nodes.size());
+                nodes.push_back(std::move(middle));
+                child = static_cast<uint32_t>(nodes.size() - 1);
+            }
+            node = child;
+            i += common;
+        }
+        auto &entries = nodes[node].entries;
+        if (std::none_of(entries.begin(), entries.end(), [&](const Entry &entry) { return entry.kind == kind; })) {
+            entries.push_back({std::string(name), kind});
+        }
+    }
+
+    // Names of the given kinds starting with prefix, in alphabetical order
+    std::vector<Match> complete(std::string_view prefix, unsigned kinds, size_t limit) const {
+        std::string key = lowercase(std::string(prefix));
+        uint32_t node = 0;
+        size_t i = 0;
+        while (i < key.size()) {
+            int child = findChild(node, key[i]);
+            if (child < 0) return {};
+            const std::string &label = nodes[child].label;
+            size_t length = std::min(label.size(), key.size() - i);
+            if (label.compare(0, length, key, i, length) != 0) return {};
+            node = static_cast<uint32_t>(child);
+            i += length;
+        }
+        std::vector<Match> matches;
+        collect(node, kinds, limit, matches);
+        return matches;
+    }
+
+    // Names of the given kinds within maxDistance edits of word, closest first
+    std::vector<Match> suggest(std::string_view word, unsigned kinds, int maxDistance, size_t limit) const {
+        std::string key = lowercase(std::string(word));
+        std::vector<int> rows(key.size() + 1);
+        for (size_t i = 0; i < rows.size(); ++i) rows[i] = static_cast<int>(i);
+        std::vector<Match> matches;
+        for (uint32_t child : nodes[0].children) search(child, key, rows, 0, kinds, maxDistance, matches);
+        std::stable_sort(matches.begin(), matches.end(),
+                         [](const Match &a, const Match &b) { return a.distance < b.distance; });
+        if (matches.size() > limit) matches.resize(limit);
+        return matches;
+    }
+};
+
+// Largest edit distance a suggestion may be from an unknown name of the given length, about
+// one edit per three characters; negative for names shorter than 3, which any other short
+// name would be close to, so they get no suggestion
+inline int suggestionDistance(size_t length) {
+    return length < 3 ? -1 : static_cast<int>(std::min<size_t>(length / 3, 3));
+}
+
+// Global symbols merged from the first pass of every file
+struct SymbolTable {
+    FunctionTable functions;
+    std::vector<TableDefinition> tables;
+    std::vector<TypeDefinition> types;
+    SymbolIndex index; // Built by indexSymbols once the table is complete
+    const SymbolTable *outer = nullptr; // Consulted after this table, e.g. a context's definitions
+};
+
+// Builds the name index over user functions, tables, their columns and types, plus the
+// built-in functions unless an outer table already indexes them
+void indexSymbols(SymbolTable &symbols);
+
+// Append-only text kept in chunks that never move once written, so growing it never
+// copies what is already there. Chunks start small and double up to chunkLimit, which
+// keeps the many short outputs of single statements cheap. Long runs of text that outlive
+// the buffer, such as slices of the source being formatted, can be borrowed instead of
+// copied; they are then written straight from where they are.
+class OutputBuffer {
+private:
+    static const size_t firstChunkSize = 256;
+    static const size_t chunkLimit = 64 << 10;
+    static const size_t minBorrowSize = 64; // Shorter text is cheaper to copy than to track
+    std::vector<std::string> chunks;        // Owned text
+    std::vector<std::string_view> slices;   // The text in order: parts of chunks and borrowed text
+    size_t totalSize = 0;
+    size_t borrowedSize = 0;
+
+    // Chunk with room for count more bytes. Capacities never drop below firstChunkSize, so
+    // chunk text is on the heap and stays in place when chunks grows.
+    std::string &room(size_t count) {
+        if (chunks.empty() || chunks.back().capacity() - chunks.back().size() < count) {
+            size_t capacity = chunks.empty() ? firstChunkSize : std::min(chunks.back().capacity() * 2, chunkLimit);
+            chunks.emplace_back();
+            chunks.back().reserve(std::max(capacity, count));
+        }
+        return chunks.back();
+    }
+
+    void appendRepeated(char c, size_t count) {
+        static const std::string spaces(256, ' ');
+        static const std::string tabs(64, '\t');
+        const std::string &run = c == '\t' ? tabs : spaces;
+        while (count > 0) {
+            size_t piece = std::min(count, run.size());
+            append(std::string_view(run.data(), piece));
+            count -= piece;
+        }
+    }
+
+public:
+    OutputBuffer() = default;
+    // Slices point into chunks, so a copy would still refer to the original's text
+    OutputBuffer(const OutputBuffer &) = delete;
+    OutputBuffer &operator=(const OutputBuffer &) = delete;
+    OutputBuffer(OutputBuffer &&) = default;
+    OutputBuffer &operator=(OutputBuffer &&) = default;
+
+    // Takes over text as the first chunk
+    explicit OutputBuffer(std::string text) {
+        if (text.capacity() < firstChunkSize) {
+            append(text);
+            return;
+        }
+        totalSize = text.size();
+        chunks.push_back(std::move(text));
+        if (totalSize > 0) slices.push_back(chunks.back());
+    }
+
+    void append(std::string_view text) {
+        if (text.empty()) return;
+        std::string &chunk = room(text.size());
+        const char *end = chunk.data() + chunk.size();
+        chunk.append(text);
+        // Extends the last slice when it ends where the new text went
+        if (!slices.empty() && slices.back().data() + slices.back().size() == end) {
+            slices.back() = std::string_view(slices.back().data(), slices.back().size() + text.size());
+        } else {
+            slices.push_back(std::string_view(end, text.size()));
+        }
+        totalSize += text.size();
+    }
+
+    void append(char c) { append(std::string_view(&c, 1)); }
+
+    // Appends text without copying it when it is long enough. Text must stay valid and in
+    // place for as long as this buffer, or any buffer its text is moved to, is used.
+    void borrow(std::string_view text) {
+        if (text.size() < minBorrowSize) {
+            append(text);
+            return;
+        }
+        slices.push_back(text);
+        totalSize += text.size();
+        borrowedSize += text.size();
+    }
+
+    // Spaces copied from a preset run of spaces
+    void appendSpaces(size_t count) { appendRepeated(' ', count); }
+    void appendTabs(size_t count) { appendRepeated('\t', count); }
+
+    void appendNumber(long long value) {
+        char digits[24];
+        append(std::string_view(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr - digits));
+    }
+
+    // Moves the text of other to the end of this buffer without copying it
+    void append(OutputBuffer &&other) {
+        for (auto &chunk : other.chunks) chunks.push_back(std::move(chunk));
+        slices.insert(slices.end(), other.slices.begin(), other.slices.end());
+        totalSize += other.totalSize;
+        borrowedSize += other.borrowedSize;
+        other.clear();
+    }
+
+    // Replaces the content with text borrowed as a whole
+    void assignBorrowed(std::string_view text) {
+        clear();
+        borrow(text);
+    }
+
+    void clear() {
+        chunks.clear();
+        slices.clear();
+        totalSize = 0;
+        borrowedSize = 0;
+    }
+
+    size_t size() const { return totalSize; }
+    bool empty() const { return totalSize == 0; }
+    bool borrows() const { return borrowedSize > 0; }
+    const std::vector<std::string_view> &pieces() const { return slices; }
+
+    bool equals(std::string_view text) const {
+        if (text.size() != totalSize) return false;
+        for (std::string_view slice : slices) {
+            if (text.compare(0, slice.size(), slice) != 0) return false;
+            text.remove_prefix(slice.size());
+        }
+        return true;
+    }
+
+    // Contiguous copy, for callers that need a single string
+    std::string str() const {
+        std::string text;
+        text.reserve(totalSize);
+        for (std::string_view slice : slices) text += slice;
+        return text;
+    }
+};
+
+// Oppen's pretty printer. Text, breaks and nested boxes go in; a box that fits on the rest
+// of the line is printed flat, otherwise a consistent box breaks at every one of its
+// breaks and an inconsistent box only where the next piece would not fit. Sizes are
+// measured through a lookahead buffer that never holds more than about a line width of
+// text, so printing takes linear time and bounded memory whatever the document size.
+// Text is referenced, not copied, and must stay valid until finish returns; borrowed text
+// is also referenced by the output, see OutputBuffer::borrow.
+class PrettyPrinter {
+public:
+    enum Breaks { CONSISTENT, INCONSISTENT };
+
+private:
+    static const long infinity = 1L << 30; // Size of a hard break; wider than any line
+    enum Kind { TEXT, BREAK, BEGIN, END };
+    struct Entry {
+        Kind kind;
+        std::string_view text;
+        int offset; // Indentation of a box, or extra indentation of a break when taken
+        int blank;  // Spaces a break prints when not taken
+        bool fixed; // A break that is never taken
+        Breaks breaks;
+        long size;  // Up to the next break or to the end of the box; negative while unknown
+        bool borrowed = false; // Text that outlives the output
+    };
+    // Box being printed
+    struct Frame {
+        bool fits;
+        int indent; // Indentation to restore when the box ends
+        Breaks breaks;
+    };
+
+    OutputBuffer &out;
+    long width;
+    int tabWidth;         // Columns of a tab that line indentation is written with; 0 for spaces
+    long space;           // Columns left on the current line
+    int indent = 0;       // Indentation of the innermost broken box
+    int pendingSpaces = 0; // Written before the next text, so lines never end in spaces
+    bool indenting = false; // pendingSpaces are the indentation of a new line
+    std::vector<Entry> buffer; // Scanned but not yet printed from buffer[head] on
+    size_t head = 0;
+    size_t bufferStart = 0; // Index of buffer[head]
+    long leftTotal = 1;     // Sizes of everything printed and of everything scanned
+    long rightTotal = 1;
+    std::deque<size_t> scanStack; // Indices of the buffered entries whose size is unknown
+    std::vector<Frame> printStack;
+
+    Entry &at(size_t index) { return buffer[head + index - bufferStart]; }
+
+    bool buffered() const { return head < buffer.size(); }
+
+    size_t push(const Entry &entry) {
+        buffer.push_back(entry);
+        return bufferStart + buffer.size() - head - 1;
+    }
+
+    // Starts measuring afresh once everything scanned has been printed
+    void restart() {
+        leftTotal = rightTotal = 1;
+        buffer.clear();
+        head = 0;
+        bufferStart = 0;
+    }
+
+    void printText(std::string_view text, bool borrowed) {
+        if (indenting && tabWidth > 0) {
+            out.appendTabs(static_cast<size_t>(pendingSpaces / tabWidth));
+            pendingSpaces %= tabWidth;
+        }
+        out.appendSpaces(static_cast<size_t>(pendingSpaces));
+        pendingSpaces = 0;
+        indenting = false;
+        if (borrowed) out.borrow(text);
+        else out.append(text);
+        size_t newline = text.rfind('\n');
+        if (newline == std::string_view::npos) space -= static_cast<long>(text.size());
+        else space = width - static_cast<long>(text.size() - newline - 1);
+    }
+
+    void print(const Entry &entry) {
+        switch (entry.kind) {
+        case TEXT:
+            leftTotal += static_cast<long>(entry.text.size());
+            printText(entry.text, entry.borrowed);
+            break;
+        case BREAK: {
+            leftTotal += entry.blank;
+            Frame top = printStack.empty() ? Frame{false, 0, INCONSISTENT} : printStack.back();
+            if (entry.fixed || top.fits || (top.breaks == INCONSISTENT && entry.size <= space)) {
+                pendingSpaces += entry.blank;
+                space -= entry.blank;
+            } else {
+                out.append('\n');
+                pendingSpaces = std::max(indent + entry.offset, 0);
+                indenting = true;
+                space = width - pendingSpaces;
+            }
+            break;
+        }
+        case BEGIN:
+            printStack.push_back({entry.size <= space, indent, entry.breaks});
+            if (entry.size > space) indent += entry.offset;
+            break;
+        case END:
+            if (!printStack.empty()) {
+                indent = printStack.back().indent;
+                printStack.pop_back();
+            }
+            break;
+        }
+    }
+
+    // Prints the buffered entries whose sizes are known
+    void advanceLeft() {
+        while (buffered() && buffer[head].size >= 0) {
+            print(buffer[head++]);
+            bufferStart++;
+        }
+        // Drops the printed entries once they make up most of the buffer
+        if (head > 1024 && head * 2 > buffer.size()) {
+            buffer.erase(buffer.begin(), buffer.begin() + static_cast<std::ptrdiff_t>(head));
+            head = 0;
+        }
+    }
+
+    // Once more is buffered than fits on the line, the oldest open entry cannot fit either
+    void checkStream() {
+        while (rightTotal - leftTotal > space) {
+            if (!scanStack.empty() && scanStack.front() == bufferStart) {
+                scanStack.pop_front();
+                buffer[head].size = infinity;
+            }
+            advanceLeft();
+            if (!buffered()) break;
+        }
+    }
+
+    // Closes the sizes of the open entries that end at the current position
+    void checkStack(int depth) {
+        while (!scanStack.empty()) {
+            Entry &entry = at(scanStack.back());
+            if (entry.kind == BEGIN) {
+                if (depth == 0) break;
+                scanStack.pop_back();
+                entry.size += rightTotal;
+                depth--;
+            } else if (entry.kind == END) {
+                scanStack.pop_back();
+                entry.size = 1;
+                depth++;
+            } else {
+                scanStack.pop_back();
+                entry.size += rightTotal;
+                if (depth == 0) break;
+            }
+        }
+    }
+
+    void addBreak(int blank, int offset, bool fixed) {
+        if (scanStack.empty()) restart();
+        else checkStack(0);
+        scanStack.push_back(push({BREAK, {}, offset, blank, fixed, INCONSISTENT, -rightTotal}));
+        rightTotal += blank;
+    }
+
+public:
+    PrettyPrinter(OutputBuffer &out, int width, int tabWidth = 0)
+        : out(out), width(std::clamp<long>(width, 1, infinity / 2)), tabWidth(std::max(tabWidth, 0)),
+          space(this->width) {}
+
+    // Opens a box whose broken lines are indented by indent more than the enclosing box
+    void begin(int indent, Breaks breaks) {
+        if (scanStack.empty()) restart();
+        scanStack.push_back(push({BEGIN, {}, indent, 0, false, breaks, -rightTotal}));
+    }
+
+    void end() {
+        if (scanStack.empty()) {
+            print({END, {}, 0, 0, false, INCONSISTENT, 0});
+            return;
+        }
+        scanStack.push_back(push({END, {}, 0, 0, false, INCONSISTENT, -1}));
+    }
+
+    // Prints blank spaces, or starts a new line indented by offset more than the box
+    void softBreak(int blank = 1, int offset = 0) { addBreak(blank, offset, false); }
+
+    // Always starts a new line, and so breaks every box around it
+    void hardBreak(int offset = 0) { addBreak(static_cast<int>(infinity), offset, false); }
+
+    // Only prints blank spaces. Like any break it ends the measure of the boxes before it,
+    // so text after it never makes them break.
+    void fixedBreak(int blank = 0) { addBreak(blank, 0, true); }
+
+    // Borrowed text is handed to the output by reference rather than copied into it
+    void text(std::string_view text, bool borrowed = false) {
+        if (scanStack.empty()) {
+            printText(text, borrowed);
+            return;
+        }
+        push({TEXT, text, 0, 0, false, INCONSISTENT, static_cast<long>(text.size()), borrowed});
+        rightTotal += static_cast<long>(text.size());
+        checkStream();
+    }
+
+    // Prints what is still buffered; every box must have been ended
+    void finish() {
+        if (!scanStack.empty()) {
+            checkStack(0);
+            advanceLeft();
+        }
+    }
+};
+
+// Parser with two-pass analysis
+class Parser {
+private:
+    const std::vector<Token> &tokens;
+    size_t position;
+    size_t end; // One past the last token of the range being parsed
+    size_t rangeBegin;
+    FunctionTable functionTable; // Functions defined in the parsed range
+    std::vector<TableDefinition> tables;
+    std::vector<TypeDefinition> types;
+    const FunctionTable *lookupTable = &functionTable; // Table the second pass validates against
+    const SymbolTable *symbols = nullptr; // Merged symbols, source of "did you mean" suggestions
+    std::vector<Diagnostic> diagnostics;
+    std::vector<std::string> calledNames; // Lowercase names the second pass looked up
+    std::string previousWord; // Lowercase identifier or keyword before the current token
+
+    const Token &peek(size_t ahead = 0) {
+        static const Token endOfFile{END_OF_FILE, "", -1};
+        return position + ahead < end ? tokens[position + ahead] : endOfFile;
+    }
+
+    const Token &advance() {
+        const Token &current = peek();
+        if (position < end) position++;
+        if (current.type == IDENTIFIER || current.type == KEYWORD) previousWord = lowercase(current.value);
+        return current;
+    }
+
+    void reportError(const Token &at, Diagnostic::Code code, std::string message, std::vector<std::string> args) {
+        diagnostics.push_back(
+            {at.line, std::move(message), at.offset, at.value.size(), code, Diagnostic::ERROR, std::move(args)});
+    }
+
+    // Type of a call argument made of a single token, where it can be inferred
+    static TypeId inferArgumentType(const Token &token) {
+        if (token.type == LITERAL) return INTEGER_TYPE;
+        if (token.type == STRING_LITERAL) return TEXT_TYPE;
+        return UNKNOWN_TYPE;
+    }
+
+    // Closest function name to an unknown one, searching outer tables too; the innermost
+    // table wins ties. Empty when no name is close enough.
+    std::string suggestFunction(const std::string &name) const {
+        int bestDistance = suggestionDistance(name.size()) + 1;
+        std::string best;
+        if (bestDistance == 0) return best;
+        for (const SymbolTable *scope = symbols; scope; scope = scope->outer) {
+            auto matches = scope->index.suggest(name, SymbolIndex::FUNCTION | SymbolIndex::BUILTIN, bestDistance - 1, 1);
+            if (!matches.empty() && matches[0].distance < bestDistance) {
+                bestDistance = matches[0].distance;
+                best = matches[0].name;
+            }
+        }
+        return best;
+    }
+
+    // Consumes '(' arguments ')' and returns one inferred type per top-level argument
+    std::vector<TypeId> parseCallArguments(bool &closed) {
+        std::vector<TypeId> arguments;
+        advance(); // Skip '('
+        int depth = 0;
+        size_t argumentTokens = 0;
+        const Token *firstToken = nullptr;
+        auto finishArgument = [&] {
+            arguments.push_back(argumentTokens == 1 ? inferArgumentType(*firstToken) : UNKNOWN_TYPE);
+            argumentTokens = 0;
+        };
+
+        while (peek().type != END_OF_FILE && !(depth == 0 && peek().value == ")")) {
+            const Token &token = advance();
+            if (token.type == COMMENT) continue;
+            if (depth == 0 && token.value == ",") {
+                finishArgument();
+                continue;
+            }
+            if (token.value == "(") depth++;
+            else if (token.value == ")") depth--;
+            if (argumentTokens++ == 0) firstToken = &token;
+        }
+        if (argumentTokens > 0 || !arguments.empty()) finishArgument();
+
+        closed = peek().value == ")";
+        if (closed) {
+            advance(); // Skip ')'
+        }
+        return arguments;
+    }
+
+    static std::string describeTypes(const std::vector<TypeId> &types) {
+        std::string description = "(";
+        for (size_t i = 0; i < types.size(); ++i) {
+            if (i > 0) description += ", ";
+            description += typeTable().name(types[i]);
+        }
+        return description + ")";
+    }
+
+    // Declared type of a parameter without typmods: "numeric(10, 2)" is numeric,
+    // "character varying(20) []" is "character varying[]"
+    std::string parameterTypeName(const std::vector<size_t> &words, size_t begin, size_t end) {
+        std::string typeName;
+        bool isArray = false;
+        int depth = 0;
+        for (size_t w = begin; w < end; ++w) {
+            const Token &token = tokens[words[w]];
+            if (token.value == "(") {
+                depth++;
+            } else if (token.value == ")") {
+                depth--;
+            } else if (depth > 0) {
+                continue;
+            } else if (token.value == "[" || lowercase(token.value) == "array") {
+                isArray = true;
+            } else if (token.value == "." || token.value == "%") {
+                typeName += token.value;
+            } else if (token.type == IDENTIFIER || token.type == KEYWORD || token.type == STRING_LITERAL) {
+                bool attach = typeName.empty() || typeName.back() == '.' || typeName.back() == '%';
+                typeName += (attach ? "" : " ") + token.value;
+            }
+        }
+        return isArray ? typeName + "[]" : typeName;
+    }
+
+    // One parameter of a function header: [argmode] [argname] argtype [DEFAULT expr | = expr]
+    void parseParameter(size_t begin, size_t end, FunctionSignature &signature, bool isProcedure) {
+        std::vector<size_t> words;
+        for (size_t i = begin; i < end; ++i) {
+            if (tokens[i].type != COMMENT) words.push_back(i);
+        }
+        if (words.empty()) return;
+
+        size_t w = 0;
+        std::string mode = lowercase(tokens[words[0]].value);
+        if (words.size() > 1 && (mode == "in" || mode == "out" || mode == "inout" || mode == "variadic")) {
+            w++;
+        } else {
+            mode = "in";
+        }
+        size_t typeEnd = w;
+        bool hasDefault = false;
+        for (int depth = 0; typeEnd < words.size(); ++typeEnd) {
+            const Token &token = tokens[words[typeEnd]];
+            if (token.value == "(") depth++;
+            else if (token.value == ")") depth--;
+            else if (depth == 0 && (token.value == "=" || lowercase(token.value) == "default")) {
+                hasDefault = true;
+                break;
+            }
+        }
+
+        // The first word is the parameter name unless it starts a multi-word type name
+        static const std::set<std::string> multiWordStarts = {"double", "character", "bit", "timestamp",
+                                                              "time", "national"};
+        static const std::set<std::string> typeContinuations = {"precision", "varying", "with", "without"};
+        if (typeEnd - w >= 2 && tokens[words[w]].type == IDENTIFIER &&
+            (tokens[words[w + 1]].type == IDENTIFIER || tokens[words[w + 1]].type == KEYWORD) &&
+            !(multiWordStarts.count(lowercase(tokens[words[w]].value)) &&
+              typeContinuations.count(lowercase(tokens[words[w + 1]].value)))) {
+            w++;
+        }
+        std::string typeName = parameterTypeName(words, w, typeEnd);
+
+        // OUT parameters are not passed to functions, but procedures take a placeholder
+        if (mode == "out" && !isProcedure) return;
+        TypeId type = internTypeName(typeName);
+        if (mode == "variadic") {
+            if (typeName.size() > 2 && typeName.compare(typeName.size() - 2, 2, "[]") == 0) {
+                type = internTypeName(typeName.substr(0, typeName.size() - 2));
+            }
+            signature.variadic = true;
+        }
+        signature.argumentTypes.push_back(type);
+        if (!hasDefault) signature.requiredArguments = signature.argumentTypes.size();
+    }
+
+    // Parses CREATE [OR REPLACE] FUNCTION|PROCEDURE name(parameters) at the current position.
+    // On success the position is after the parameter list; otherwise it is unchanged.
+    bool parseFunctionHeader(FunctionSignature &signature) {
+        size_t start = position;
+        auto fail = [&] {
+            position = start;
+            return false;
+        };
+        advance(); // Skip CREATE
+        if (lowercase(peek().value) == "or") {
+            advance();
+            if (lowercase(advance().value) != "replace") return fail();
+        }
+        std::string kind = lowercase(peek().value);
+        if (kind != "function" && kind != "procedure") return fail();
+        advance();
+        if (peek().type != IDENTIFIER && peek().type != STRING_LITERAL) return fail();
+        // Schema-qualified names are registered under the function name, as calls are
+        const Token *name = &parseQualifiedName();
+        if (peek().value != "(") return fail();
+        advance(); // Skip '('
+
+        signature = {name->value, {}, name->line, 0, false};
+        bool isProcedure = kind == "procedure";
+        size_t parameterStart = position;
+        int depth = 0;
+        while (peek().type != END_OF_FILE && !(depth == 0 && peek().value == ")")) {
+            const Token &token = advance();
+            if (token.value == "(") {
+                depth++;
+            } else if (token.value == ")") {
+                depth--;
+            } else if (depth == 0 && token.value == ",") {
+                parseParameter(parameterStart, position - 1, signature, isProcedure);
+                parameterStart = position;
+            }
+        }
+        if (peek().type == END_OF_FILE) return fail();
+        parseParameter(parameterStart, position, signature, isProcedure);
+        advance(); // Skip ')'
+        return true;
+    }
+
+    // Skips an optionally schema-qualified name and returns its last component
+    const Token &parseQualifiedName() {
+        const Token *name = &advance();
+        while (peek().value == ".") {
+            advance();
+            name = &advance();
+        }
+        return *name;
+    }
+
+    // CREATE [TEMP|UNLOGGED] TABLE [IF NOT EXISTS] name (column type ..., ...); table
+    // constraints are skipped and column constraints end the column type
+    bool parseTableDefinition(TableDefinition &table) {
+        size_t start = position;
+        advance(); // Skip CREATE
+        static const std::set<std::string> tableOptions = {"temp", "temporary", "unlogged", "global", "local"};
+        while (tableOptions.count(lowercase(peek().value))) advance();
+        if (lowercase(peek().value) != "table") {
+            position = start;
+            return false;
+        }
+        advance();
+        if (lowercase(peek().value) == "if") {
+            advance(); // IF NOT EXISTS
+            advance();
+            advance();
+        }
+        const Token &name = parseQualifiedName();
+        table = {name.value, {}, name.line};
+        if (peek().value != "(") return true;
+        advance(); // Skip '('
+
+        static const std::set<std::string> tableConstraints = {"constraint", "primary", "foreign", "unique",
+                                                               "check", "exclude", "like"};
+        static const std::set<std::string> columnConstraints = {"not", "null", "default", "primary", "references",
+                                                                "unique", "check", "constraint", "collate",
+                                                                "generated"};
+        std::vector<size_t> words;
+        auto finishColumn = [&] {
+            if (words.size() >= 2 && !tableConstraints.count(lowercase(tokens[words[0]].value))) {
+                size_t typeEnd = 1;
+                while (typeEnd < words.size() && !columnConstraints.count(lowercase(tokens[words[typeEnd]].value))) {
+                    typeEnd++;
+                }
+                table.columns.push_back({tokens[words[0]].value,
+                                         internTypeName(parameterTypeName(words, 1, typeEnd))});
+            }
+            words.clear();
+        };
+        int depth = 0;
+        while (peek().type != END_OF_FILE && !(depth == 0 && peek().value == ")")) {
+            size_t index = position;
+            const Token &token = advance();
+            if (token.type == COMMENT) continue;
+            if (token.value == "(") depth++;
+            else if (token.value == ")") depth--;
+            if (depth == 0 && token.value == ",") finishColumn();
+            else words.push_back(index);
+        }
+        finishColumn();
+        return true;
+    }
+
+    // CREATE TYPE name / CREATE DOMAIN name
+    bool parseTypeDefinition(TypeDefinition &type) {
+        size_t start = position;
+        advance(); // Skip CREATE
+        std::string kind = lowercase(peek().value);
+        if ((kind != "type" && kind != "domain") || peek(1).type != IDENTIFIER) {
+            position = start;
+            return false;
+        }
+        advance();
+        const Token &name = parseQualifiedName();
+        type = {name.value, name.line};
+        typeTable().intern(lowercase(name.value));
+        return true;
+    }
+
+    // First pass: Record functions, tables and types defined in the range
+    void collectDefinition() {
+        FunctionSignature signature;
+        TableDefinition table;
+        TypeDefinition type;
+        if (parseFunctionHeader(signature)) {
+            functionTable.add(std::move(signature));
+        } else if (parseTableDefinition(table)) {
+            tables.push_back(std::move(table));
+        } else if (parseTypeDefinition(type)) {
+            types.push_back(std::move(type));
+        } else {
+            advance();
+        }
+    }
+
+    // Second pass: Definition headers are skipped and never checked as calls
+    void skipFunctionDefinition() {
+        FunctionSignature signature;
+        if (!parseFunctionHeader(signature)) advance();
+    }
+
+    // Second pass: Validate functions
+    void validateFunctionCall() {
+        std::string precedingWord = previousWord;
+        const Token &functionName = advance();
+
+        // SQL syntax taking a parenthesized list, type modifiers and table column lists
+        // look like calls but are not
+        static const std::set<std::string> nonCallWords = {
+            "in", "exists", "any", "all", "some", "and", "or", "not", "as", "over", "filter", "within",
+            "table", "returns", "using", "array", "row", "cast", "extract", "position", "substring",
+            "overlay", "trim", "if", "elsif", "when", "while", "return", "then", "else", "where", "on",
+            "key", "unique", "check", "primary", "references", "default", "by", "from", "join", "set",
+            "returning", "is", "like", "between", "case", "numeric", "decimal", "varchar", "character",
+            "char", "varying", "bit", "time", "timestamp", "interval", "float", "zone"};
+        static const std::set<std::string> tableContextWords = {"into", "table", "references", "on",
+                                                                "update", "only"};
+        bool isCall = !nonCallWords.count(lowercase(functionName.value)) &&
+                      !tableContextWords.count(precedingWord);
+
+        if (peek().value == "(") {
+            bool closed;
+            std::vector<TypeId> arguments = parseCallArguments(closed);
+            if (!closed) {
+                reportError(functionName, Diagnostic::UNCLOSED_CALL, "Missing closing parenthesis for function call.",
+                            {functionName.value});
+            }
+
+            // Check against the function table and the tables outside it, then against the
+            // built-in catalog
+            Resolution resolution{Resolution::FOUND, 0, 0, ""};
+            if (isCall) {
+                calledNames.push_back(lowercase(functionName.value));
+                resolution = lookupTable->resolve(functionName.value, arguments);
+                for (const SymbolTable *scope = symbols ? symbols->outer : nullptr;
+                     scope && resolution.status != Resolution::FOUND; scope = scope->outer) {
+                    Resolution outer = scope->functions.resolve(functionName.value, arguments);
+                    if (outer.status == Resolution::FOUND || resolution.status == Resolution::UNKNOWN_FUNCTION) {
+                        resolution = outer;
+                    }
+                }
+                if (resolution.status != Resolution::FOUND) {
+                    Resolution builtin = resolveBuiltin(functionName.value, arguments);
+                    if (builtin.status == Resolution::FOUND || resolution.status == Resolution::UNKNOWN_FUNCTION) {
+                        resolution = builtin;
+                    }
+                }
+            }
+            if (resolution.status == Resolution::UNKNOWN_FUNCTION) {
+                std::string message = concat("Unknown function '", functionName.value, "' at line ", functionName.line, ".");
+                std::vector<std::string> args = {functionName.value};
+                std::string suggestion = suggestFunction(functionName.value);
+                if (!suggestion.empty()) {
+                    appendParts(message, " Did you mean '", suggestion, "'?");
+                    args.push_back(std::move(suggestion));
+                }
+                reportError(functionName, Diagnostic::UNKNOWN_FUNCTION, std::move(message), std::move(args));
+            } else if (resolution.status == Resolution::ARITY_MISMATCH && resolution.overloadCount == 1) {
+                std::string message = concat("Function '", functionName.value, "'");
+                if (resolution.line > 0) appendParts(message, " at line ", resolution.line);
+                appendParts(message, " expects ", resolution.arity, " arguments, but ", arguments.size(),
+                            " were provided.");
+                reportError(functionName, Diagnostic::ARGUMENT_COUNT, std::move(message),
+                            {functionName.value, resolution.arity, std::to_string(arguments.size())});
+            } else if (resolution.status == Resolution::ARITY_MISMATCH) {
+                reportError(functionName, Diagnostic::NO_OVERLOAD_ARITY,
+                            concat("No overload of function '", functionName.value, "' takes ", arguments.size(),
+                                   " arguments."),
+                            {functionName.value, std::to_string(arguments.size())});
+            } else if (resolution.status == Resolution::TYPE_MISMATCH) {
+                std::string types = describeTypes(arguments);
+                reportError(functionName, Diagnostic::NO_OVERLOAD_TYPES,
+                            concat("No overload of function '", functionName.value, "' accepts argument types ",
+                                   types, "."),
+                            {functionName.value, types});
+            }
+        }
+    }
+
+    void parseStatement(bool isFirstPass) {
+        const Token &token = peek();
+        if (token.type == KEYWORD && lowercase(token.value) == "create") {
+            if (isFirstPass) {
+                collectDefinition();
+            } else {
+                skipFunctionDefinition();
+            }
+        } else if (token.type == IDENTIFIER && peek().value != "(") {
+            if (isFirstPass) {
+                advance();
+            } else {
+                validateFunctionCall();
+            }
+        } else {
+            advance();
+        }
+    }
+
+public:
+    // Parses tokens[begin, end); the range must not split a function call
+    Parser(const std::vector<Token> &tokens, size_t begin = 0, size_t end = std::string::npos)
+        : tokens(tokens), position(begin), end(std::min(end, tokens.size())), rangeBegin(begin) {}
+
+    void firstPass() {
+        while (peek().type != END_OF_FILE) {
+            parseStatement(true);
+        }
+    }
+
+    // Validate against a table merged from several parsers instead of this parser's own
+    void setFunctionTable(const FunctionTable &table) {
+        lookupTable = &table;
+    }
+
+    // Validate against merged symbols, suggesting close names for unknown functions
+    void setSymbols(const SymbolTable &symbols) {
+        lookupTable = &symbols.functions;
+        this->symbols = &symbols;
+    }
+
+    // Second pass: Validate calls; the output is laid out separately by a Formatter
+    void secondPass() {
+        position = rangeBegin; // Reset position for second pass
+        while (peek().type != END_OF_FILE) {
+            parseStatement(false);
+        }
+    }
+
+    FunctionTable &getFunctionTable() { return functionTable; }
+    std::vector<TableDefinition> &getTables() { return tables; }
+    std::vector<TypeDefinition> &getTypes() { return types; }
+    std::vector<Diagnostic> &getDiagnostics() { return diagnostics; }
+
+    // Functions the range calls, sorted and without duplicates
+    std::vector<std::string> getDependencies() const {
+        std::vector<std::string> names = calledNames;
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        return names;
+    }
+};
+
+// Formatting style with its settings fixed at compile time, so that a Formatter
+// specialized for it tests none of them per token
+template <int IndentWidth, bool Tabs, FormatOptions::KeywordCase Case, bool LeadingCommas>
+struct StaticStyle {
+    static constexpr int indentWidth = IndentWidth;
+    static constexpr bool tabs = Tabs;
+    static constexpr FormatOptions::KeywordCase keywordCase = Case;
+    static constexpr bool leadingCommas = LeadingCommas;
+
+    explicit StaticStyle(const FormatOptions &) {}
+
+    static bool matches(const FormatOptions &options) {
+        return options.indentWidth == IndentWidth && options.tabs == Tabs && options.keywordCase == Case &&
+               options.leadingCommas == LeadingCommas;
+    }
+};
+
+// Presets, see formatUnit
+using DefaultStyle = StaticStyle<4, false, FormatOptions::PRESERVE, false>;
+using UpperCaseStyle = StaticStyle<4, false, FormatOptions::UPPER, false>;
+using LowerCaseStyle = StaticStyle<4, false, FormatOptions::LOWER, false>;
+using TwoSpaceStyle = StaticStyle<2, false, FormatOptions::PRESERVE, false>;
+using TabStyle = StaticStyle<4, true, FormatOptions::PRESERVE, false>;
+
+// Style read from the options at run time, for the combinations no preset covers
+struct RuntimeStyle {
+    int indentWidth;
+    bool tabs;
+    FormatOptions::KeywordCase keywordCase;
+    bool leadingCommas;
+
+    explicit RuntimeStyle(const FormatOptions &options)
+        : indentWidth(std::max(options.indentWidth, 0)), tabs(options.tabs), keywordCase(options.keywordCase),
+          leadingCommas(options.leadingCommas) {}
+};
+
+// Lays out one top-level unit, tokens[begin, end), through a PrettyPrinter. A statement is
+// a box that breaks consistently before its clauses, a clause wraps where it must with a
+// hanging indent, and a parenthesized list puts one item per line when it does not fit.
+// The dollar-quoted body of a PL/pgSQL or SQL function or DO block is laid out a statement
+// per line with its blocks indented; bodies in other languages, nested dollar quotes and
+// dollar-quoted string constants are copied from the source as they are. Style is one of
+// the style policies above.
+template <typename Style>
+class Formatter {
+private:
+    enum Stop { SEMICOLON, STOP_WORD, RANGE_END };
+
+    // Statement or parenthesized list being written
+    struct Level {
+        bool parenthesized;
+        bool empty; // Nothing written since the current item began
+    };
+
+    // Indented PL/pgSQL block; depth counts the indentation levels it adds
+    struct Block {
+        enum Kind { DECLARE, BEGIN, EXCEPTION, IF, LOOP, CASE };
+        Kind kind;
+        int depth;
+    };
+
+    const std::vector<Token> &tokens;
+    std::string_view source; // Text the token offsets refer to, from sourceOffset on
+    size_t sourceOffset;
+    size_t begin;
+    size_t end;
+    size_t position;
+    Style style;
+    OutputBuffer output;
+    PrettyPrinter printer;
+    std::vector<Level> levels;
+    int depth = 0;           // Indentation level of body statements
+    bool lineStart = true;   // Nothing written since the last line break
+    bool blankLine = false;  // The next line break leaves an empty line
+    bool formatBody = true; // The dollar-quoted body is PL/pgSQL or SQL
+
+    // Lowercase identifier or keyword; empty for other tokens and for words longer than
+    // any this class looks for
+    static std::string word(const Token &token) {
+        if ((token.type != IDENTIFIER && token.type != KEYWORD) || token.value.size() > 15) return "";
+        return lowercase(token.value);
+    }
+
+    static bool isDollarTag(const Token &token) {
+        return token.type == SYMBOL && token.value.size() > 1 && token.value[0] == '$';
+    }
+
+    static bool isOperator(const Token &token) {
+        return token.type == SYMBOL && token.value.size() == 1 && strchr("+-*/<>=~!@#%^&|`?:", token.value[0]);
+    }
+
+    // Words after which a parenthesis opens an expression rather than an argument list,
+    // and after which a sign is unary
+    static bool isOperatorWord(const std::string &word) {
+        static const std::set<std::string, std::less<>> words = {
+            "all", "and", "any", "as", "between", "by", "check", "else", "elsif", "exists", "filter", "from",
+            "if", "ilike", "in", "into", "is", "join", "like", "not", "on", "or", "over", "query", "return",
+            "returns", "select", "set", "some", "table", "then", "using", "values", "when", "where", "while",
+            "with", "within"};
+        return words.count(word) > 0;
+    }
+
+    // Source text of tokens[i]; string literals keep their quotes and escapes. Comments are
+    // taken from the source too, so that long ones are borrowed rather than copied.
+    std::string_view text(size_t i) const {
+        const Token &token = tokens[i];
+        if ((token.type != STRING_LITERAL && token.type != COMMENT) || token.offset < sourceOffset ||
+            token.offset - sourceOffset >= source.size()) {
+            return token.value;
+        }
+        size_t start = token.offset - sourceOffset;
+        if (token.type == COMMENT) {
+            std::string_view comment = source.substr(start, token.value.size());
+            return comment == token.value ? comment : std::string_view(token.value);
+        }
+        char quote = source[start];
+        // The quote of an escape string follows its E prefix, as the lexer saw it
+        const Token &previous = tokens[i > 0 ? i - 1 : i];
+        bool escapes = quote == '\'' && i > 0 && previous.type == IDENTIFIER &&
+                       (previous.value == "E" || previous.value == "e") && previous.offset + 1 == token.offset;
+        size_t close = start + 1;
+        while (close < source.size()) {
+            if (source[close] == quote) {
+                if (quote != '\'' || close + 1 >= source.size() || source[close + 1] != '\'') break;
+                close++; // Escaped quote
+            } else if (escapes && source[close] == '\\') {
+                close++;
+            }
+            close++;
+        }
+        return source.substr(start, std::min(close + 1, source.size()) - start);
+    }
+
+    // Offset just past tokens[i]
+    size_t endOffset(size_t i) const {
+        return tokens[i].offset + (tokens[i].type == STRING_LITERAL ? text(i).size() : tokens[i].value.size());
+    }
+
+    // Text tokens[i] is written as: keywords in the case of the style, except as parts of
+    // qualified names
+    std::string_view spelling(size_t i) const {
+        const Token &token = tokens[i];
+        if (style.keywordCase == FormatOptions::PRESERVE || (token.type != KEYWORD && token.type != IDENTIFIER) ||
+            (i > begin && tokens[i - 1].value == ".") || (i + 1 < end && tokens[i + 1].value == ".")) {
+            return text(i);
+        }
+        auto keyword = casedKeywords.find(word(token));
+        if (keyword == casedKeywords.end()) return text(i);
+        return style.keywordCase == FormatOptions::UPPER ? std::string_view(keyword->second)
+                                                         : std::string_view(keyword->first);
+    }
+
+    // Whether tokens[i] touches the token before it in the source
+    bool adjacent(size_t i) const { return endOffset(i - 1) == tokens[i].offset; }
+
+    // Whether tokens[i] is written right after the token before it, without a space
+    bool glued(size_t i) const {
+        const Token &previous = tokens[i - 1];
+        const Token &token = tokens[i];
+        if (previous.type == COMMENT) return false;
+        const std::string &last = previous.value;
+        const std::string &next = token.value;
+        bool symbol = token.type == SYMBOL;
+        bool previousSymbol = previous.type == SYMBOL;
+        if (symbol && (next == "," || next == ";" || next == ")" || next == "[" || next == "]" || next == ".")) {
+            return true;
+        }
+        if (previousSymbol && (last == "(" || last == "[" || last == ".")) return true;
+        if (symbol && next == "(") {
+            // Calls and type modifiers, but not column lists after a table name
+            static const std::set<std::string, std::less<>> tableWords = {"exists", "into", "references", "table"};
+            size_t name = i - 1;
+            while (name >= begin + 2 && tokens[name - 1].value == ".") name -= 2;
+            return previous.type == IDENTIFIER && !isOperatorWord(word(previous)) &&
+                   !(name > begin && tableWords.count(word(tokens[name - 1])));
+        }
+        // Casts are written value::type
+        if (symbol && next == ":" && i + 1 < end && tokens[i + 1].value == ":" && adjacent(i + 1)) return true;
+        if (previousSymbol && last == ":" && i >= 2 && tokens[i - 2].value == ":" && adjacent(i - 1)) return true;
+        if (!adjacent(i)) return false;
+        // Operators of several characters, $1, %TYPE, 1e5 and prefixed strings such as E'\n'
+        if (isOperator(previous) && isOperator(token)) return true;
+        if (previousSymbol && (last == "$" || last == "%")) return true;
+        if (symbol && next == "%") return true;
+        if (previous.type == LITERAL) return true;
+        if (token.type == STRING_LITERAL && previous.type == IDENTIFIER) return true;
+        // Unary signs
+        if (previousSymbol && (last == "-" || last == "+") && i - 1 > begin) {
+            const Token &before = tokens[i - 2];
+            if (before.type == SYMBOL) return before.value != ")" && before.value != "]";
+            return isOperatorWord(word(before));
+        }
+        return false;
+    }
+
+    // Whether tokens[i], the lowercase word given, starts a new clause of its statement
+    bool isClause(const std::string &lower, size_t i) const {
+        static const std::set<std::string, std::less<>> clauses = {
+            "except", "from", "group", "having", "intersect", "join", "language", "limit", "offset",
+            "order", "returning", "returns", "select", "set", "union", "values", "where", "window"};
+        static const std::set<std::string, std::less<>> joins = {"cross", "full", "inner", "left", "natural",
+                                                                 "right"};
+        bool join = joins.count(lower) > 0;
+        if (!join && !clauses.count(lower)) return false;
+        std::string previous = i > begin ? word(tokens[i - 1]) : "";
+        if (join) return i + 1 < end && tokens[i + 1].value != "(" && !joins.count(previous);
+        if (lower == "join") return !joins.count(previous) && previous != "outer";
+        if (lower == "from") return previous != "delete" && previous != "distinct";
+        return true;
+    }
+
+    // Whether the source has an empty line between tokens[i] and what precedes it
+    bool blankLineBefore(size_t i) const {
+        if (tokens[i].offset < sourceOffset) return false;
+        size_t at = std::min(tokens[i].offset - sourceOffset, source.size());
+        int newlines = 0;
+        while (at > 0 && isspace(static_cast<unsigned char>(source[at - 1]))) {
+            if (source[at - 1] == '\n') newlines++;
+            at--;
+        }
+        return newlines >= 2 && (at > 0 || sourceOffset > 0);
+    }
+
+    // Text lying in the source is borrowed by the output rather than copied
+    void write(std::string_view text) {
+        std::less_equal<const char *> before;
+        printer.text(text, before(source.data(), text.data()) &&
+                               before(text.data() + text.size(), source.data() + source.size()));
+        lineStart = false;
+        if (!levels.empty()) levels.back().empty = false;
+    }
+
+    // Space or line break between tokens[i] and what precedes it on its line
+    void separate(size_t i) {
+        if (lineStart || glued(i)) return;
+        if (levels.empty() || !levels.back().empty) printer.softBreak();
+    }
+
+    void writeToken(size_t i) {
+        separate(i);
+        write(spelling(i));
+    }
+
+    // Line break between statements. Blocks indent through the offset of the break rather
+    // than through boxes, so that no box stays open across the statements of a body.
+    void newline() {
+        if (!lineStart) printer.hardBreak(depth * style.indentWidth);
+        if (blankLine) printer.hardBreak(depth * style.indentWidth);
+        lineStart = true;
+        blankLine = false;
+    }
+
+    // Line break inside a statement
+    void lineBreak() {
+        printer.hardBreak();
+        lineStart = true;
+    }
+
+    // Writes the current token alone at the start of a line
+    void writeKeyword() {
+        newline();
+        write(spelling(position++));
+    }
+
+    // Comment between statements: kept at the end of the line it trailed, otherwise on a
+    // line of its own
+    void writeLeadingComment() {
+        const Token &comment = tokens[position];
+        if (!lineStart && position > begin && tokens[position - 1].line == comment.line) printer.text(" ");
+        else newline();
+        write(text(position++));
+    }
+
+    void openStatement() {
+        printer.begin(depth * style.indentWidth, PrettyPrinter::CONSISTENT);
+        printer.begin(style.indentWidth, PrettyPrinter::INCONSISTENT);
+        levels.push_back({false, true});
+    }
+
+    // The break after '(' belongs to the enclosing item, so what precedes a list is measured
+    // only up to the parenthesis and a list that does not fit breaks before anything else
+    void openList() {
+        printer.softBreak(0);
+        printer.begin(0, PrettyPrinter::CONSISTENT);
+        printer.begin(style.indentWidth, PrettyPrinter::INCONSISTENT);
+        levels.push_back({true, true});
+    }
+
+    void closeList() {
+        printer.end();
+        if (!lineStart) printer.softBreak(0, -style.indentWidth);
+        printer.text(")");
+        printer.end();
+        levels.pop_back();
+        lineStart = false;
+        levels.back().empty = false;
+    }
+
+    void closeLevels() {
+        for (; !levels.empty(); levels.pop_back()) {
+            printer.end();
+            printer.end();
+        }
+    }
+
+    // Ends the current item of the innermost level and starts the next one, blank spaces
+    // after the last when the line is not broken there
+    void nextItem(int blank = 1) {
+        printer.end();
+        if (!lineStart) printer.softBreak(blank);
+        printer.begin(style.indentWidth, PrettyPrinter::INCONSISTENT);
+        levels.back().empty = true;
+    }
+
+    // Index of the delimiter closing the dollar quote opened by tokens[open], or limit
+    size_t closingTag(size_t open, size_t limit) const {
+        size_t close = open + 1;
+        while (close < limit && !(tokens[close].type == SYMBOL && tokens[close].value == tokens[open].value)) close++;
+        return close;
+    }
+
+    // Source text from offset from to offset to
+    std::string_view sourceBetween(size_t from, size_t to) const {
+        if (from < sourceOffset || to < from || to - sourceOffset > source.size()) return {};
+        return source.substr(from - sourceOffset, to - from);
+    }
+
+    // Writes the dollar quote at the current token as it is in the source
+    void writeVerbatim(size_t limit) {
+        size_t open = position;
+        size_t close = closingTag(open, limit);
+        separate(open);
+        write(sourceBetween(tokens[open].offset, endOffset(close < limit ? close : limit - 1)));
+        position = std::min(close + 1, limit);
+    }
+
+    // Word of the token before tokens[i] in the statement starting at first, comments skipped
+    std::string previousWord(size_t first, size_t i) const {
+        while (i > first && tokens[i - 1].type == COMMENT) i--;
+        return i > first ? word(tokens[i - 1]) : "";
+    }
+
+    // Whether the dollar quote at tokens[i] is the code of the statement starting at first:
+    // the quote after AS in CREATE FUNCTION or PROCEDURE, or the block of a DO. Any other
+    // dollar quote is a string constant, whose bytes are data.
+    bool isBody(size_t first, size_t i) const {
+        std::string command = word(tokens[first]);
+        if (command == "do") return true;
+        if (command != "create") return false;
+        size_t kind = first + 1;
+        if (kind + 1 < end && word(tokens[kind]) == "or" && word(tokens[kind + 1]) == "replace") kind += 2;
+        if (kind >= end || (word(tokens[kind]) != "function" && word(tokens[kind]) != "procedure")) return false;
+        return previousWord(first, i) == "as";
+    }
+
+    // Writes the dollar-quoted body at the current token with its delimiters, laid out when
+    // it is PL/pgSQL or SQL and as it is otherwise. The statement is ended before the body
+    // and picked up again after it, so no box around the header spans the body.
+    void writeBody(size_t limit) {
+        size_t open = position;
+        size_t close = closingTag(open, limit);
+        writeToken(position++);
+        closeLevels();
+        if (formatBody) {
+            writeStatements(close);
+            newline();
+            openStatement();
+            if (close < limit) write(tokens[position++].value);
+        } else {
+            printer.fixedBreak();
+            write(sourceBetween(endOffset(open), endOffset(close < limit ? close : limit - 1)));
+            printer.fixedBreak();
+            position = std::min(close + 1, limit);
+            openStatement();
+            levels.back().empty = false;
+        }
+    }
+
+    // Writes the statement at the current token, up to and including its ';'. A word of
+    // stopWords outside parentheses and CASE expressions ends it early, included when
+    // includeStop and otherwise left for the caller. A dollar-quoted function body or DO
+    // block is laid out on its own when topLevel; every other dollar quote is written as it
+    // is in the source.
+    Stop writeStatement(size_t limit, std::initializer_list<const char *> stopWords, bool includeStop, bool topLevel) {
+        openStatement();
+        size_t first = position;
+        int caseDepth = 0;
+        while (position < limit) {
+            const Token &token = tokens[position];
+            if (isDollarTag(token)) {
+                if (topLevel && levels.size() == 1 && isBody(first, position)) writeBody(limit);
+                else writeVerbatim(limit);
+                continue;
+            }
+            std::string lower = word(token);
+            if (!lower.empty() && position > first) {
+                if (levels.size() == 1 && caseDepth == 0) {
+                    for (const char *stop : stopWords) {
+                        if (lower != stop) continue;
+                        if (includeStop) {
+                            nextItem();
+                            writeToken(position++);
+                        }
+                        closeLevels();
+                        return STOP_WORD;
+                    }
+                }
+                if (lower == "case") caseDepth++;
+                else if (lower == "end" && caseDepth > 0) caseDepth--;
+                if (!levels.back().empty && isClause(lower, position)) nextItem();
+            }
+            if (token.type == COMMENT) {
+                writeToken(position++);
+                if (token.value.compare(0, 2, "--") == 0) lineBreak();
+            } else if (token.type == SYMBOL && token.value == "(") {
+                writeToken(position++);
+                if (position < limit && tokens[position].value == ")") writeToken(position++);
+                else openList();
+            } else if (token.type == SYMBOL && token.value == ")" && levels.back().parenthesized) {
+                closeList();
+                position++;
+            } else if (token.type == SYMBOL && token.value == "," && levels.back().parenthesized) {
+                if (style.leadingCommas) {
+                    // The space after the comma is only written before the next item
+                    nextItem(0);
+                    writeToken(position++);
+                    printer.fixedBreak(1);
+                    levels.back().empty = true;
+                } else {
+                    writeToken(position++);
+                    nextItem();
+                }
+            } else if (token.type == SYMBOL && token.value == ";") {
+                writeToken(position++);
+                closeLevels();
+                return SEMICOLON;
+            } else {
+                writeToken(position++);
+            }
+        }
+        closeLevels();
+        return RANGE_END;
+    }
+
+    // Length of a <<label>> at the current token, or 0
+    size_t labelLength(size_t limit) const {
+        if (position + 5 > limit) return 0;
+        const Token *label = &tokens[position];
+        return label[0].value == "<" && label[1].value == "<" && label[2].type == IDENTIFIER &&
+                       label[3].value == ">" && label[4].value == ">"
+                   ? 5
+                   : 0;
+    }
+
+    // Writes the PL/pgSQL or SQL statements of a body, tokens[position, close), one per line
+    void writeStatements(size_t close) {
+        std::vector<Block> blocks;
+        auto openBlock = [&](typename Block::Kind kind) {
+            blocks.push_back({kind, 1});
+            depth++;
+        };
+        auto closeBlock = [&] {
+            depth -= blocks.back().depth;
+            blocks.pop_back();
+        };
+        // Ends the statements of the previous WHEN or ELSE branch
+        auto closeBranch = [&](Block &block) {
+            if (block.depth > 1) {
+                block.depth--;
+                depth--;
+            }
+        };
+        int baseDepth = depth;
+        while (position < close) {
+            if (blankLineBefore(position)) blankLine = true;
+            const Token &token = tokens[position];
+            std::string lower = word(token);
+            Block *block = blocks.empty() ? nullptr : &blocks.back();
+            typename Block::Kind kind = block ? block->kind : Block::DECLARE;
+            if (token.type == COMMENT) {
+                writeLeadingComment();
+            } else if (lower == "declare") {
+                writeKeyword();
+                openBlock(Block::DECLARE);
+            } else if (lower == "begin" && position + 1 < close && tokens[position + 1].value != ";") {
+                if (block && kind == Block::DECLARE) closeBlock();
+                writeKeyword();
+                openBlock(Block::BEGIN);
+            } else if (lower == "exception" && block && kind == Block::BEGIN) {
+                depth--;
+                writeKeyword();
+                depth++;
+                block->kind = Block::EXCEPTION;
+            } else if (lower == "when" && block && (kind == Block::EXCEPTION || kind == Block::CASE)) {
+                closeBranch(*block);
+                newline();
+                writeStatement(close, {"then"}, true, false);
+                block->depth++;
+                depth++;
+            } else if ((lower == "elsif" || lower == "elseif") && block && kind == Block::IF) {
+                depth--;
+                newline();
+                writeStatement(close, {"then"}, true, false);
+                depth++;
+            } else if (lower == "else" && block && kind == Block::IF) {
+                depth--;
+                writeKeyword();
+                depth++;
+            } else if (lower == "else" && block && kind == Block::CASE) {
+                closeBranch(*block);
+                writeKeyword();
+                block->depth++;
+                depth++;
+            } else if (lower == "end" && block) {
+                closeBlock();
+                newline();
+                writeStatement(close, {}, false, false);
+            } else if (lower == "if") {
+                newline();
+                if (writeStatement(close, {"then"}, true, false) == STOP_WORD) openBlock(Block::IF);
+            } else if (lower == "loop") {
+                writeKeyword();
+                openBlock(Block::LOOP);
+            } else if (lower == "while" || lower == "for" || lower == "foreach") {
+                newline();
+                if (writeStatement(close, {"loop"}, true, false) == STOP_WORD) openBlock(Block::LOOP);
+            } else if (lower == "case") {
+                newline();
+                if (writeStatement(close, {"when"}, false, false) == STOP_WORD) openBlock(Block::CASE);
+            } else if (size_t length = labelLength(close)) {
+                newline();
+                for (size_t stop = position + length; position < stop;) write(tokens[position++].value);
+            } else {
+                newline();
+                writeStatement(close, {}, false, false);
+            }
+        }
+        depth = baseDepth;
+    }
+
+    // Source text the output of the unit would be if it was already formatted: from the
+    // line after the previous statement, which holds a blank line when one separates them,
+    // up to and including the newline after the last token. Empty when there is no such text.
+    std::string_view formattedSource() const {
+        if (begin >= end || tokens[begin].offset < sourceOffset) return {};
+        size_t from = std::min(tokens[begin].offset - sourceOffset, source.size());
+        while (from > 0 && isspace(static_cast<unsigned char>(source[from - 1]))) from--;
+        if ((from > 0 || sourceOffset > 0) && from < source.size() && source[from] == '\n') from++;
+        size_t to = endOffset(end - 1) - sourceOffset;
+        if (to >= source.size() || source[to] != '\n') return {};
+        return source.substr(from, to + 1 - from);
+    }
+
+public:
+    // source holds the text of the token offsets from sourceOffset on
+    Formatter(const std::vector<Token> &tokens, std::string_view source, size_t sourceOffset, size_t begin,
+              size_t end, const FormatOptions &options)
+        : tokens(tokens), source(source), sourceOffset(sourceOffset), begin(begin), end(std::min(end, tokens.size())),
+          position(begin), style(options),
+          printer(output, options.lineWidth, style.tabs ? style.indentWidth : 0) {
+        // Only the body of a LANGUAGE plpgsql or sql function is laid out
+        const std::string *openTag = nullptr;
+        for (size_t i = begin; i + 1 < this->end; ++i) {
+            if (isDollarTag(tokens[i])) {
+                if (!openTag) openTag = &tokens[i].value;
+                else if (*openTag == tokens[i].value) openTag = nullptr;
+            } else if (!openTag && word(tokens[i]) == "language") {
+                std::string language = lowercase(tokens[i + 1].value);
+                formatBody = language == "plpgsql" || language == "sql";
+                break;
+            }
+        }
+    }
+
+    OutputBuffer format() {
+        while (position < end) {
+            if (blankLineBefore(position)) blankLine = true;
+            if (tokens[position].type == COMMENT) {
+                writeLeadingComment();
+                continue;
+            }
+            newline();
+            writeStatement(end, {}, false, true);
+        }
+        newline();
+        printer.finish();
+        // A unit that was already formatted is written straight from the source
+        std::string_view original = formattedSource();
+        if (!original.empty() && output.equals(original)) output.assignBorrowed(original);
+        return std::move(output);
+    }
+};
+
+// Token range of one top-level statement
+struct TokenRange {
+    size_t begin;
+    size_t end;
+};
+
+// Splits tokens at top-level semicolons: outside parentheses and outside dollar-quoted
+// bodies, so every CREATE FUNCTION/PROCEDURE ends up in a unit of its own. endsAtBoundary
+// tells whether the last unit was closed by such a semicolon.
+std::vector<TokenRange> splitUnits(const std::vector<Token> &tokens, bool *endsAtBoundary = nullptr);
+
+// 64-bit FNV-1a, used for content fingerprints
+uint64_t hashBytes(std::string_view data, uint64_t hash = 14695981039346656037ull);
+uint64_t hashValue(uint64_t value, uint64_t hash);
+
+// Analysis results of one top-level unit, as stored in the cache. Lines are relative to
+// the first token of the unit, so a unit that only moved is still found.
+struct CacheEntry {
+    bool loaded = false; // Read from the cache rather than produced by this run
+    int baseLine = 0;    // Absolute line of the unit when the entry was stored
+    std::vector<FunctionSignature> functions;
+    std::vector<TableDefinition> tables;
+    std::vector<TypeDefinition> types;
+    std::vector<std::string> dependencies; // Lowercase names of the functions called
+    uint64_t dependencyHash = 0;           // Signatures those names resolved to
+    std::string output;
+    std::vector<Diagnostic> diagnostics;
+};
+
+// Bump whenever a change to the lexer, parser or formatter changes analysis results
+const uint32_t analysisVersion = 9;
+
+// Content-addressed cache of per-unit analysis results on disk, one file per entry named
+// by the hash of the unit's token stream. Least recently used entries are evicted once the
+// cache grows past its size limit; reads refresh an entry's modification time.
+class AnalysisCache {
+private:
+    std::filesystem::path directory;
+    uintmax_t sizeLimit;
+    std::atomic<uint32_t> temporaryCounter{0};
+
+    std::filesystem::path entryPath(uint64_t key) const {
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+        return directory / std::string(name, 2) / std::string(name + 2);
+    }
+
+    static void writeNumber(std::string &out, uint64_t value) {
+        out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    static void writeString(std::string &out, const std::string &value) {
+        writeNumber(out, value.size());
+        out += value;
+    }
+
+    // Bounds-checked reader over an entry file; any failure makes the entry a miss
+    struct Reader {
+        std::string_view data;
+        bool ok = true;
+
+        uint64_t number() {
+            uint64_t value = 0;
+            if (data.size() < sizeof(value)) {
+                ok = false;
+                return 0;
+            }
+            memcpy(&value, data.data(), sizeof(value));
+            data.remove_prefix(sizeof(value));
+            return value;
+        }
+
+        std::string string() {
+            uint64_t length = number();
+            if (length > data.size()) {
+                ok = false;
+                return "";
+            }
+            std::string value(data.substr(0, length));
+            data.remove_prefix(length);
+            return value;
+        }
+    };
+
+    static std::string serialize(const CacheEntry &entry) {
+        std::string out;
+        writeNumber(out, analysisVersion);
+        writeNumber(out, static_cast<uint64_t>(entry.baseLine));
+        writeNumber(out, entry.functions.size());
+        for (const auto &function : entry.functions) {
+            writeString(out, function.name);
+            writeNumber(out, static_cast<uint64_t>(function.line));
+            writeNumber(out, function.requiredArguments);
+            writeNumber(out, function.variadic);
+            writeNumber(out, function.argumentTypes.size());
+            for (TypeId type : function.argumentTypes) writeString(out, typeTable().name(type));
+        }
+        writeNumber(out, entry.tables.size());
+        for (const auto &table : entry.tables) {
+            writeString(out, table.name);
+            writeNumber(out, static_cast<uint64_t>(table.line));
+            writeNumber(out, table.columns.size());
+            for (const auto &column : table.columns) {
+                writeString(out, column.name);
+                writeString(out, typeTable().name(column.type));
+            }
+        }
+        writeNumber(out, entry.types.size());
+        for (const auto &type : entry.types) {
+            writeString(out, type.name);
+            writeNumber(out, static_cast<uint64_t>(type.line));
+        }
+        writeNumber(out, entry.dependencies.size());
+        for (const auto &name : entry.dependencies) writeString(out, name);
+        writeNumber(out, entry.dependencyHash);
+        writeString(out, entry.output);
+        writeNumber(out, entry.diagnostics.size());
+        for (const auto &diagnostic : entry.diagnostics) {
+            writeNumber(out, static_cast<uint64_t>(diagnostic.line));
+            writeString(out, diagnostic.message);
+            writeNumber(out, diagnostic.offset);
+            writeNumber(out, diagnostic.length);
+            writeNumber(out, diagnostic.code);
+            writeNumber(out, diagnostic.severity);
+            writeNumber(out, diagnostic.args.size());
+            for (const auto &arg : diagnostic.args) writeString(out, arg);
+        }
+        return out;
+    }
+
+    static bool deserialize(std::string_view data, CacheEntry &entry) {
+        Reader in{data};
+        if (in.number() != analysisVersion) return false;
+        entry.baseLine = static_cast<int>(in.number());
+        // Counts are checked against the remaining bytes so a corrupt file cannot
+        // trigger a huge allocation
+        auto count = [&] {
+            uint64_t value = in.number();
+            if (value > in.data.size()) in.ok = false;
+            return in.ok ? value : 0;
+        };
+        for (uint64_t i = count(); i > 0; --i) {
+            FunctionSignature function;
+            function.name = in.string();
+            function.line = static_cast<int>(in.number());
+            function.requiredArguments = in.number();
+            function.variadic = in.number() != 0;
+            for (uint64_t a = count(); a > 0; --a) function.argumentTypes.push_back(typeTable().intern(in.string()));
+            entry.functions.push_back(std::move(function));
+        }
+        for (uint64_t i = count(); i > 0; --i) {
+            TableDefinition table{in.string(), {}, 0};
+            table.line = static_cast<int>(in.number());
+            for (uint64_t c = count(); c > 0; --c) {
+                std::string name = in.string();
+                table.columns.push_back({name, typeTable().intern(in.string())});
+            }
+            entry.tables.push_back(std::move(table));
+        }
+        for (uint64_t i = count(); i > 0; --i) {
+            TypeDefinition type{in.string(), 0};
+            type.line = static_cast<int>(in.number());
+            entry.types.push_back(std::move(type));
+        }
+        for (uint64_t i = count(); i > 0; --i) entry.dependencies.push_back(in.string());
+        entry.dependencyHash = in.number();
+        entry.output = in.string();
+        for (uint64_t i = count(); i > 0; --i) {
+            Diagnostic diagnostic;
+            diagnostic.line = static_cast<int>(in.number());
+            diagnostic.message = in.string();
+            diagnostic.offset = in.number();
+            diagnostic.length = in.number();
+            uint64_t code = in.number();
+            uint64_t severity = in.number();
+            if (code > Diagnostic::NO_OVERLOAD_TYPES || severity > Diagnostic::WARNING) in.ok = false;
+            diagnostic.code = static_cast<Diagnostic::Code>(in.ok ? code : 0);
+            diagnostic.severity = static_cast<Diagnostic::Severity>(in.ok ? severity : 0);
+            for (uint64_t a = count(); a > 0; --a) diagnostic.args.push_back(in.string());
+            entry.diagnostics.push_back(std::move(diagnostic));
+        }
+        return in.ok && in.data.empty();
+    }
+
+public:
+    std::atomic<size_t> hits{0};        // Units served entirely from the cache
+    std::atomic<size_t> revalidated{0}; // Units whose symbols were cached but whose output was redone
+    std::atomic<size_t> misses{0};
+
+    AnalysisCache(const std::string &directory, uintmax_t sizeLimit) : directory(directory), sizeLimit(sizeLimit) {}
+
+    // Key of the unit tokens[range]: token types, text and positions relative to the unit,
+    // the source text the formatter copies from, plus everything else that affects the result
+    static uint64_t unitKey(const std::vector<Token> &tokens, size_t begin, size_t end, std::string_view text,
+                            const FormatOptions &format) {
+        uint64_t hash = hashValue(analysisVersion, hashValue(builtinCatalogVersion, hashBytes("")));
+        hash = hashValue(static_cast<uint64_t>(format.lineWidth), hashBytes(text, hash));
+        hash = hashValue((static_cast<uint64_t>(format.indentWidth) << 32) | (format.keywordCase << 2) |
+                             (format.tabs << 1) | format.leadingCommas,
+                         hash);
+        int firstLine = begin < end ? tokens[begin].line : 0;
+        size_t firstOffset = begin < end ? tokens[begin].offset : 0;
+        for (size_t i = begin; i < end; ++i) {
+            hash = hashValue((static_cast<uint64_t>(tokens[i].type) << 32) |
+                                 static_cast<uint32_t>(tokens[i].line - firstLine),
+                             hash);
+            hash = hashValue(tokens[i].offset - firstOffset, hash);
+            hash = hashBytes(tokens[i].value, hashValue(tokens[i].value.size(), hash));
+        }
+        return hash;
+    }
+
+    // Hash of every overload the given names resolve to, and of the suggestion made for
+    // names that resolve to nothing
+    static uint64_t dependencyHash(const std::vector<std::string> &names, const SymbolTable &symbols) {
+        uint64_t hash = hashBytes("");
+        for (const auto &name : names) {
+            hash = hashBytes(name, hash);
+            if (!symbols.functions.contains(name)) {
+                for (const auto &match : symbols.index.suggest(name, SymbolIndex::FUNCTION | SymbolIndex::BUILTIN,
+                                                               suggestionDistance(name.size()), 1)) {
+                    hash = hashBytes(match.name, hash);
+                }
+            }
+            symbols.functions.forEachOverload(name, [&](const FunctionSignature &signature) {
+                hash = hashValue(static_cast<uint64_t>(signature.line), hash);
+                hash = hashValue(signature.requiredArguments, hashValue(signature.variadic, hash));
+                for (TypeId type : signature.argumentTypes) hash = hashBytes(typeTable().name(type), hash);
+                hash = hashValue(signature.argumentTypes.size(), hash);
+            });
+        }
+        return hash;
+    }
+
+    bool load(uint64_t key, CacheEntry &entry) {
+        std::filesystem::path path = entryPath(key);
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) return false;
+        std::ostringstream content;
+        content << file.rdbuf();
+        if (!deserialize(content.str(), entry)) return false;
+        std::error_code error;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+        entry.loaded = true;
+        return true;
+    }
+
+    // Stores through a temporary file and a rename, so concurrent writers of the same key
+    // and interrupted runs never leave a partial entry behind
+    void store(uint64_t key, const CacheEntry &entry) {
+        std::filesystem::path path = entryPath(key);
+        std::error_code error;
+        std::filesystem::create_directories(path.parent_path(), error);
+        std::filesystem::path temporary = path;
+        temporary += ".tmp" + std::to_string(getpid()) + "-" + std::to_string(temporaryCounter++);
+        {
+            std::ofstream file(temporary, std::ios::binary);
+            if (!file.is_open()) return;
+            file << serialize(entry);
+            if (!file) return;
+        }
+        std::filesystem::rename(temporary, path, error);
+        if (error) std::filesystem::remove(temporary, error);
+    }
+
+    // Removes least recently used entries until the cache is below 90% of its limit
+    void evict() {
+        std::error_code error;
+        std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> entries;
+        uintmax_t totalSize = 0;
+        for (auto it = std::filesystem::recursive_directory_iterator(directory, error);
+             !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+            if (!it->is_regular_file(error)) continue;
+            totalSize += it->file_size(error);
+            entries.push_back({it->last_write_time(error), it->path()});
+        }
+        if (totalSize <= sizeLimit) return;
+        std::sort(entries.begin(), entries.end());
+        for (const auto &entry : entries) {
+            if (totalSize <= sizeLimit / 10 * 9) break;
+            uintmax_t size = std::filesystem::file_size(entry.second, error);
+            if (!error && std::filesystem::remove(entry.second, error)) totalSize -= size;
+        }
+    }
+};
+
+// Parse state of one source file across both passes. Parsers refer to the token
+// vector, so a ParsedFile must stay in place once prepareUnits has run.
+struct ParsedFile {
+    std::string path;
+    uint64_t size = 0;        // Fingerprint of the source file as read
+    int64_t modified = 0;
+    uint64_t contentHash = 0;
+    std::string preprocessedCode;
+    size_t codeOffset = 0; // Offset of preprocessedCode in the whole file, for streamed batches
+    std::vector<Token> tokens;
+    std::vector<TokenRange> units;
+    std::vector<std::unique_ptr<Parser>> parsers; // One per unit
+    std::vector<OutputBuffer> unitOutputs;        // Second pass output per unit
+    std::vector<uint64_t> unitKeys;               // Cache key per unit
+    std::vector<std::unique_ptr<CacheEntry>> cacheEntries; // Per unit, when caching
+    std::vector<Diagnostic> diagnostics;
+    OutputBuffer formattedCode; // May borrow from preprocessedCode
+    FormatOptions format;
+    bool streamed = false; // Too large to hold in memory; read through a StatementReader
+    bool directives = false; // Has #define directives, so preprocessedCode differs from the source
+};
+
+void prepareUnits(ParsedFile &file);
+// Sets the units of file and sizes the per-unit state to match
+void prepareUnits(ParsedFile &file, std::vector<TokenRange> units);
+int unitLine(const ParsedFile &file, size_t unit);
+// Source text of a unit, from the end of the unit before it to the start of the next
+std::string_view unitSource(const ParsedFile &file, size_t unit);
+
+// First pass over one unit; with a cache, a unit found there is not parsed at all and
+// the symbols of a parsed unit are kept for storing after the second pass
+void firstPassUnit(ParsedFile &file, size_t unit, AnalysisCache *cache);
+
+// Second pass over one unit. A cached result is reused when the functions it calls still
+// resolve to the same signatures; diagnostics quote absolute lines, so a result with
+// diagnostics is only reused when the unit has not moved.
+void secondPassUnit(ParsedFile &file, size_t unit, const SymbolTable &symbols, AnalysisCache *cache);
+
+// Adds the unit symbols to the global table in source order, so the first definition of
+// each overload wins
+void mergeSymbols(ParsedFile &file, uint32_t fileIndex, SymbolTable &symbols);
+
+// Concatenates unit outputs and diagnostics in unit order, so the result matches a
+// sequential parse
+void assembleOutput(ParsedFile &file);
+
+// Preprocesses and lexes one file; a file processed on its own is lexed in parallel chunks
+void loadSource(ParsedFile &file, std::string_view sourceCode, ThreadPool &pool, bool parallelLex);
+
+// Reads a file in blocks and hands out its complete top-level statements in batches, so a
+// file of any size is processed in memory bounded by the block size plus its largest
+// statement. Each batch is lexed on its own from the line it starts on; a statement cut
+// by the end of the text read so far is carried over to the next batch.
+class StatementReader {
+private:
+    static const size_t blockSize = 256 << 10;
+    std::string path;
+    int fd;
+    Status readStatus;
+    Preprocessor preprocessor;
+    std::string block;
+    std::string partialLine;  // Read but not preprocessed yet: text after the last newline
+    std::string pending;      // Preprocessed text not handed out yet
+    size_t pendingOffset = 0; // Offset of pending in the whole preprocessed text
+    int pendingLine = 1;      // Line pending starts on
+    bool endOfFile = false;
+    uint64_t bytesRead = 0;
+    uint64_t hash = hashBytes("");
+
+    // Lexing state of the batch being assembled, so a statement spanning several blocks is
+    // lexed once rather than again on every block
+    std::vector<Token> lexed; // Tokens of pending before lexedEnd
+    size_t lexedEnd = 0;      // Where lexing resumes
+    int lexedLine = 1;        // Line at lexedEnd
+    int depth = 0;            // Parenthesis depth and open dollar-quote delimiter after lexed,
+    std::string openTag;      // as splitUnits tracks them
+    bool boundary = false;    // Whether lexed holds a top-level ';'
+
+    // Reads one block and appends its complete lines, preprocessed, to pending
+    void readBlock() {
+        block.resize(blockSize);
+        ssize_t count;
+        do {
+            count = ::read(fd, block.data(), block.size());
+        } while (count < 0 && errno == EINTR);
+        if (count <= 0) {
+            if (count < 0) readStatus = Status::failure("Cannot read file " + path);
+            endOfFile = true;
+            pending += preprocessor.process(partialLine);
+            partialLine.clear();
+            return;
+        }
+        std::string_view data(block.data(), static_cast<size_t>(count));
+        hash = hashBytes(data, hash);
+        bytesRead += data.size();
+        size_t lastNewline = data.rfind('\n');
+        if (lastNewline == std::string_view::npos) {
+            partialLine += data;
+            return;
+        }
+        partialLine += data.substr(0, lastNewline + 1);
+        pending += preprocessor.process(partialLine);
+        partialLine.assign(data.substr(lastNewline + 1));
+    }
+
+public:
+    explicit StatementReader(const std::string &path) : path(path), fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC)) {
+        if (fd < 0) {
+            readStatus = Status::failure("Cannot open file " + path);
+            endOfFile = true;
+        }
+    }
+
+    ~StatementReader() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    StatementReader(const StatementReader &) = delete;
+    StatementReader &operator=(const StatementReader &) = delete;
+
+    // Lexes pending from lexedEnd on and scans the new tokens for a top-level ';'. Pending
+    // ends with a complete line, so only a string or comment left open can go on in the
+    // next block; until the input is exhausted, lexing resumes at its start, inside the
+    // dollar quote open there.
+    void lexPending() {
+        Lexer lexer(std::string_view(pending).substr(lexedEnd), lexedLine, openTag);
+        size_t first = lexed.size();
+        lexer.lexInto(lexed);
+        for (size_t i = first; i < lexed.size(); ++i) lexed[i].offset += lexedEnd;
+        size_t resume = pending.size();
+        if (lexer.endedInsideToken() && !endOfFile) {
+            resume = lexedEnd + lexer.unterminatedOffset();
+            while (lexed.size() > first && lexed.back().offset >= resume) lexed.pop_back();
+        }
+        lexedLine += static_cast<int>(std::count(pending.begin() + static_cast<std::ptrdiff_t>(lexedEnd),
+                                                 pending.begin() + static_cast<std::ptrdiff_t>(resume), '\n'));
+        lexedEnd = resume;
+        for (size_t i = first; i < lexed.size(); ++i) {
+            const Token &token = lexed[i];
+            if (token.type != SYMBOL) continue;
+            if (token.value.size() > 1 && token.value[0] == '$') {
+                if (openTag.empty()) openTag = token.value;
+                else if (openTag == token.value) openTag.clear();
+            } else if (token.value == "(") {
+                depth++;
+            } else if (token.value == ")") {
+                depth = std::max(depth - 1, 0);
+            } else if (token.value == ";" && depth == 0 && openTag.empty()) {
+                boundary = true;
+            }
+        }
+    }
+
+    // Replaces file's tokens and units with the next batch; false once the input is exhausted
+    bool next(ParsedFile &file) {
+        lexed.clear();
+        lexedEnd = 0;
+        lexedLine = pendingLine;
+        depth = 0;
+        openTag.clear();
+        boundary = false;
+        while (!endOfFile && pending.size() < blockSize) readBlock();
+        lexPending();
+        // A statement longer than what has been read; only the text read since is lexed
+        while (!endOfFile && !boundary) {
+            readBlock();
+            lexPending();
+        }
+        std::vector<Token> tokens = std::move(lexed);
+        lexed.clear();
+        tokens.push_back({END_OF_FILE, "", lexedLine, lexedEnd});
+        bool endsAtBoundary;
+        std::vector<TokenRange> units = splitUnits(tokens, &endsAtBoundary);
+        size_t complete = endOfFile || endsAtBoundary ? units.size() : units.size() - 1;
+        if (complete == 0) return false;
+
+        // Keep the complete statements and the END_OF_FILE marker, which moves to the cut.
+        // Unless the input is exhausted the last of them ends in a ';', and the batch text is
+        // cut right after it so the whitespace that follows stays with the next statement.
+        const Token &last = tokens[units[complete - 1].end - 1];
+        size_t cut = endOfFile ? pending.size() : last.offset + 1;
+        int restLine = last.line;
+        tokens.erase(tokens.begin() + static_cast<std::ptrdiff_t>(units[complete - 1].end), tokens.end() - 1);
+        tokens.back().offset = cut;
+        if (!endOfFile) tokens.back().line = restLine;
+        for (auto &token : tokens) token.offset += pendingOffset;
+        units.resize(complete);
+
+        std::string path = std::move(file.path);
+        FormatOptions format = file.format;
+        file = ParsedFile();
+        file.path = std::move(path);
+        file.format = format;
+        file.preprocessedCode = pending.substr(0, cut);
+        file.codeOffset = pendingOffset;
+        file.tokens = std::move(tokens);
+        prepareUnits(file, std::move(units));
+        pending.erase(0, cut);
+        pendingOffset += cut;
+        pendingLine = restLine;
+        return true;
+    }
+
+    const Status &status() const { return readStatus; }
+    bool directives() const { return preprocessor.substituted(); }
+    uint64_t size() const { return bytesRead; }
+    uint64_t contentHash() const { return hash; }
+};
+
+// First pass over a streamed file, adding its symbols to symbols and setting its size and
+// content hash
+Status collectStreamed(ParsedFile &file, uint32_t fileIndex, SymbolTable &symbols, ThreadPool &pool);
+
+// Second pass over a streamed file. Formatted statements are written to outputPath as they
+// complete, in writes of at least outputFlushSize bytes; the diagnostics of each batch go
+// to report rather than being kept. outputHash, when given, receives the hashBytes of the
+// whole output.
+const size_t outputFlushSize = 1 << 20;
+Status formatStreamed(const ParsedFile &file, const std::string &outputPath, const SymbolTable &symbols,
+                      ThreadPool &pool, const std::function<void(const std::vector<Diagnostic> &)> &report,
+                      uint64_t *outputHash = nullptr);
+
+// Where the formatted code of a file first differs from the text it was formatted from
+struct FormatDifference {
+    bool found = false;
+    size_t offset = 0; // In the preprocessed text
+    int line = 1;
+    int column = 1;
+};
+
+// Compares two streams, formatted output and the text it was formatted from, fed in pieces
+// of any size and in any interleaving, and finds the first byte where they differ. The
+// stream that is ahead keeps a copy of its unmatched bytes, so pieces need not outlive
+// the call that feeds them.
+class FormatChecker {
+private:
+    std::string ahead;        // Unmatched bytes of one stream, from aheadStart on
+    size_t aheadStart = 0;
+    bool outputAhead = false; // Which stream ahead holds bytes of
+    size_t lineStart = 0;     // Offset of the line the compared bytes end on
+    FormatDifference result;  // offset, line and column track the end of the equal prefix
+
+    // Moves the position past equal bytes
+    void pass(std::string_view equal) {
+        for (size_t newline = equal.find('\n'); newline != std::string_view::npos;
+             newline = equal.find('\n', newline + 1)) {
+            result.line++;
+            lineStart = result.offset + newline + 1;
+        }
+        result.offset += equal.size();
+    }
+
+    void feed(std::string_view piece, bool isOutput) {
+        if (result.found || piece.empty()) return;
+        if (aheadStart == ahead.size()) {
+            ahead.clear();
+            aheadStart = 0;
+            outputAhead = isOutput;
+        }
+        if (outputAhead == isOutput) {
+            ahead.append(piece);
+            return;
+        }
+        std::string_view kept = std::string_view(ahead).substr(aheadStart);
+        size_t count = std::min(kept.size(), piece.size());
+        size_t equal = static_cast<size_t>(
+            std::mismatch(piece.begin(), piece.begin() + static_cast<std::ptrdiff_t>(count), kept.begin()).first -
+            piece.begin());
+        pass(piece.substr(0, equal));
+        if (equal < count) {
+            result.found = true;
+            return;
+        }
+        aheadStart += count;
+        if (count < piece.size()) feed(piece.substr(count), isOutput);
+    }
+
+public:
+    void output(const OutputBuffer &output) {
+        for (std::string_view piece : output.pieces()) feed(piece, true);
+    }
+
+    void text(std::string_view text) { feed(text, false); }
+
+    // Whether a difference has been found; once it has, nothing more needs to be fed
+    bool differs() const { return result.found; }
+
+    // Result once both streams have ended: what is left over in one of them differs too
+    FormatDifference finish() {
+        if (aheadStart < ahead.size()) result.found = true;
+        result.column = static_cast<int>(result.offset - lineStart) + 1;
+        return result;
+    }
+};
+
+// Whether a loaded file's formatted code matches its preprocessed text. Units are
+// formatted in parallel in windows of a few per thread, so formatting stops soon after
+// the first difference and only a window of output is held at a time.
+FormatDifference checkFormatted(const ParsedFile &file, ThreadPool &pool);
+
+// The same for a streamed file, batch by batch
+Status checkStreamed(const ParsedFile &file, ThreadPool &pool, FormatDifference &difference);
+
+// Output of the Formatter for tokens[begin, end), specialized for the style of options when
+// it is one of the presets, and configured at run time otherwise
+OutputBuffer formatUnit(const std::vector<Token> &tokens, std::string_view source, size_t sourceOffset, size_t begin,
+                        size_t end, const FormatOptions &options);
+
+// Formatted code of a loaded file, without validating it
+OutputBuffer formatUnvalidated(const ParsedFile &file, ThreadPool &pool);
+
+// Edit of source, which tokens and units were lexed from without preprocessing, that
+// formats the units overlapping bytes [offset, offset + length) as formatting all of it
+// would. Each unit's edit spans from the end of the unit before it to its own last token,
+// so that the newlines between units are rewritten too.
+TextEdit formatRange(const std::vector<Token> &tokens, const std::vector<TokenRange> &units, std::string_view source,
+                     size_t offset, size_t length, const FormatOptions &format, ThreadPool &pool);
+
+// Lines a[aBegin, aEnd) of one text replaced by lines b[bBegin, bEnd) of another
+struct LineChange {
+    size_t aBegin;
+    size_t aEnd;
+    size_t bBegin;
+    size_t bEnd;
+};
+
+// Lines of text, each with its '\n' except possibly the last
+std::vector<std::string_view> splitLines(std::string_view text);
+
+// Changes turning lines a into lines b, in order, found by Myers' O(ND) algorithm in
+// linear space. Very different inputs get a correct diff that may not be minimal.
+std::vector<LineChange> diffLines(const std::vector<std::string_view> &a, const std::vector<std::string_view> &b);
+
+// Unified diff of a and b under path, with context lines around the changes; nothing
+// when there are no changes
+void writeUnifiedDiff(OutputBuffer &out, std::string_view path, const std::vector<std::string_view> &a,
+                      const std::vector<std::string_view> &b, const std::vector<LineChange> &changes,
+                      size_t context = 3);
+
+// Writes every byte of pieces to fd with as few writev calls as possible
+bool writeAll(int fd, std::vector<iovec> pieces);
+bool writeAll(int fd, const OutputBuffer &content);
+Status writeFile(const std::string &path, const OutputBuffer &content);
+uint64_t hashOutput(const OutputBuffer &content, uint64_t hash = hashBytes(""));
+
+// Replacing a file through a rename, so readers see its old or its new content and never
+// part of either: output goes to a temporary file created next to path, which then takes
+// the place and the permissions of path, or those of a new file when path does not
+// exist yet. A symbolic link is followed, so the file it points to is replaced and the
+// link kept, and the content is synced to disk before the rename. The temporary file is
+// removed on failure.
+
+Status createTemporary(const std::string &path, std::string &temporary);
+Status commitTemporary(const std::string &temporary, const std::string &path);
+Status replaceFile(const std::string &path, const OutputBuffer &content);
+
+// Appends value to out as a quoted JSON string
+void appendJsonString(std::string &out, std::string_view value);
+
+// Streams diagnostics to out in one of the report formats: "path:line: error: message"
+// lines, JSON Lines, or a single SARIF 2.1.0 log. Files are numbered in the order they
+// are added, and records refer to a file by its number. Records are buffered and written
+// in batches of at least outputFlushSize bytes, so a report on any number of files holds
+// one batch at a time. Not thread-safe; a run reports from one thread.
+class DiagnosticWriter {
+public:
+    enum Format { TEXT, JSON_LINES, SARIF };
+
+private:
+    std::ostream &out;
+    Format format;
+    std::string pending;
+    std::vector<std::string> paths;
+    std::vector<char> preprocessed; // Offsets refer to the preprocessed text, so they are left out
+    size_t results = 0;
+
+    void flush(size_t threshold);
+
+public:
+    DiagnosticWriter(std::ostream &out, Format format);
+
+    // Number of a new file; offsets of a file with #define directives refer to its
+    // preprocessed text and are left out of its records
+    size_t addFile(const std::string &path, bool hasDirectives = false);
+
+    void write(size_t file, const std::vector<Diagnostic> &diagnostics);
+
+    // Completes the report; fails when a write did
+    Status finish();
+};
+
+// Consecutive units of one file dispatched as a single work item
+struct WorkItem {
+    size_t file;
+    size_t firstUnit;
+    size_t endUnit;
+    size_t cost; // Tokens covered, used as the runtime estimate
+};
+
+// Longest-processing-time-first schedule: files up to a fair share of the total work stay
+// whole, larger files are cut into runs of functions no bigger than that share (a single
+// oversized function stays alone), and items are dispatched largest first so the makespan
+// is bounded by the biggest unit rather than by dispatch order
+std::vector<WorkItem> scheduleWork(const std::vector<ParsedFile> &files, size_t workers);
+
+} // namespace plpgsql
+
+#endif
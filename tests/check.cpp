@@ -0,0 +1,609 @@
+// Checks run by make check. parser.cpp is compiled in whole, without its main, so the
+// language server can be driven through its protocol and its state inspected.
+#define PARSER_NO_MAIN
+#include "../parser.cpp"
+
+#include <future>
+
+namespace {
+
+int failures = 0;
+
+void expect(bool ok, const std::string &what) {
+    if (ok) return;
+    std::cerr << "FAIL: " << what << "\n";
+    failures++;
+}
+
+// Deterministic generator, so a failure is reproducible
+uint32_t nextRandom(uint64_t &state) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    return static_cast<uint32_t>(state >> 33);
+}
+
+// LSP position of offset in text, counting UTF-16 code units, written independently of
+// the server's mapping
+Json positionOf(const std::string &text, size_t offset) {
+    size_t lineStart = text.rfind('\n', offset == 0 ? 0 : offset - 1);
+    lineStart = lineStart == std::string::npos || offset == 0 ? 0 : lineStart + 1;
+    int line = static_cast<int>(std::count(text.begin(), text.begin() + static_cast<std::ptrdiff_t>(offset), '\n'));
+    int character = 0;
+    for (size_t i = lineStart; i < offset; ++i) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        if ((c & 0xC0) != 0x80) character += c >= 0xF0 ? 2 : 1;
+    }
+    return Json::makeObject().set("line", line).set("character", character);
+}
+
+// Moves offset back to the start of the UTF-8 character it falls in
+size_t characterStart(const std::string &text, size_t offset) {
+    while (offset > 0 && offset < text.size() && (static_cast<unsigned char>(text[offset]) & 0xC0) == 0x80) offset--;
+    return offset;
+}
+
+} // namespace
+
+// Snapshots written and loaded back; corrupt ones are refused with an error rather than
+// ending the process, and leave the symbols as they were
+void checkSnapshots() {
+    std::string directory = (std::filesystem::temp_directory_path() / "plpgsql-check-XXXXXX").string();
+    if (!mkdtemp(directory.data())) {
+        expect(false, "scratch directory created");
+        return;
+    }
+    TypeId integer = typeTable().intern("integer");
+    SymbolTable written;
+    written.functions.add({"total", {integer, integer}, 3, 1, true, 0});
+    std::string good = directory + "/good.snapshot";
+    expect(bool(writeSnapshot(good, written, {})), "snapshot written");
+    SymbolTable loaded;
+    expect(loadSnapshot(good, loaded, {}) && loaded.functions.signatures().size() == 1 &&
+               loaded.functions.signatures()[0].name == "total" && loaded.functions.signatures()[0].variadic,
+           "snapshot loaded back");
+
+    // Variadic without parameters, which parameterType could not answer
+    SymbolTable corrupt;
+    corrupt.functions.add({"f", {}, 1, 0, true, 0});
+    std::string bad = directory + "/bad.snapshot";
+    expect(bool(writeSnapshot(bad, corrupt, {})), "corrupt snapshot written");
+    SymbolTable refused;
+    Status status = loadSnapshot(bad, refused, {});
+    expect(!status && status.message.find("corrupt function signature") != std::string::npos &&
+               refused.functions.signatures().empty(),
+           "variadic function without parameters refused");
+
+    std::string truncated;
+    expect(readFile(good, truncated) && writeFile(bad, truncated.substr(0, truncated.size() - 1)),
+           "truncated snapshot written");
+    expect(!loadSnapshot(bad, refused, {}), "truncated snapshot refused");
+    expect(!loadSnapshot(directory + "/missing.snapshot", refused, {}), "missing snapshot refused");
+    std::error_code error;
+    std::filesystem::remove_all(directory, error);
+}
+
+// "Did you mean" suggestions: none for short names, and a name that is a table and a
+// function at once is found as either
+void checkSuggestions() {
+    expect(suggestionDistance(1) < 0 && suggestionDistance(2) < 0, "no suggestion for names shorter than 3");
+    expect(suggestionDistance(3) == 1 && suggestionDistance(6) == 2 && suggestionDistance(30) == 3,
+           "suggestion distance grows with the name");
+
+    SymbolTable symbols;
+    symbols.functions.add({"f", {}, 1, 0, false, 0});
+    symbols.functions.add({"orders", {}, 2, 0, false, 0});
+    symbols.tables.push_back({"Orders", {}, 3, 0});
+    indexSymbols(symbols);
+    auto suggestion = [&](const std::string &name, unsigned kinds) {
+        auto matches = symbols.index.suggest(name, kinds, suggestionDistance(name.size()), 1);
+        return matches.empty() ? std::string() : matches[0].name;
+    };
+    expect(suggestion("g", SymbolIndex::FUNCTION).empty(), "unknown g suggests nothing");
+    expect(suggestion("ordrs", SymbolIndex::FUNCTION) == "orders", "function found under a table's name");
+    expect(suggestion("ordrs", SymbolIndex::TABLE) == "Orders", "table found under a function's name");
+    auto completions = symbols.index.complete("ord", SymbolIndex::FUNCTION | SymbolIndex::TABLE, 10);
+    expect(completions.size() == 2, "a name of two kinds completes as both");
+
+    auto messages = [&](const std::string &code) {
+        std::vector<Token> tokens = Lexer(code).tokenize();
+        Parser parser(tokens);
+        parser.setSymbols(symbols);
+        parser.secondPass();
+        std::string text;
+        for (const auto &diagnostic : parser.getDiagnostics()) text += diagnostic.message + "\n";
+        return text;
+    };
+    std::string unknownG = messages("SELECT g(1);");
+    expect(unknownG.find("Unknown function 'g'") != std::string::npos &&
+               unknownG.find("Did you mean") == std::string::npos,
+           "unknown g reported without a suggestion");
+    expect(messages("SELECT ordrs();").find("Did you mean 'orders'?") != std::string::npos,
+           "unknown ordrs suggests orders");
+}
+
+// parallelFor called from inside parallelFor, on the calling thread as well as on the
+// workers, as project mode does when it collects the signatures of each file. A nested
+// call that waited for the pool would never return, so the check gives up after a while.
+void checkNestedParallelFor() {
+    ThreadPool pool(4);
+    std::atomic<size_t> calls{0};
+    auto run = std::async(std::launch::async, [&] {
+        for (int round = 0; round < 20; ++round) {
+            pool.parallelFor(64, [&](size_t) { pool.parallelFor(16, [&](size_t) { calls++; }); });
+        }
+    });
+    if (run.wait_for(std::chrono::seconds(30)) == std::future_status::timeout) {
+        std::cerr << "FAIL: nested parallelFor returns\n";
+        std::_Exit(EXIT_FAILURE);
+    }
+    expect(calls == 20 * 64 * 16, "nested parallelFor runs every call");
+}
+
+bool sameTokens(const std::vector<Token> &a, const std::vector<Token> &b) {
+    if (a.size() != b.size()) return false;
+    for (size_t t = 0; t < a.size(); ++t) {
+        if (a[t].type != b[t].type || a[t].value != b[t].value || a[t].line != b[t].line ||
+            a[t].offset != b[t].offset) {
+            std::cerr << "  token " << t << " differs: '" << a[t].value << "' and '" << b[t].value << "'\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Lexes text in parallel chunks and in streamed batches, and compares both token streams
+// with expected, the tokens of a sequential lex
+void expectSameLexing(const std::string &text, std::vector<Token> expected, ThreadPool &pool, const std::string &what) {
+    expect(sameTokens(tokenizeParallel(text, pool), expected), what + " lexed in parallel chunks");
+
+    std::string path = (std::filesystem::temp_directory_path() / "plpgsql-check-XXXXXX").string();
+    int descriptor = mkstemp(path.data());
+    expect(descriptor >= 0 && writeFile(path, text), "stream input written");
+    if (descriptor >= 0) ::close(descriptor);
+    std::vector<Token> streamed;
+    {
+        StatementReader reader(path);
+        ParsedFile batch;
+        while (reader.next(batch)) streamed.insert(streamed.end(), batch.tokens.begin(), batch.tokens.end() - 1);
+    }
+    ::unlink(path.c_str());
+    expected.pop_back();
+    expect(sameTokens(streamed, expected), what + " lexed in streamed batches");
+}
+
+// E'' strings, where a backslash escapes a quote, lexed whole and formatted as they are.
+// Most newlines of the input fall inside strings, so parallel chunks and streamed blocks
+// start inside them and must be lexed again from the E prefix.
+void checkEscapeStrings() {
+    const std::string statement = "SELECT E'it\\'s\n\\\\' || e'\\'\n' || 'x\n' AS s, E'\\\\' AS t;\n";
+    std::string text;
+    while (text.size() < (3 << 20)) text += statement;
+    // A statement longer than a streamed block, so that blocks end inside its strings
+    text += "SELECT 1";
+    while (text.size() < (4 << 20)) text += " || E'\\'\n'";
+    text += ";\n" + statement;
+
+    std::vector<Token> expected = Lexer(text).tokenize();
+    expect(expected.size() > 3 && expected[2].type == STRING_LITERAL && expected[2].value == "it\\'s\n\\\\" &&
+               expected[3].value == "|",
+           "E'' string lexed as one literal");
+
+    ThreadPool pool(4);
+    expectSameLexing(text, expected, pool, "E'' strings");
+
+    ParsedFile file;
+    loadSource(file, statement, pool, false);
+    expect(formatUnvalidated(file, pool).str() == statement, "E'' strings formatted as they are");
+}
+
+// Dollar-quoted string constants are data and come out of the formatter byte for byte;
+// only function bodies and DO blocks are laid out
+void checkDollarStrings() {
+    ThreadPool pool(2);
+    auto formatted = [&](const std::string &source) {
+        ParsedFile file;
+        loadSource(file, source, pool, false);
+        return formatUnvalidated(file, pool).str();
+    };
+    const std::pair<std::string, std::string> constants[] = {
+        {"SELECT $q$  keep   this;  spacing $q$ AS s;\n", "$q$  keep   this;  spacing $q$"},
+        {"INSERT INTO t VALUES ($$ it's  (raw ; $$);\n", "$$ it's  (raw ; $$"},
+        {"UPDATE t SET a = $x$\n  multi\n    line $x$ WHERE b = 1;\n", "$x$\n  multi\n    line $x$"},
+        {"SELECT f($$ BEGIN  x; END $$, $a$ if  (y) $a$);\n", "$$ BEGIN  x; END $$, $a$ if  (y) $a$"},
+        {"CREATE FUNCTION f(a text DEFAULT $d$  x  $d$) RETURNS text AS $$ BEGIN RETURN a; END $$ LANGUAGE plpgsql;\n",
+         "$d$  x  $d$"},
+        {"CREATE FUNCTION g() RETURNS text AS $body$ SELECT $s$  a ;  b $s$; $body$ LANGUAGE sql;\n",
+         "$s$  a ;  b $s$"},
+    };
+    for (const auto &[source, constant] : constants) {
+        std::string output = formatted(source);
+        expect(output.find(constant) != std::string::npos, "dollar-quoted constant kept in: " + source);
+        expect(formatted(output) == output, "formatting is stable for: " + source);
+    }
+    expect(formatted("CREATE FUNCTION f() RETURNS int AS $$ BEGIN  RETURN 1; END $$ LANGUAGE plpgsql;\n") ==
+               "CREATE FUNCTION f() RETURNS int AS $$\nBEGIN\n    RETURN 1;\nEND\n$$ LANGUAGE plpgsql;\n",
+           "function body laid out");
+    expect(formatted("DO $$ BEGIN  PERFORM f(1); END $$;\n") == "DO $$\nBEGIN\n    PERFORM f(1);\nEND\n$$;\n",
+           "DO block laid out");
+
+    // A quote or comment in a dollar quote ends at its closing delimiter, so the text after
+    // a constant such as $$ it's $$ is lexed as code again
+    const std::string statement = "SELECT $$ it's -- $$ AS s;\n";
+    std::vector<Token> tokens = Lexer(statement + "SELECT 1;\n").tokenize();
+    expect(tokens.size() == 14 && tokens[3].value == "'" && tokens[5].type == COMMENT && tokens[6].value == "$$" &&
+               tokens[11].value == "1",
+           "quotes and comments end at the closing dollar quote");
+
+    // Bodies longer than a parallel chunk or a streamed block, holding an odd number of
+    // apostrophes, so chunks and blocks start inside dollar quotes with their strings paired
+    // differently than a sequential lex pairs them
+    std::string text;
+    while (text.size() < (1 << 20)) text += statement;
+    for (int body = 0; body < 2; ++body) {
+        text += "CREATE FUNCTION f() RETURNS void AS $body$\nBEGIN\n";
+        while (text.size() < (static_cast<size_t>(body) + 2) << 20) text += "    RAISE NOTICE $m$ it's $m$;\n";
+        text += "END $body$ LANGUAGE plpgsql;\n";
+    }
+    text += statement;
+    expectSameLexing(text, Lexer(text).tokenize(), pool, "dollar-quoted constants");
+}
+
+// Drives a language server through JSON-RPC messages and compares its incrementally
+// edited documents with documents analyzed from scratch
+struct LanguageServerCheck {
+    ThreadPool pool{2};
+    Options options;
+    std::istringstream input;
+    std::stringstream output;
+    LanguageServer server{pool, options, input, output};
+    std::map<std::string, std::string> published; // Last diagnostics published per URI, as JSON
+
+    void notify(const std::string &method, Json params) {
+        server.handle(Json::makeObject().set("jsonrpc", "2.0").set("method", method).set("params", std::move(params)));
+        // Collect what the server wrote in response
+        std::string written = output.str();
+        output.str("");
+        for (size_t at = 0; (at = written.find("\r\n\r\n", at)) != std::string::npos;) {
+            size_t header = written.rfind("Content-Length: ", at);
+            size_t length = std::stoul(written.substr(header + 16, at - header - 16));
+            Json message;
+            expect(Json::parse(std::string_view(written).substr(at + 4, length), message), "server output parses");
+            if (message["method"].string == "textDocument/publishDiagnostics") {
+                published[message["params"]["uri"].string] = message["params"]["diagnostics"].dump();
+            }
+            at += 4 + length;
+        }
+    }
+
+    void open(const std::string &uri, const std::string &text) {
+        notify("textDocument/didOpen", Json::makeObject().set(
+                                           "textDocument", Json::makeObject().set("uri", uri).set("text", text)));
+    }
+
+    // Replaces text[start, end) with replacement in the document and in text
+    void change(const std::string &uri, std::string &text, size_t start, size_t end, const std::string &replacement) {
+        Json range = Json::makeObject().set("start", positionOf(text, start)).set("end", positionOf(text, end));
+        Json changes = Json::makeArray();
+        changes.push(Json::makeObject().set("range", range).set("text", replacement));
+        notify("textDocument/didChange", Json::makeObject()
+                                             .set("textDocument", Json::makeObject().set("uri", uri))
+                                             .set("contentChanges", changes));
+        text.replace(start, end - start, replacement);
+    }
+
+    const Document &document(const std::string &uri) { return server.documents[server.byUri.at(uri)]; }
+
+    // The edited document must hold exactly what analyzing text from scratch gives
+    void compare(const std::string &uri, const std::string &text, const std::string &what) {
+        const Document &edited = document(uri);
+        expect(edited.text.str() == text, what + ": text");
+        Document fresh;
+        fresh.uri = uri;
+        fresh.text.assign(text);
+        server.analyze(fresh);
+        for (size_t u = 0; u < fresh.units.size(); ++u) server.validate(fresh, u);
+
+        bool tokensEqual = edited.tokens.size() == fresh.tokens.size();
+        for (size_t t = 0; tokensEqual && t < fresh.tokens.size(); ++t) {
+            const Token &a = edited.tokens[t];
+            const Token &b = fresh.tokens[t];
+            tokensEqual = a.type == b.type && a.value == b.value && a.line == b.line && a.offset == b.offset;
+        }
+        expect(tokensEqual, what + ": tokens");
+        bool unitsEqual = edited.units.size() == fresh.units.size();
+        for (size_t u = 0; unitsEqual && u < fresh.units.size(); ++u) {
+            unitsEqual = edited.units[u].begin == fresh.units[u].begin && edited.units[u].end == fresh.units[u].end;
+            const auto &a = edited.unitStates[u].functions;
+            const auto &b = fresh.unitStates[u].functions;
+            unitsEqual = unitsEqual && a.size() == b.size();
+            for (size_t f = 0; unitsEqual && f < a.size(); ++f) {
+                unitsEqual = a[f].name == b[f].name && a[f].line == b[f].line;
+            }
+        }
+        expect(unitsEqual, what + ": units");
+        bool diagnosticsEqual = unitsEqual;
+        for (size_t u = 0; diagnosticsEqual && u < fresh.units.size(); ++u) {
+            const auto &a = edited.unitStates[u].diagnostics;
+            const auto &b = fresh.unitStates[u].diagnostics;
+            diagnosticsEqual = a.size() == b.size();
+            for (size_t d = 0; diagnosticsEqual && d < a.size(); ++d) {
+                diagnosticsEqual = a[d].line == b[d].line && a[d].offset == b[d].offset &&
+                                   a[d].length == b[d].length && a[d].code == b[d].code &&
+                                   a[d].message == b[d].message && a[d].args == b[d].args;
+            }
+        }
+        expect(diagnosticsEqual, what + ": diagnostics");
+
+        // What the client was sent must match too, as published for the same text opened fresh
+        open("file:///fresh.sql", text);
+        expect(published[uri] == published["file:///fresh.sql"], what + ": published diagnostics");
+        notify("textDocument/didClose", Json::makeObject().set("textDocument", Json::makeObject().set(
+                                                                                  "uri", "file:///fresh.sql")));
+    }
+
+    // offsetAt and positionAt against positionOf at every character of text
+    void comparePositions(const std::string &uri, const std::string &text) {
+        const Document &edited = document(uri);
+        bool equal = true;
+        for (size_t offset = 0; equal && offset <= text.size(); ++offset) {
+            if (characterStart(text, offset) != offset) continue;
+            Json position = positionOf(text, offset);
+            equal = server.offsetAt(edited, position) == offset &&
+                    server.positionAt(edited, offset).dump() == position.dump();
+            if (!equal) std::cerr << "  at offset " << offset << ", position " << position.dump() << "\n";
+        }
+        expect(equal, "UTF-16 positions map to offsets and back");
+    }
+};
+
+void checkLanguageServer() {
+    LanguageServerCheck check;
+    const std::string uri = "file:///edited.sql";
+    std::string text = "CREATE FUNCTION greet(name text) RETURNS text AS $$\n"
+                       "BEGIN\n"
+                       "    RETURN 'h\xC3\xA9llo \xE2\x82\xACuro \xF0\x9F\x98\x80 ' || name; "
+                       "-- \xC3\xBCn\xC3\xAF" "code\n"
+                       "END;\n"
+                       "$$ LANGUAGE plpgsql;\n"
+                       "SELECT greet('w\xC3\xB6rld'); SELECT greet(1, 2);\n"
+                       "CREATE FUNCTION total(a int, b int) RETURNS int AS $$\n"
+                       "DECLARE s int;\n"
+                       "BEGIN\n"
+                       "    s := a + b;\n"
+                       "    PERFORM greet('x', 'y');\n"
+                       "    RETURN s;\n"
+                       "END;\n"
+                       "$$ LANGUAGE plpgsql;\n"
+                       "SELECT total(1);\n";
+    check.notify("initialize", Json::makeObject().set("capabilities", Json::makeObject()));
+    check.open(uri, text);
+    check.compare(uri, text, "opened document");
+    check.comparePositions(uri, text);
+
+    // At a unit boundary: right after the ';' of a statement
+    size_t boundary = text.find(" SELECT greet(1, 2)");
+    check.change(uri, text, boundary, boundary, "\nSELECT nosuch(1);");
+    check.compare(uri, text, "statement inserted at a unit boundary");
+    // Removing a statement's ';' joins it with the next one, and putting it back splits them
+    size_t semicolon = text.find("');\nSELECT nosuch") + 2;
+
+    check.change(uri, text, semicolon, semicolon + 1, "");
+    check.compare(uri, text, "unit boundary removed");
+    check.change(uri, text, semicolon, semicolon, ";");
+    check.compare(uri, text, "unit boundary restored");
+
+    // Inside a $$ body
+    size_t body = text.find("    PERFORM greet('x', 'y');");
+    check.change(uri, text, body, body, "    PERFORM lower('\xE2\x82\xAC', 2);\n");
+    check.compare(uri, text, "statement inserted in a $$ body");
+    size_t name = text.find("|| name;") + 3;
+    check.change(uri, text, name, name + 4, "upper(name)");
+    check.compare(uri, text, "call inserted after multibyte characters");
+    check.comparePositions(uri, text);
+
+    // Opening a string makes every later unit change, and closing it again restores them
+    size_t quote = text.find("SELECT nosuch");
+    check.change(uri, text, quote, quote, "'");
+    check.compare(uri, text, "string opened");
+    check.change(uri, text, quote, quote + 1, "");
+    check.compare(uri, text, "string closed");
+
+    // A signature change reaches the callers
+    size_t parameter = text.find(", b int)");
+    check.change(uri, text, parameter, parameter + 7, "");
+    check.compare(uri, text, "signature changed");
+
+    // An edit across two units, then random edits
+    size_t from = text.find("greet('w");
+    size_t to = text.find("CREATE FUNCTION total");
+    check.change(uri, text, from, to, "lower('x');\n");
+    check.compare(uri, text, "edit across units");
+    const char *pieces[] = {";", "\n", "'", "$$", "/*", "*/", "--", "(", ")", "x", "\xC3\xA9", "\xF0\x9F\x98\x80",
+                            "BEGIN ", "PERFORM greet(1);\n", "SELECT total(1, 2);\n",
+                            "CREATE FUNCTION z(a int) RETURNS int AS $$ BEGIN RETURN a; END; $$ LANGUAGE plpgsql;\n"};
+    uint64_t state = 1;
+    for (int step = 0; step < 300; ++step) {
+        size_t start = characterStart(text, nextRandom(state) % (text.size() + 1));
+        size_t end = characterStart(text, std::min(text.size(), start + nextRandom(state) % 12));
+        std::string replacement = nextRandom(state) % 5 == 0 ? "" : pieces[nextRandom(state) % std::size(pieces)];
+        check.change(uri, text, start, std::max(start, end), replacement);
+        check.compare(uri, text, "random edit " + std::to_string(step));
+        if (failures > 0) break;
+    }
+    check.comparePositions(uri, text);
+}
+
+// FormatChecker fed two streams split at every pair of offsets, in several interleavings,
+// against the first difference std::mismatch finds in the whole streams
+void checkFormatChecker() {
+    const std::pair<std::string, std::string> pairs[] = {
+        {"", ""},
+        {"", "SELECT 1;\n"},
+        {"SELECT 1;\n", ""},
+        {"SELECT 1;\nSELECT 2;\n", "SELECT 1;\nSELECT 2;\n"},
+        {"SELECT 1;\nSELECT 2;\n", "select 1;\nSELECT 2;\n"},
+        {"SELECT 1;\nSELECT 2;\n", "SELECT 1;\nSELECT  2;\n"},
+        {"SELECT 1;\nSELECT 2;\n", "SELECT 1;\n\nSELECT 2;\n"},
+        {"SELECT 1;\nSELECT 2;\n", "SELECT 1;\nSELECT 2;"},
+        {"SELECT 1;\n\nSELECT 2;", "SELECT 1;\n\nSELECT 2;\nSELECT 3;\n"},
+        {"SELECT 1;\n\n\xC3\xA9\n", "SELECT 1;\n\n\xC3\xA8\n"},
+    };
+    for (const auto &[output, text] : pairs) {
+        size_t count = std::min(output.size(), text.size());
+        size_t offset = static_cast<size_t>(
+            std::mismatch(output.begin(), output.begin() + static_cast<std::ptrdiff_t>(count), text.begin()).first -
+            output.begin());
+        std::string_view prefix = std::string_view(output).substr(0, offset);
+        size_t lineStart = prefix.rfind('\n');
+        lineStart = lineStart == std::string_view::npos ? 0 : lineStart + 1;
+        FormatDifference expected;
+        expected.found = offset < count || output.size() != text.size();
+        expected.offset = offset;
+        expected.line = 1 + static_cast<int>(std::count(prefix.begin(), prefix.end(), '\n'));
+        expected.column = static_cast<int>(offset - lineStart) + 1;
+
+        bool equal = true;
+        for (size_t i = 0; equal && i <= output.size(); ++i) {
+            for (size_t j = 0; equal && j <= text.size(); ++j) {
+                // Pieces of output are 0 and 2, pieces of text 1 and 3
+                std::string_view pieces[] = {std::string_view(output).substr(0, i), std::string_view(text).substr(0, j),
+                                             std::string_view(output).substr(i), std::string_view(text).substr(j)};
+                const int orders[][4] = {{0, 1, 2, 3}, {1, 0, 3, 2}, {0, 2, 1, 3}, {1, 3, 0, 2}, {0, 1, 3, 2}};
+                for (const auto &order : orders) {
+                    FormatChecker checker;
+                    for (int piece : order) {
+                        // A piece is copied into a buffer of its own, which is gone once fed
+                        if (piece % 2 == 0) {
+                            checker.output(OutputBuffer(std::string(pieces[piece])));
+                        } else {
+                            std::string copy(pieces[piece]);
+                            checker.text(copy);
+                        }
+                    }
+                    FormatDifference actual = checker.finish();
+                    equal = actual.found == expected.found &&
+                            (!expected.found || (actual.offset == expected.offset && actual.line == expected.line &&
+                                                 actual.column == expected.column));
+                    if (!equal) {
+                        std::cerr << "  output split at " << i << ", text split at " << j << ", order " << order[0]
+                                  << order[1] << order[2] << order[3] << "\n";
+                        break;
+                    }
+                }
+            }
+        }
+        expect(equal, "FormatChecker finds the first difference of \"" + output + "\" and \"" + text + "\"");
+    }
+}
+
+// Writes before to a scratch directory, applies the unified diff from before to after with
+// patch -p0 and expects after back
+void checkPatch(const std::string &before, const std::string &after, const std::string &what) {
+    std::vector<std::string_view> a = splitLines(before);
+    std::vector<std::string_view> b = splitLines(after);
+    std::vector<LineChange> changes = diffLines(a, b);
+    OutputBuffer diff;
+    writeUnifiedDiff(diff, "file.sql", a, b, changes);
+    if (changes.empty()) {
+        expect(before == after && diff.str().empty(), what + ": no diff only for equal texts");
+        return;
+    }
+    std::string directory = (std::filesystem::temp_directory_path() / "plpgsql-check-XXXXXX").string();
+    if (!mkdtemp(directory.data())) {
+        expect(false, what + ": scratch directory created");
+        return;
+    }
+    expect(writeFile(directory + "/file.sql", before) && writeFile(directory + "/file.diff", diff),
+           what + ": files written");
+    std::string command = "cd '" + directory + "' && patch -s -p0 < file.diff";
+    expect(std::system(command.c_str()) == 0, what + ": patch applies");
+    // patch may remove a file it empties
+    std::string patched;
+    if (std::filesystem::exists(directory + "/file.sql")) readFile(directory + "/file.sql", patched);
+    expect(patched == after, what + ": patched text equals the formatted one");
+    std::error_code error;
+    std::filesystem::remove_all(directory, error);
+}
+
+// Diffs written by --patch, on fixtures chosen for the edges of the unified format and on a
+// pair too different for the diff to be minimal
+void checkDiff() {
+    ThreadPool pool(2);
+    auto formatted = [&](const std::string &source) {
+        ParsedFile file;
+        loadSource(file, source, pool, false);
+        return formatUnvalidated(file, pool).str();
+    };
+    const std::string function =
+        "create function f(a int) returns int as $$ begin return a; end; $$ language plpgsql;\n";
+    const std::string sources[] = {
+        "",
+        "select 1;",
+        "select  1;\nSELECT 2;\nSELECT 3;\nSELECT 4;\nSELECT 5;\nSELECT 6;\nSELECT 7;\nSELECT 8;\n",
+        "SELECT 1;\nSELECT 2;\nSELECT 3;\nSELECT 4;\nSELECT 5;\nSELECT 6;\nSELECT 7;\nselect  8;",
+        "select  1;\nSELECT 2;\nSELECT 3;\nSELECT 4;\nSELECT 5;\nSELECT 6;\nSELECT 7;\nselect  8;\n",
+        function + "SELECT f(1);\n" + function,
+        "\n\n\nSELECT 1;\n\n\n",
+    };
+    for (size_t i = 0; i < std::size(sources); ++i) {
+        checkPatch(sources[i], formatted(sources[i]), "formatted fixture " + std::to_string(i));
+    }
+
+    // Texts the formatter does not produce: emptied, with the final newline removed or added
+    const std::string text = "a\nb\nc\nd\ne\nf\ng\nh\n";
+    checkPatch(text, "", "file emptied");
+    checkPatch("", text, "empty file filled");
+    checkPatch(text, text.substr(0, text.size() - 1), "final newline removed");
+    checkPatch(text.substr(0, text.size() - 1), text, "final newline added");
+    checkPatch(text.substr(0, text.size() - 1), "a\nb\nc\nd\ne\nf\ng\nx", "last line changed without newline");
+    checkPatch(text, "x\n" + text.substr(2), "first line changed");
+    checkPatch(text, text.substr(0, text.size() - 2) + "x\n", "last line changed");
+    checkPatch(text, "x\n" + text.substr(2, text.size() - 4) + "x", "first and last lines changed");
+
+    // Thousands of scattered changes, past the cost where diffLines gives up on a minimal diff
+    uint64_t state = 2;
+    std::string before, after;
+    for (int line = 0; line < 6000; ++line) {
+        std::string content = "line " + std::to_string(line) + "\n";
+        uint32_t choice = nextRandom(state) % 4;
+        if (choice != 1) before += content;
+        if (choice != 2) after += choice == 3 ? "changed " + content : content;
+    }
+    checkPatch(before, after, "changes past the fallback threshold");
+}
+
+// A malformed Content-Length is answered with a parse error, and the session goes on
+void checkLanguageServerFraming() {
+    auto frame = [](const std::string &body) {
+        return "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    };
+
+    ThreadPool pool(1);
+    Options options;
+    std::istringstream input("Content-Length: abc\r\n\r\n" +
+                             frame(R"({"jsonrpc":"2.0","id":1,"method":"initialize","params":{}})") +
+                             frame(R"({"jsonrpc":"2.0","id":2,"method":"shutdown"})") +
+                             frame(R"({"jsonrpc":"2.0","method":"exit"})"));
+    std::stringstream output;
+    int status = LanguageServer(pool, options, input, output).run();
+    expect(status == EXIT_SUCCESS, "session with a malformed header ends cleanly");
+    expect(output.str().find("-32700") != std::string::npos, "malformed header is answered with -32700");
+    expect(output.str().find("\"id\":2") != std::string::npos, "requests after a malformed header are answered");
+}
+
+int main() {
+    checkNestedParallelFor();
+    checkEscapeStrings();
+    checkSnapshots();
+    checkSuggestions();
+    checkLanguageServer();
+    checkLanguageServerFraming();
+    checkDiff();
+    checkDollarStrings();
+    checkFormatChecker();
+    if (failures > 0) {
+        std::cerr << failures << " checks failed\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << "All checks passed\n";
+    return EXIT_SUCCESS;
+}